@@ -24,6 +24,8 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/system_properties.h>
 #include <unistd.h>
 
 #include <log/log.h>
@@ -54,6 +56,7 @@
 #define CODEC_SAMPLING_RATE 48000
 #define CHANNEL_STEREO 2
 #define MIN_WRITE_SLEEP_US      5000
+#define ARC_DEVICE_PROPERTY "vendor.audio.hdmi.arc_device"
 
 struct stub_stream_in {
     struct audio_stream_in stream;
@@ -83,14 +86,45 @@ struct alsa_stream_out {
     bool unavailable;
     int standby;
     snd_pcm_uframes_t written;
+
+    /* ALSA device the pcm was opened on, and the ARC property serial then */
+    char device_name[PROPERTY_VALUE_MAX];
+    uint32_t arc_serial;
 };
 
-static void get_alsa_device_name(char *name) {
+/* looked up once the CEC HAL first sets it */
+static const prop_info *arc_prop;
+
+static uint32_t get_arc_serial(void) {
+    if (arc_prop == NULL)
+        arc_prop = __system_property_find(ARC_DEVICE_PROPERTY);
+    return arc_prop ? __system_property_serial(arc_prop) : 0;
+}
+
+static void get_alsa_device_name(char *name, size_t len) {
     char hdmi_device[PROPERTY_VALUE_MAX];
     property_get("persist.audio.hdmi.device", hdmi_device, "vc4hdmi0");
 
+    // prefer the port with an active audio return channel, set by the CEC HAL
+    char arc_device[PROPERTY_VALUE_MAX];
+    if (property_get(ARC_DEVICE_PROPERTY, arc_device, "") > 0)
+        strlcpy(hdmi_device, arc_device, sizeof(hdmi_device));
+
     // use card configured in vc4-hdmi.conf to get IEC958 subframe conversion
-    sprintf(name, "default:CARD=%s", hdmi_device);
+    snprintf(name, len, "default:CARD=%s", hdmi_device);
+}
+
+/* whether the CEC HAL moved the audio return channel since the pcm was opened */
+static bool arc_device_changed(struct alsa_stream_out *out)
+{
+    uint32_t serial = get_arc_serial();
+    if (serial == out->arc_serial)
+        return false;
+    out->arc_serial = serial;
+
+    char device_name[PROPERTY_VALUE_MAX];
+    get_alsa_device_name(device_name, sizeof(device_name));
+    return strcmp(device_name, out->device_name) != 0;
 }
 
 /* must be called with hw device and output stream mutexes locked */
@@ -101,14 +135,15 @@ static int start_output_stream(struct alsa_stream_out *out)
     if (out->unavailable)
         return -ENODEV;
 
-    char device_name[PROPERTY_VALUE_MAX];
-    get_alsa_device_name(device_name);
-    ALOGI("start_output_stream: %s", device_name);
+    // read the serial first, a change while opening then reroutes again
+    out->arc_serial = get_arc_serial();
+    get_alsa_device_name(out->device_name, sizeof(out->device_name));
+    ALOGI("start_output_stream: %s", out->device_name);
 
     int r;
     snd_pcm_t *pcm;
 
-    if ((r = snd_pcm_open(&pcm, device_name, SND_PCM_STREAM_PLAYBACK, 0) < 0)) {
+    if ((r = snd_pcm_open(&pcm, out->device_name, SND_PCM_STREAM_PLAYBACK, 0) < 0)) {
         ALOGE("cannot open pcm_out driver: %s", snd_strerror(r));
         adev->active_output = NULL;
         out->unavailable = true;
@@ -340,6 +375,10 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
      */
     pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
+    if (!out->standby && arc_device_changed(out)) {
+        ALOGI("out_write: audio return channel moved, reopening");
+        do_output_standby(out);
+    }
     if (out->standby) {
         ret = start_output_stream(out);
         if (ret != 0) {
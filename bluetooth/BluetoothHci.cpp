@@ -21,6 +21,8 @@
 
 #include "log/log.h"
 
+#include <cstring>
+
 using namespace ::android::hardware::bluetooth::hci;
 using namespace ::android::hardware::bluetooth::async;
 using aidl::android::hardware::bluetooth::Status;
@@ -35,6 +37,11 @@ class BluetoothDeathRecipient {
 
   void LinkToDeath(const std::shared_ptr<IBluetoothHciCallbacks>& cb) {
     mCb = cb;
+    // An in-process client, such as bluetooth_hci_bench_rpi, cannot die
+    // on its own.
+    if (!AIBinder_isRemote(mCb->asBinder().get())) {
+      return;
+    }
     clientDeathRecipient_ = AIBinder_DeathRecipient_new(OnDeath);
     auto linkToDeathReturnStatus = AIBinder_linkToDeath(
         mCb->asBinder().get(), clientDeathRecipient_, this /* cookie */);
@@ -81,6 +88,11 @@ BluetoothHci::BluetoothHci() {
   mDeathRecipient = std::make_shared<BluetoothDeathRecipient>(this);
 }
 
+BluetoothHci::BluetoothHci(std::unique_ptr<HciTransport> transport)
+    : BluetoothHci() {
+  management_ = std::move(transport);
+}
+
 ndk::ScopedAStatus BluetoothHci::initialize(
     const std::shared_ptr<IBluetoothHciCallbacks>& cb) {
   ALOGI(__func__);
@@ -107,13 +119,24 @@ ndk::ScopedAStatus BluetoothHci::initialize(
     return ndk::ScopedAStatus::ok();
   }
 
+  uint64_t start = HciStats::Now();
   mCb = cb;
-  management_.reset(new NetBluetoothMgmt);
+  if (management_ == nullptr) {
+    // Kept across sessions, it caches the rfkill and HCI interface lookups.
+    management_ = HciTransport::Create();
+  }
   mFd = management_->openHci();
+  if (mFd >= 0) {
+    mTxQueue = std::make_shared<HciTxQueue>(mFd, &mSnoop, &mStats);
+    if (!mTxQueue->Start()) {
+      mTxQueue.reset();
+      management_->closeHci();
+      mFd = -1;
+    }
+  }
   if (mFd < 0) {
-    management_.reset();
-
     ALOGI("Unable to open Linux interface.");
+    mStats.OnOpen(HciStats::Now() - start, false);
     mState = HalState::READY;
     cb->initializationComplete(Status::UNABLE_TO_OPEN_INTERFACE);
     return ndk::ScopedAStatus::ok();
@@ -121,34 +144,53 @@ ndk::ScopedAStatus BluetoothHci::initialize(
 
   mDeathRecipient->LinkToDeath(mCb);
 
-  mH4 = std::make_shared<H4Protocol>(
-      mFd,
-      [](const std::vector<uint8_t>& /* raw_command */) {
-        LOG_ALWAYS_FATAL("Unexpected command!");
-      },
-      [this](const std::vector<uint8_t>& raw_acl) {
-        mCb->aclDataReceived(raw_acl);
-      },
-      [this](const std::vector<uint8_t>& raw_sco) {
-        mCb->scoDataReceived(raw_sco);
-      },
-      [this](const std::vector<uint8_t>& raw_event) {
-        mCb->hciEventReceived(raw_event);
-      },
-      [this](const std::vector<uint8_t>& raw_iso) {
-        mCb->isoDataReceived(raw_iso);
+  mReader = std::make_shared<HciReader>(
+      mFd, &mSnoop,
+      [this](PacketType type, std::vector<uint8_t>& packet) {
+        mStats.OnReceived(type, packet.size());
+        if (type == PacketType::EVENT) {
+          mTxQueue->OnEvent(packet);
+        }
+        mDispatcher->Post(type, packet);
       },
       [this]() {
         ALOGI("HCI socket device disconnected");
+        mStats.OnDisconnect();
         mFdWatcher.StopWatchingFileDescriptors();
       });
-  mFdWatcher.WatchFdForNonBlockingReads(mFd,
-                                        [this](int) { mH4->OnDataReady(); });
+  mDispatcher = std::make_shared<HciDispatcher>(
+      mReader->pool(),
+      [this](PacketType type, const std::vector<uint8_t>& packet) {
+        switch (type) {
+          case PacketType::ACL_DATA:
+            mCb->aclDataReceived(packet);
+            break;
+          case PacketType::SCO_DATA:
+            mCb->scoDataReceived(packet);
+            break;
+          case PacketType::EVENT:
+            mCb->hciEventReceived(packet);
+            break;
+          case PacketType::ISO_DATA:
+            mCb->isoDataReceived(packet);
+            break;
+          case PacketType::COMMAND:
+            LOG_ALWAYS_FATAL("Unexpected command!");
+            break;
+          default:
+            ALOGE("Unexpected packet type %d", static_cast<int>(type));
+            break;
+        }
+      });
+  mDispatcher->Start();
+  mFdWatcher.WatchFdForNonBlockingReads(
+      mFd, [this](int) { mReader->OnDataReady(); });
 
   {
     std::lock_guard<std::mutex> guard(mStateMutex);
     mState = HalState::ONE_CLIENT;
   }
+  mStats.OnOpen(HciStats::Now() - start, true);
   ALOGI("initialization complete");
   auto status = mCb->initializationComplete(Status::SUCCESS);
   if (!status.isOk()) {
@@ -175,19 +217,61 @@ ndk::ScopedAStatus BluetoothHci::close() {
     }
     mState = HalState::CLOSING;
   }
+  uint64_t start = HciStats::Now();
 
   mFdWatcher.StopWatchingFileDescriptors();
 
+  // Release the writer and any blocked senders before the socket goes away
+  mTxQueue->Stop();
+  mDispatcher->Stop();
+
   management_->closeHci();
 
   {
     std::lock_guard<std::mutex> guard(mStateMutex);
     mState = HalState::READY;
-    mH4 = nullptr;
+    mDispatcher = nullptr;
+    mReader = nullptr;
+    mTxQueue = nullptr;
   }
+  mStats.OnClose(HciStats::Now() - start);
   return ndk::ScopedAStatus::ok();
 }
 
+// "dumpsys android.hardware.bluetooth.IBluetoothHci/default --snoop" writes
+// the HAL snoop ring as a btsnoop file.
+binder_status_t BluetoothHci::dump(int fd, const char** args,
+                                   uint32_t numArgs) {
+  if (numArgs > 0 && strcmp(args[0], "--snoop") == 0) {
+    mSnoop.WriteBtsnoop(fd);
+    return STATUS_OK;
+  }
+
+  dprintf(fd, "HCI snoop ring: %s, %llu packets recorded, last %zu kept\n",
+          !mSnoop.enabled() ? "disabled"
+          : mSnoop.filtered() ? "filtered"
+                              : "enabled",
+          static_cast<unsigned long long>(mSnoop.recorded()),
+          HciSnoop::kEntries);
+  dprintf(fd, "  use --snoop to write it out in btsnoop format\n");
+  mStats.Dump(fd);
+
+  std::shared_ptr<HciTxQueue> txQueue;
+  HciTransport* transport;
+  {
+    std::lock_guard<std::mutex> guard(mStateMutex);
+    txQueue = mTxQueue;
+    transport = mState == HalState::INITIALIZING ? nullptr : management_.get();
+  }
+  if (transport != nullptr) {
+    transport->dump(fd);
+  }
+  if (txQueue != nullptr) {
+    txQueue->Dump(fd);
+  }
+  return STATUS_OK;
+}
+
 ndk::ScopedAStatus BluetoothHci::sendHciCommand(
     const std::vector<uint8_t>& packet) {
   return send(PacketType::COMMAND, packet);
@@ -215,12 +299,18 @@ ndk::ScopedAStatus BluetoothHci::send(PacketType type,
     return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
   }
 
-  std::lock_guard<std::mutex> guard(mStateMutex);
-  if (mH4 == nullptr) {
-    return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+  std::shared_ptr<HciTxQueue> txQueue;
+  {
+    std::lock_guard<std::mutex> guard(mStateMutex);
+    if (mState == HalState::CLOSING || mTxQueue == nullptr) {
+      return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+    }
+    txQueue = mTxQueue;
   }
 
-  mH4->Send(type, v);
+  if (!txQueue->Enqueue(type, v)) {
+    return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+  }
   return ndk::ScopedAStatus::ok();
 }
 
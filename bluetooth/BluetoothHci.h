@@ -21,8 +21,12 @@
 #include <aidl/android/hardware/bluetooth/IBluetoothHciCallbacks.h>
 
 #include "async_fd_watcher.h"
-#include "h4_protocol.h"
-#include "net_bluetooth_mgmt.h"
+#include "hci_dispatcher.h"
+#include "hci_reader.h"
+#include "hci_snoop.h"
+#include "hci_stats.h"
+#include "hci_transport.h"
+#include "hci_tx_queue.h"
 
 namespace aidl::android::hardware::bluetooth::impl {
 
@@ -32,6 +36,8 @@ class BluetoothDeathRecipient;
 class BluetoothHci : public BnBluetoothHci {
  public:
   BluetoothHci();
+  // Uses the given transport instead of the one from HciTransport::Create().
+  explicit BluetoothHci(std::unique_ptr<HciTransport> transport);
 
   ndk::ScopedAStatus initialize(
       const std::shared_ptr<IBluetoothHciCallbacks>& cb) override;
@@ -47,11 +53,18 @@ class BluetoothHci : public BnBluetoothHci {
 
   ndk::ScopedAStatus close() override;
 
+  binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
  private:
   int mFd{-1};
   std::shared_ptr<IBluetoothHciCallbacks> mCb = nullptr;
 
-  std::shared_ptr<::android::hardware::bluetooth::hci::H4Protocol> mH4;
+  std::shared_ptr<HciReader> mReader;
+  std::shared_ptr<HciDispatcher> mDispatcher;
+  HciSnoop mSnoop;
+  HciStats mStats;
+  // Outbound path, pinned by send() so the write happens outside mStateMutex
+  std::shared_ptr<HciTxQueue> mTxQueue;
 
   std::shared_ptr<BluetoothDeathRecipient> mDeathRecipient;
 
@@ -60,7 +73,7 @@ class BluetoothHci : public BnBluetoothHci {
   [[nodiscard]] ndk::ScopedAStatus send(
       ::android::hardware::bluetooth::hci::PacketType type,
       const std::vector<uint8_t>& packet);
-  std::unique_ptr<NetBluetoothMgmt> management_{};
+  std::unique_ptr<HciTransport> management_{};
 
   // Don't close twice or open before close is complete
   std::mutex mStateMutex;
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Pushes ACL, SCO and ISO traffic through BluetoothHci against a controller
+// emulated on the other end of a socketpair(): out through send() and the tx
+// queue, in through the H4 reader and the dispatcher lanes. Packets are sent
+// back to back and carry their send time, so latency includes queueing.
+//
+//   bluetooth_hci_bench_rpi [packets per run]
+//
+// Reports throughput, per-packet latency percentiles and heap allocations per
+// packet, counted process wide while a run is in progress.
+
+#define LOG_TAG "bluetooth_hci_bench_rpi"
+
+#include <aidl/android/hardware/bluetooth/BnBluetoothHciCallbacks.h>
+#include <android-base/properties.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "BluetoothHci.h"
+
+using ::aidl::android::hardware::bluetooth::BnBluetoothHciCallbacks;
+using ::aidl::android::hardware::bluetooth::Status;
+using ::aidl::android::hardware::bluetooth::impl::BluetoothHci;
+using ::aidl::android::hardware::bluetooth::impl::HciPacketPool;
+using ::aidl::android::hardware::bluetooth::impl::SocketHciTransport;
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace {
+
+std::atomic<uint64_t> gAllocations{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr) {
+    abort();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t /* size */) noexcept { free(p); }
+
+namespace {
+
+constexpr size_t kDefaultPackets = 20000;
+constexpr uint16_t kHandle = 0x0001;
+constexpr std::chrono::seconds kRunTimeout(30);
+
+struct Traffic {
+  const char* name;
+  PacketType type;
+  size_t header;   // HCI header, the send time follows it
+  size_t payload;
+};
+
+constexpr Traffic kTraffic[] = {
+    {"ACL", PacketType::ACL_DATA, 4, 1000},
+    {"SCO", PacketType::SCO_DATA, 3, 240},
+    {"ISO", PacketType::ISO_DATA, 4, 1000},
+};
+
+uint64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::vector<uint8_t> MakePacket(const Traffic& traffic) {
+  std::vector<uint8_t> packet(traffic.header + traffic.payload, 0xa5);
+  packet[0] = kHandle & 0xff;
+  packet[1] = kHandle >> 8;
+  packet[2] = traffic.payload & 0xff;
+  if (traffic.header == 4) {
+    packet[3] = traffic.payload >> 8;
+  }
+  return packet;
+}
+
+void Stamp(uint8_t* packet, const Traffic& traffic) {
+  uint64_t now = Now();
+  memcpy(packet + traffic.header, &now, sizeof(now));
+}
+
+uint64_t Latency(const uint8_t* packet, const Traffic& traffic) {
+  uint64_t sent;
+  memcpy(&sent, packet + traffic.header, sizeof(sent));
+  return Now() - sent;
+}
+
+void Report(const Traffic& traffic, const char* direction,
+            std::vector<uint64_t>& latencies, uint64_t elapsed_ns,
+            uint64_t allocations) {
+  if (latencies.empty() || elapsed_ns == 0) {
+    printf("%s %s: no packets\n", traffic.name, direction);
+    return;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    size_t i = std::min(latencies.size() - 1,
+                        static_cast<size_t>(p * latencies.size()));
+    return latencies[i] / 1000.0;
+  };
+  double bytes = static_cast<double>(latencies.size()) *
+                 (traffic.header + traffic.payload);
+
+  printf("%s %s: %zu x %zu bytes, %.1f Mbit/s, %.0f packets/s, latency us "
+         "p50 %.1f p90 %.1f p99 %.1f max %.1f, %.2f allocations/packet\n",
+         traffic.name, direction, latencies.size(),
+         traffic.header + traffic.payload, bytes * 8 * 1000 / elapsed_ns,
+         latencies.size() * 1e9 / elapsed_ns, percentile(0.5),
+         percentile(0.9), percentile(0.99), latencies.back() / 1000.0,
+         static_cast<double>(allocations) / latencies.size());
+}
+
+class BenchCallbacks : public BnBluetoothHciCallbacks {
+ public:
+  ndk::ScopedAStatus initializationComplete(Status status) override {
+    initialized_ = status == Status::SUCCESS;
+    return ndk::ScopedAStatus::ok();
+  }
+
+  ndk::ScopedAStatus hciEventReceived(
+      const std::vector<uint8_t>& /* event */) override {
+    return ndk::ScopedAStatus::ok();
+  }
+
+  ndk::ScopedAStatus aclDataReceived(
+      const std::vector<uint8_t>& data) override {
+    return Received(data);
+  }
+
+  ndk::ScopedAStatus scoDataReceived(
+      const std::vector<uint8_t>& data) override {
+    return Received(data);
+  }
+
+  ndk::ScopedAStatus isoDataReceived(
+      const std::vector<uint8_t>& data) override {
+    return Received(data);
+  }
+
+  bool initialized() const { return initialized_; }
+
+  // Reserves room up front so the callbacks themselves never allocate.
+  void Expect(const Traffic& traffic, size_t count) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    traffic_ = &traffic;
+    expected_ = count;
+    latencies_.clear();
+    latencies_.reserve(count);
+  }
+
+  bool Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, kRunTimeout, [this]() {
+      return latencies_.size() >= expected_;
+    });
+  }
+
+  std::vector<uint64_t>& latencies() { return latencies_; }
+
+ private:
+  ndk::ScopedAStatus Received(const std::vector<uint8_t>& data) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (traffic_ != nullptr &&
+        data.size() >= traffic_->header + sizeof(uint64_t) &&
+        latencies_.size() < expected_) {
+      latencies_.push_back(Latency(data.data(), *traffic_));
+      if (latencies_.size() == expected_) {
+        cv_.notify_one();
+      }
+    }
+    return ndk::ScopedAStatus::ok();
+  }
+
+  bool initialized_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  const Traffic* traffic_{nullptr};
+  size_t expected_{0};
+  std::vector<uint64_t> latencies_;
+};
+
+ndk::ScopedAStatus Send(BluetoothHci& hci, PacketType type,
+                        const std::vector<uint8_t>& packet) {
+  switch (type) {
+    case PacketType::SCO_DATA:
+      return hci.sendScoData(packet);
+    case PacketType::ISO_DATA:
+      return hci.sendIsoData(packet);
+    default:
+      return hci.sendAclData(packet);
+  }
+}
+
+// The emulated controller reads what the HAL writes to the socket.
+void RunTx(BluetoothHci& hci, int controller_fd, const Traffic& traffic,
+           size_t count, bool report) {
+  std::vector<uint64_t> latencies;
+  latencies.reserve(count);
+  uint64_t end = 0;
+
+  std::thread controller([&]() {
+    uint8_t frame[1 + HciPacketPool::kMaxPacketSize];
+    while (latencies.size() < count) {
+      ssize_t n = recv(controller_fd, frame, sizeof(frame), 0);
+      if (n <= 0) {
+        break;
+      }
+      if (frame[0] != static_cast<uint8_t>(traffic.type) ||
+          static_cast<size_t>(n) < 1 + traffic.header + sizeof(uint64_t)) {
+        continue;
+      }
+      latencies.push_back(Latency(frame + 1, traffic));
+    }
+    end = Now();
+  });
+
+  std::vector<uint8_t> packet = MakePacket(traffic);
+  uint64_t allocations = gAllocations.load();
+  uint64_t start = Now();
+  for (size_t i = 0; i < count; i++) {
+    Stamp(packet.data(), traffic);
+    if (!Send(hci, traffic.type, packet).isOk()) {
+      fprintf(stderr, "%s send failed after %zu packets\n", traffic.name, i);
+      shutdown(controller_fd, SHUT_RD);
+      break;
+    }
+  }
+  controller.join();
+  allocations = gAllocations.load() - allocations;
+
+  if (report) {
+    Report(traffic, "tx", latencies, end - start, allocations);
+  }
+}
+
+// The emulated controller writes H4 frames for the reader to pick up.
+void RunRx(BenchCallbacks& cb, int controller_fd, const Traffic& traffic,
+           size_t count, bool report) {
+  std::vector<uint8_t> packet = MakePacket(traffic);
+  std::vector<uint8_t> frame(1 + packet.size());
+  frame[0] = static_cast<uint8_t>(traffic.type);
+  memcpy(frame.data() + 1, packet.data(), packet.size());
+
+  cb.Expect(traffic, count);
+  uint64_t allocations = gAllocations.load();
+  uint64_t start = Now();
+  for (size_t i = 0; i < count; i++) {
+    Stamp(frame.data() + 1, traffic);
+    if (send(controller_fd, frame.data(), frame.size(), 0) !=
+        static_cast<ssize_t>(frame.size())) {
+      fprintf(stderr, "%s controller write failed: %s\n", traffic.name,
+              strerror(errno));
+      break;
+    }
+  }
+  bool complete = cb.Wait();
+  uint64_t end = Now();
+  allocations = gAllocations.load() - allocations;
+
+  if (!complete) {
+    fprintf(stderr, "%s rx: only %zu of %zu packets delivered\n", traffic.name,
+            cb.latencies().size(), count);
+  }
+  if (report) {
+    Report(traffic, "rx", cb.latencies(), end - start, allocations);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 0) : kDefaultPackets;
+  if (count == 0) {
+    fprintf(stderr, "usage: %s [packets per run]\n", argv[0]);
+    return 1;
+  }
+
+  // The emulated controller never returns credits.
+  if (::android::base::GetBoolProperty("persist.vendor.bluetooth.flow_control",
+                                       false)) {
+    fprintf(stderr, "turn off persist.vendor.bluetooth.flow_control first\n");
+    return 1;
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+    perror("socketpair");
+    return 1;
+  }
+
+  auto cb = ndk::SharedRefBase::make<BenchCallbacks>();
+  auto hci = ndk::SharedRefBase::make<BluetoothHci>(
+      std::make_unique<SocketHciTransport>(sv[0]));
+  hci->initialize(cb);
+  if (!cb->initialized()) {
+    fprintf(stderr, "HAL initialization failed\n");
+    return 1;
+  }
+
+  for (const Traffic& traffic : kTraffic) {
+    // Warm up first, so the packet pool and the queues are grown already.
+    size_t warmup = std::min<size_t>(count, 1000);
+    RunTx(*hci, sv[1], traffic, warmup, false);
+    RunTx(*hci, sv[1], traffic, count, true);
+    RunRx(*cb, sv[1], traffic, warmup, false);
+    RunRx(*cb, sv[1], traffic, count, true);
+  }
+
+  hci->close();
+  close(sv[1]);
+  return 0;
+}
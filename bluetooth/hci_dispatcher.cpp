@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.bluetooth.service.rpi"
+
+#include "hci_dispatcher.h"
+
+#include <log/log.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+namespace {
+
+// Same class as the audio HAL's fast threads.
+constexpr int kRealtimePriority = 2;
+
+constexpr uint8_t kSynchronousConnectionComplete = 0x2c;
+constexpr uint8_t kLeMetaEvent = 0x3e;
+
+// LE Meta subevents reporting advertisements
+bool IsAdvertisingReport(PacketType type, const std::vector<uint8_t>& packet) {
+  if (type != PacketType::EVENT || packet.size() < 3 ||
+      packet[0] != kLeMetaEvent) {
+    return false;
+  }
+  switch (packet[2]) {
+    case 0x02:  // LE Advertising Report
+    case 0x0b:  // LE Directed Advertising Report
+    case 0x0d:  // LE Extended Advertising Report
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Events announcing a new SCO, CIS or BIS handle
+bool IsSyncLinkEvent(PacketType type, const std::vector<uint8_t>& packet) {
+  if (type != PacketType::EVENT || packet.empty()) {
+    return false;
+  }
+  if (packet[0] == kSynchronousConnectionComplete) {
+    return true;
+  }
+  if (packet[0] != kLeMetaEvent || packet.size() < 3) {
+    return false;
+  }
+  switch (packet[2]) {
+    case 0x19:  // LE CIS Established
+    case 0x1b:  // LE Create BIG Complete
+    case 0x1d:  // LE BIG Sync Established
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+HciDispatcher::HciDispatcher(HciPacketPool& pool, DeliverCallback deliver_cb)
+    : pool_(pool), deliver_cb_(std::move(deliver_cb)) {}
+
+HciDispatcher::~HciDispatcher() { Stop(); }
+
+void HciDispatcher::Start() {
+  for (Lane* lane : {&realtime_, &normal_}) {
+    lane->running = true;
+    lane->thread = std::thread([this, lane]() { Run(*lane); });
+  }
+}
+
+void HciDispatcher::Stop() {
+  for (Lane* lane : {&realtime_, &normal_}) {
+    {
+      std::lock_guard<std::mutex> guard(lane->mutex);
+      lane->running = false;
+    }
+    lane->cv.notify_all();
+    lane->space_cv.notify_all();
+    if (lane->thread.joinable()) {
+      lane->thread.join();
+      ALOGI("%s lane: %llu packets delivered, %llu dropped, %llu stalls, "
+            "%zu discarded",
+            lane->name, static_cast<unsigned long long>(lane->delivered),
+            static_cast<unsigned long long>(lane->dropped),
+            static_cast<unsigned long long>(lane->stalled),
+            lane->packets.size());
+    }
+    for (auto& item : lane->packets) {
+      pool_.Release(std::move(item.packet));
+    }
+    lane->packets.clear();
+  }
+}
+
+void HciDispatcher::Post(PacketType type, std::vector<uint8_t>& packet) {
+  bool realtime = type == PacketType::SCO_DATA || type == PacketType::ISO_DATA;
+  Lane& lane = realtime ? realtime_ : normal_;
+  std::vector<uint8_t> stale;
+  bool drop = false;
+  uint64_t barrier = 0;
+
+  // Counted before the event is queued, frames read after it wait for it.
+  if (IsSyncLinkEvent(type, packet)) {
+    std::lock_guard<std::mutex> guard(realtime_.mutex);
+    barrier = ++barriers_posted_;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(lane.mutex);
+    if (lane.packets.size() >= lane.capacity) {
+      if (realtime) {
+        stale = std::move(lane.packets.front().packet);
+        lane.packets.pop_front();
+        drop = true;
+      } else if (IsAdvertisingReport(type, packet)) {
+        stale = std::move(packet);
+        drop = true;
+      } else {
+        lane.stalled++;
+        lane.space_cv.wait(lock, [&lane]() {
+          return !lane.running || lane.packets.size() < lane.capacity;
+        });
+        if (!lane.running) {
+          lock.unlock();
+          pool_.Release(std::move(packet));
+          if (barrier) {
+            ReleaseBarrier();
+          }
+          return;
+        }
+      }
+    }
+    if (!drop || realtime) {
+      // Real-time frames hold realtime_.mutex, which guards barriers_posted_.
+      lane.packets.push_back(
+          {type, std::move(packet), realtime ? barriers_posted_ : barrier});
+    }
+  }
+  lane.cv.notify_one();
+
+  if (drop) {
+    Drop(lane, std::move(stale));
+  }
+}
+
+void HciDispatcher::ReleaseBarrier() {
+  {
+    std::lock_guard<std::mutex> guard(realtime_.mutex);
+    barriers_released_++;
+  }
+  realtime_.cv.notify_one();
+}
+
+void HciDispatcher::Drop(Lane& lane, std::vector<uint8_t>&& packet) {
+  uint64_t dropped;
+  {
+    std::lock_guard<std::mutex> guard(lane.mutex);
+    dropped = ++lane.dropped;
+  }
+  if (dropped == 1 || dropped % 100 == 0) {
+    ALOGW("%s lane full, %llu packets dropped", lane.name,
+          static_cast<unsigned long long>(dropped));
+  }
+  pool_.Release(std::move(packet));
+}
+
+void HciDispatcher::Run(Lane& lane) {
+  if (lane.realtime) {
+    struct sched_param param = {};
+    param.sched_priority = kRealtimePriority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret) {
+      ALOGW("unable to make %s lane SCHED_FIFO: %s", lane.name, strerror(ret));
+    }
+  }
+
+  for (;;) {
+    Lane::Item item;
+    {
+      std::unique_lock<std::mutex> lock(lane.mutex);
+      lane.cv.wait(lock, [this, &lane]() {
+        return !lane.running ||
+               (!lane.packets.empty() &&
+                (!lane.realtime ||
+                 lane.packets.front().barrier <= barriers_released_));
+      });
+      if (!lane.running) {
+        return;
+      }
+      bool full = lane.packets.size() >= lane.capacity;
+      item = std::move(lane.packets.front());
+      lane.packets.pop_front();
+      lane.delivered++;
+      if (full) {
+        lane.space_cv.notify_one();
+      }
+    }
+
+    deliver_cb_(item.type, item.packet);
+    pool_.Release(std::move(item.packet));
+    if (!lane.realtime && item.barrier) {
+      ReleaseBarrier();
+    }
+  }
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
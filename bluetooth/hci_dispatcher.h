@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "hci_internals.h"
+#include "hci_reader.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Hands received packets to the stack from two worker threads. SCO and ISO
+// go through a SCHED_FIFO lane, events and ACL through a normal one, so a
+// burst of advertising reports cannot delay voice frames.
+//
+// Both lanes are bounded. The real-time lane drops its oldest frame when
+// full, since a late voice frame is useless anyway. The normal lane drops
+// LE advertising reports when full; for other events and ACL Post() blocks
+// until there is room, which pushes back on the reader and the controller.
+//
+// The events creating SCO, CIS and BIS handles stay on the normal lane,
+// ordered with the commands they answer, but act as barriers: frames
+// received after one wait until it was delivered, so the stack never sees
+// data for a handle it does not know yet. Disconnections need no barrier,
+// a reused handle is only announced again after them.
+class HciDispatcher {
+ public:
+  using DeliverCallback =
+      std::function<void(::android::hardware::bluetooth::hci::PacketType,
+                         const std::vector<uint8_t>&)>;
+
+  HciDispatcher(HciPacketPool& pool, DeliverCallback deliver_cb);
+  ~HciDispatcher();
+
+  void Start();
+  void Stop();
+
+  // Takes the packet buffer, it goes back to the pool once delivered. May
+  // block while the normal lane is full.
+  void Post(::android::hardware::bluetooth::hci::PacketType type,
+            std::vector<uint8_t>& packet);
+
+ private:
+  struct Lane {
+    Lane(const char* name, size_t capacity, bool realtime)
+        : name(name), capacity(capacity), realtime(realtime) {}
+
+    const char* name;
+    size_t capacity;
+    bool realtime;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Signalled when a packet was taken off a full lane.
+    std::condition_variable space_cv;
+    struct Item {
+      ::android::hardware::bluetooth::hci::PacketType type;
+      std::vector<uint8_t> packet;
+      // Normal lane: a barrier to release once delivered. Real-time lane:
+      // barriers that must be released before delivery.
+      uint64_t barrier;
+    };
+    std::deque<Item> packets;
+    bool running{false};
+    std::thread thread;
+
+    uint64_t delivered{0};
+    uint64_t dropped{0};
+    // Post() calls that had to wait for room.
+    uint64_t stalled{0};
+  };
+
+  void Run(Lane& lane);
+  void ReleaseBarrier();
+  void Drop(Lane& lane, std::vector<uint8_t>&& packet);
+
+  HciPacketPool& pool_;
+  DeliverCallback deliver_cb_;
+
+  Lane realtime_{"sco/iso", 32, true};
+  Lane normal_{"event/acl", 256, false};
+  // Guarded by realtime_.mutex.
+  uint64_t barriers_posted_{0};
+  uint64_t barriers_released_{0};
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hci_flow_control.h"
+
+#include <algorithm>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+namespace {
+
+// Events
+constexpr uint8_t kConnectionComplete = 0x03;
+constexpr uint8_t kDisconnectionComplete = 0x05;
+constexpr uint8_t kCommandComplete = 0x0e;
+constexpr uint8_t kCommandStatus = 0x0f;
+constexpr uint8_t kNumberOfCompletedPackets = 0x13;
+constexpr uint8_t kLeMeta = 0x3e;
+
+// LE Meta subevents
+constexpr uint8_t kLeConnectionComplete = 0x01;
+constexpr uint8_t kLeEnhancedConnectionComplete = 0x0a;
+constexpr uint8_t kLeEnhancedConnectionCompleteV2 = 0x29;
+
+// Commands
+constexpr uint16_t kReset = 0x0c03;
+constexpr uint16_t kReadBufferSize = 0x1005;
+constexpr uint16_t kLeReadBufferSize = 0x2002;
+constexpr uint16_t kLeReadBufferSizeV2 = 0x2060;
+
+constexpr uint8_t kLinkTypeAcl = 0x01;
+
+uint16_t Le16(const std::vector<uint8_t>& v, size_t offset) {
+  return v[offset] | (v[offset + 1] << 8);
+}
+
+uint16_t AclHandle(const std::vector<uint8_t>& packet) {
+  return Le16(packet, 0) & 0x0fff;
+}
+
+}  // namespace
+
+bool HciFlowControl::CanSend(PacketType type,
+                             const std::vector<uint8_t>& packet) const {
+  switch (type) {
+    case PacketType::COMMAND:
+      return command_credits_ > 0;
+    case PacketType::ACL_DATA: {
+      if (packet.size() < 2) return true;
+      const Pool* pool = PoolFor(AclHandle(packet));
+      return pool == nullptr || pool->buffers == 0 ||
+             pool->in_flight < pool->buffers;
+    }
+    default:
+      return true;
+  }
+}
+
+void HciFlowControl::OnSent(PacketType type,
+                            const std::vector<uint8_t>& packet) {
+  switch (type) {
+    case PacketType::COMMAND:
+      if (command_credits_ > 0) command_credits_--;
+      commands_in_flight_++;
+      if (packet.size() >= 2 && Le16(packet, 0) == kReset) {
+        Reset();
+      }
+      break;
+    case PacketType::ACL_DATA: {
+      if (packet.size() < 2) break;
+      auto it = links_.find(AclHandle(packet));
+      if (it == links_.end()) break;
+      PoolFor(it->first)->in_flight++;
+      it->second.in_flight++;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+bool HciFlowControl::OnEvent(const std::vector<uint8_t>& event) {
+  if (event.size() < 2) return false;
+
+  switch (event[0]) {
+    case kCommandComplete:
+      if (event.size() < 5) return false;
+      command_credits_ = event[2];
+      // Opcode 0 only announces credits, it completes no command.
+      if (Le16(event, 3) != 0 && commands_in_flight_ > 0) commands_in_flight_--;
+      OnCommandComplete(event);
+      return true;
+
+    case kCommandStatus:
+      if (event.size() < 6) return false;
+      command_credits_ = event[3];
+      if (Le16(event, 4) != 0 && commands_in_flight_ > 0) commands_in_flight_--;
+      return true;
+
+    case kNumberOfCompletedPackets: {
+      if (event.size() < 3) return false;
+      size_t handles = event[2];
+      if (event.size() < 3 + handles * 4) return false;
+      for (size_t i = 0; i < handles; i++) {
+        Complete(Le16(event, 3 + i * 4) & 0x0fff, Le16(event, 5 + i * 4));
+      }
+      return handles > 0;
+    }
+
+    case kConnectionComplete:
+      if (event.size() < 12 || event[2] != 0) return false;
+      if (event[11] == kLinkTypeAcl) {
+        links_[Le16(event, 3) & 0x0fff] = {false, 0};
+      }
+      return false;
+
+    case kDisconnectionComplete: {
+      if (event.size() < 5 || event[2] != 0) return false;
+      // Packets still queued for the link are flushed by the controller.
+      uint16_t handle = Le16(event, 3) & 0x0fff;
+      auto it = links_.find(handle);
+      if (it == links_.end()) return false;
+      Complete(handle, it->second.in_flight);
+      links_.erase(it);
+      return true;
+    }
+
+    case kLeMeta:
+      if (event.size() < 6) return false;
+      if ((event[2] == kLeConnectionComplete ||
+           event[2] == kLeEnhancedConnectionComplete ||
+           event[2] == kLeEnhancedConnectionCompleteV2) &&
+          event[3] == 0) {
+        links_[Le16(event, 4) & 0x0fff] = {true, 0};
+      }
+      return false;
+
+    default:
+      return false;
+  }
+}
+
+void HciFlowControl::OnCommandComplete(const std::vector<uint8_t>& event) {
+  uint16_t opcode = Le16(event, 3);
+
+  if (event.size() < 6 || event[5] != 0) return;
+
+  switch (opcode) {
+    case kReadBufferSize:
+      if (event.size() >= 11) acl_.buffers = Le16(event, 9);
+      break;
+    case kLeReadBufferSize:
+    case kLeReadBufferSizeV2:
+      // Zero means LE links share the BR/EDR buffers.
+      if (event.size() >= 9) le_.buffers = event[8];
+      break;
+  }
+}
+
+// Only ACL links seen connecting are accounted. SCO, CIS and BIS handles
+// draw on buffers of their own, and stale handles on nothing at all, so
+// their completions must not hand out ACL credits.
+const HciFlowControl::Pool* HciFlowControl::PoolFor(uint16_t handle) const {
+  auto it = links_.find(handle);
+  if (it == links_.end()) return nullptr;
+  return it->second.le && le_.buffers ? &le_ : &acl_;
+}
+
+HciFlowControl::Pool* HciFlowControl::PoolFor(uint16_t handle) {
+  return const_cast<Pool*>(
+      static_cast<const HciFlowControl*>(this)->PoolFor(handle));
+}
+
+void HciFlowControl::Complete(uint16_t handle, unsigned count) {
+  auto it = links_.find(handle);
+  if (it == links_.end()) return;
+
+  // Never return more than was sent on this link.
+  count = std::min(it->second.in_flight, count);
+  it->second.in_flight -= count;
+  Pool* pool = PoolFor(handle);
+  pool->in_flight -= std::min(pool->in_flight, count);
+}
+
+// The controller forgets about buffers and links on HCI_Reset, and only
+// accepts commands again once it completes.
+void HciFlowControl::Reset() {
+  command_credits_ = 0;
+  commands_in_flight_ = 1;
+  acl_ = {};
+  le_ = {};
+  links_.clear();
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "hci_internals.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Tracks the controller's command and ACL credits from the traffic itself:
+// Num_HCI_Command_Packets in Command Complete/Status, buffer counts from the
+// Read Buffer Size commands the stack issues during bring-up, and Number Of
+// Completed Packets. Not thread safe, HciTxQueue serializes access.
+class HciFlowControl {
+ public:
+  // Whether the controller has room for this packet. Packet types, handles
+  // and buffer pools that are not tracked, or not known yet, always pass.
+  bool CanSend(::android::hardware::bluetooth::hci::PacketType type,
+               const std::vector<uint8_t>& packet) const;
+  void OnSent(::android::hardware::bluetooth::hci::PacketType type,
+              const std::vector<uint8_t>& packet);
+
+  // Returns true if credits were returned.
+  bool OnEvent(const std::vector<uint8_t>& event);
+
+  unsigned commandCredits() const { return command_credits_; }
+  unsigned commandsInFlight() const { return commands_in_flight_; }
+  unsigned aclInFlight() const { return acl_.in_flight; }
+  unsigned aclBuffers() const { return acl_.buffers; }
+  unsigned leInFlight() const { return le_.in_flight; }
+  unsigned leBuffers() const { return le_.buffers; }
+
+ private:
+  struct Pool {
+    unsigned buffers{0};  // 0 until the controller reported its buffer count
+    unsigned in_flight{0};
+  };
+  struct Link {
+    bool le;
+    unsigned in_flight;
+  };
+
+  // nullptr for handles that are not a known ACL link.
+  const Pool* PoolFor(uint16_t handle) const;
+  Pool* PoolFor(uint16_t handle);
+  void Complete(uint16_t handle, unsigned count);
+  void OnCommandComplete(const std::vector<uint8_t>& event);
+  void Reset();
+
+  unsigned command_credits_{1};
+  unsigned commands_in_flight_{0};
+  Pool acl_;
+  Pool le_;
+  std::map<uint16_t, Link> links_;
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
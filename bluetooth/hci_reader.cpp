@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.bluetooth.service.rpi"
+
+#include "hci_reader.h"
+
+#include <log/log.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+std::vector<uint8_t> HciPacketPool::Acquire() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!free_.empty()) {
+      std::vector<uint8_t> packet = std::move(free_.back());
+      free_.pop_back();
+      return packet;
+    }
+  }
+
+  std::vector<uint8_t> packet;
+  packet.reserve(kMaxPacketSize);
+  return packet;
+}
+
+void HciPacketPool::Release(std::vector<uint8_t>&& packet) {
+  if (packet.capacity() < kMaxPacketSize) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (free_.size() < kMaxFree) {
+    free_.push_back(std::move(packet));
+  }
+}
+
+HciReader::HciReader(int fd, HciSnoop* snoop, PacketReadyCallback packet_cb,
+                     DisconnectCallback disconnect_cb)
+    : fd_(fd),
+      snoop_(snoop),
+      packet_cb_(std::move(packet_cb)),
+      disconnect_cb_(std::move(disconnect_cb)) {}
+
+void HciReader::OnDataReady() {
+  if (disconnected_) {
+    return;
+  }
+
+  for (size_t i = 0; i < kBatchSize; i++) {
+    Slot& slot = slots_[i];
+
+    // Refill slots whose buffer was handed off during the last batch.
+    if (slot.data.capacity() < HciPacketPool::kMaxPacketSize) {
+      slot.data = pool_.Acquire();
+    }
+    slot.data.resize(HciPacketPool::kMaxPacketSize);
+
+    iovs_[i][0] = {&slot.type, sizeof(slot.type)};
+    iovs_[i][1] = {slot.data.data(), slot.data.size()};
+    msgs_[i] = {};
+    msgs_[i].msg_hdr.msg_iov = iovs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 2;
+  }
+
+  int count =
+      TEMP_FAILURE_RETRY(recvmmsg(fd_, msgs_, kBatchSize, MSG_DONTWAIT, nullptr));
+  if (count < 0) {
+    if (errno == EPIPE || errno == ENODEV || errno == ENETDOWN) {
+      ALOGI("hci socket closed (%s), calling the disconnect callback",
+            strerror(errno));
+      disconnected_ = true;
+      disconnect_cb_();
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ALOGW("error reading from hci socket (%s)", strerror(errno));
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    Slot& slot = slots_[i];
+    size_t len = msgs_[i].msg_len;
+
+    if (len == 0) {
+      ALOGI("No bytes read, calling the disconnect callback");
+      disconnected_ = true;
+      disconnect_cb_();
+      return;
+    }
+    if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      ALOGE("dropping oversized hci packet of type %d", slot.type);
+      continue;
+    }
+
+    slot.data.resize(len - 1);
+    snoop_->Record(static_cast<PacketType>(slot.type), true, slot.data.data(),
+                   slot.data.size());
+    packet_cb_(static_cast<PacketType>(slot.type), slot.data);
+  }
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "hci_internals.h"
+#include "hci_snoop.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Packet buffers handed out by HciReader. A buffer keeps its capacity when
+// it comes back, so a steady stream of packets does not allocate.
+class HciPacketPool {
+ public:
+  // HCI_MAX_FRAME_SIZE in the kernel, the largest frame a driver assembles.
+  static constexpr size_t kMaxPacketSize = 1028;
+
+  std::vector<uint8_t> Acquire();
+  void Release(std::vector<uint8_t>&& packet);
+
+ private:
+  static constexpr size_t kMaxFree = 64;
+
+  std::mutex mutex_;
+  std::vector<std::vector<uint8_t>> free_;
+};
+
+// Reads the HCI user channel. The socket returns one H4 packet per datagram,
+// so each wakeup picks up a whole batch with a single recvmmsg() straight
+// into pooled buffers, with no reassembly and no per-packet allocation.
+class HciReader {
+ public:
+  // The packet may be moved out by the callee; it should be given back to
+  // pool() once delivered.
+  using PacketReadyCallback = std::function<void(
+      ::android::hardware::bluetooth::hci::PacketType, std::vector<uint8_t>&)>;
+  using DisconnectCallback = std::function<void()>;
+
+  HciReader(int fd, HciSnoop* snoop, PacketReadyCallback packet_cb,
+            DisconnectCallback disconnect_cb);
+
+  void OnDataReady();
+
+  HciPacketPool& pool() { return pool_; }
+
+ private:
+  static constexpr size_t kBatchSize = 16;
+
+  struct Slot {
+    uint8_t type;
+    std::vector<uint8_t> data;
+  };
+
+  int fd_;
+  HciSnoop* snoop_;
+  PacketReadyCallback packet_cb_;
+  DisconnectCallback disconnect_cb_;
+  bool disconnected_{false};
+
+  HciPacketPool pool_;
+  Slot slots_[kBatchSize];
+  struct iovec iovs_[kBatchSize][2];
+  struct mmsghdr msgs_[kBatchSize];
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
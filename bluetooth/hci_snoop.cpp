@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.bluetooth.service.rpi"
+
+#include "hci_snoop.h"
+
+#include <android-base/file.h>
+#include <android-base/properties.h>
+#include <endian.h>
+#include <log/log.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+namespace {
+
+// btsnoop timestamps count microseconds from 0000-01-01.
+constexpr uint64_t kBtsnoopEpochDeltaUs = 0x00dcddb30f2f8000ULL;
+constexpr uint32_t kBtsnoopVersion = 1;
+constexpr uint32_t kBtsnoopDatalinkH4 = 1002;
+
+struct BtsnoopHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t datalink;
+} __attribute__((packed));
+
+struct BtsnoopRecord {
+  uint32_t length;
+  uint32_t captured;
+  uint32_t flags;
+  uint32_t drops;
+  uint64_t timestamp;
+} __attribute__((packed));
+
+// Filtered captures: HCI header plus L2CAP basic header, or ISO data load
+// header, so the channel and the SDU length stay visible.
+constexpr size_t kFilteredAclCapture = 8;
+constexpr size_t kFilteredScoCapture = 3;
+constexpr size_t kFilteredIsoCapture = 8;
+constexpr size_t kCommandHeader = 3;
+constexpr size_t kEventHeader = 2;
+
+// Commands whose parameters hold key material
+bool IsSecretCommand(const uint8_t* data, size_t len) {
+  if (len < 2) {
+    return false;
+  }
+  switch (data[0] | (data[1] << 8)) {
+    case 0x040b:  // Link Key Request Reply
+    case 0x040d:  // PIN Code Request Reply
+    case 0x042e:  // User Passkey Request Reply
+    case 0x0430:  // Remote OOB Data Request Reply
+    case 0x0445:  // Remote OOB Extended Data Request Reply
+    case 0x0c11:  // Write Stored Link Key
+    case 0x2017:  // LE Encrypt
+    case 0x2019:  // LE Enable Encryption
+    case 0x201a:  // LE Long Term Key Request Reply
+    case 0x2027:  // LE Add Device To Resolving List
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Events whose parameters hold key material
+bool IsSecretEvent(const uint8_t* data, size_t len) {
+  if (len < 1) {
+    return false;
+  }
+  switch (data[0]) {
+    case 0x15:  // Return Link Keys
+    case 0x18:  // Link Key Notification
+      return true;
+    case 0x0e:  // Command Complete of LE Encrypt returns the encrypted data
+      return len >= 5 && data[3] == 0x17 && data[4] == 0x20;
+    default:
+      return false;
+  }
+}
+
+// Bytes of the packet the filtered ring keeps
+size_t FilteredCapture(PacketType type, const uint8_t* data, size_t len) {
+  switch (type) {
+    case PacketType::COMMAND:
+      return IsSecretCommand(data, len) ? kCommandHeader : len;
+    case PacketType::EVENT:
+      return IsSecretEvent(data, len) ? kEventHeader : len;
+    case PacketType::ACL_DATA:
+      return kFilteredAclCapture;
+    case PacketType::SCO_DATA:
+      return kFilteredScoCapture;
+    case PacketType::ISO_DATA:
+      return kFilteredIsoCapture;
+    default:
+      return len;
+  }
+}
+
+uint64_t NowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+}  // namespace
+
+HciSnoop::HciSnoop()
+    : filtered_(::android::base::GetProperty("ro.build.type", "") == "user") {
+  enabled_ = ::android::base::GetBoolProperty(
+      "persist.vendor.bluetooth.hal_snoop", !filtered_);
+}
+
+void HciSnoop::Record(PacketType type, bool received, const uint8_t* data,
+                      size_t len) {
+  if (!enabled_) {
+    return;
+  }
+
+  uint64_t index = head_.fetch_add(1, std::memory_order_relaxed);
+  Entry& entry = entries_[index % kEntries];
+
+  // Odd while the slot is being written, even once published.
+  entry.seq.store(index * 2 + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  entry.timestamp_us = NowUs();
+  entry.length = len;
+  entry.captured = std::min(
+      filtered_ ? std::min(len, FilteredCapture(type, data, len)) : len,
+      kMaxCapture);
+  entry.type = static_cast<uint8_t>(type);
+  entry.received = received;
+  memcpy(entry.data, data, entry.captured);
+
+  entry.seq.store(index * 2 + 2, std::memory_order_release);
+}
+
+void HciSnoop::WriteBtsnoop(int fd) const {
+  std::string out;
+  uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t first = head > kEntries ? head - kEntries : 0;
+  uint32_t drops = first;
+
+  BtsnoopHeader header = {{'b', 't', 's', 'n', 'o', 'o', 'p', '\0'},
+                          htobe32(kBtsnoopVersion),
+                          htobe32(kBtsnoopDatalinkH4)};
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.reserve(sizeof(header) + (head - first) * (sizeof(BtsnoopRecord) + 64));
+
+  for (uint64_t index = first; index < head; index++) {
+    const Entry& entry = entries_[index % kEntries];
+    Entry copy;
+
+    uint64_t seq = entry.seq.load(std::memory_order_acquire);
+    if (seq != index * 2 + 2) {
+      drops++;
+      continue;
+    }
+    copy.timestamp_us = entry.timestamp_us;
+    copy.length = entry.length;
+    copy.captured = entry.captured;
+    copy.type = entry.type;
+    copy.received = entry.received;
+    memcpy(copy.data, entry.data, copy.captured);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.seq.load(std::memory_order_relaxed) != seq) {
+      drops++;
+      continue;
+    }
+
+    // Bit 0 is the direction, bit 1 is set for commands and events.
+    uint32_t flags = (copy.received ? 1 : 0) |
+                     (copy.type == static_cast<uint8_t>(PacketType::COMMAND) ||
+                              copy.type == static_cast<uint8_t>(PacketType::EVENT)
+                          ? 2
+                          : 0);
+    BtsnoopRecord record = {htobe32(copy.length + 1), htobe32(copy.captured + 1),
+                            htobe32(flags), htobe32(drops),
+                            htobe64(copy.timestamp_us + kBtsnoopEpochDeltaUs)};
+    out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    out.push_back(static_cast<char>(copy.type));
+    out.append(reinterpret_cast<const char*>(copy.data), copy.captured);
+  }
+
+  if (!::android::base::WriteFully(fd, out.data(), out.size())) {
+    ALOGE("unable to write snoop log: %s", strerror(errno));
+  }
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "hci_internals.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// In-memory ring of the last kEntries HCI packets crossing the user channel,
+// kept across HAL sessions and written out as a btsnoop file on request.
+//
+// Recording is lock-free: a writer claims a slot with one atomic increment
+// and publishes it with a sequence number, seqlock style. The dump skips
+// slots that were overwritten while it read them. Packets are truncated to
+// kMaxCapture bytes, which keeps the headers and the start of L2CAP.
+//
+// Off by default on user builds. There the ring, if enabled, is filtered
+// like the framework's filtered snoop mode: commands and events carrying
+// link keys, PINs, passkeys or OOB data keep their header only, and data
+// packets are cut after their HCI and L2CAP headers.
+class HciSnoop {
+ public:
+  static constexpr size_t kEntries = 1024;
+  static constexpr size_t kMaxCapture = 256;
+
+  HciSnoop();
+
+  bool enabled() const { return enabled_; }
+  bool filtered() const { return filtered_; }
+
+  void Record(::android::hardware::bluetooth::hci::PacketType type,
+              bool received, const uint8_t* data, size_t len);
+
+  // Writes the ring content, oldest first, in btsnoop format (H4 datalink).
+  void WriteBtsnoop(int fd) const;
+
+  uint64_t recorded() const { return head_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Entry {
+    std::atomic<uint64_t> seq{0};
+    uint64_t timestamp_us;
+    uint16_t length;
+    uint16_t captured;
+    uint8_t type;
+    bool received;
+    uint8_t data[kMaxCapture];
+  };
+
+  bool enabled_;
+  bool filtered_;
+  std::atomic<uint64_t> head_{0};
+  Entry entries_[kEntries];
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include "hci_stats.h"
+
+#include <cutils/trace.h>
+#include <time.h>
+
+#include <cstdio>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+namespace {
+
+const char* const kTypeNames[] = {"unknown", "command", "acl",
+                                  "sco",     "event",   "iso"};
+const char* const kTxCounters[] = {nullptr,          "bt_tx_bytes_command",
+                                   "bt_tx_bytes_acl", "bt_tx_bytes_sco",
+                                   nullptr,          "bt_tx_bytes_iso"};
+const char* const kRxCounters[] = {nullptr,          nullptr,
+                                   "bt_rx_bytes_acl", "bt_rx_bytes_sco",
+                                   "bt_rx_bytes_event", "bt_rx_bytes_iso"};
+
+size_t Index(PacketType type) {
+  size_t index = static_cast<size_t>(type);
+  return index < sizeof(kTypeNames) / sizeof(kTypeNames[0]) ? index : 0;
+}
+
+}  // namespace
+
+uint64_t HciStats::Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void HciStats::OnSent(PacketType type, size_t length, uint64_t latency_ns) {
+  size_t index = Index(type);
+  uint64_t latency_us = latency_ns / 1000;
+  size_t bucket = 0;
+
+  while (bucket < kLatencyBuckets - 1 && latency_us > kLatencyBoundsUs[bucket]) {
+    bucket++;
+  }
+
+  tx_[index].packets.fetch_add(1, std::memory_order_relaxed);
+  uint64_t bytes =
+      tx_[index].bytes.fetch_add(length, std::memory_order_relaxed) + length;
+  latency_[index][bucket].fetch_add(1, std::memory_order_relaxed);
+
+  if (kTxCounters[index] != nullptr) {
+    ATRACE_INT64(kTxCounters[index], bytes);
+  }
+}
+
+void HciStats::OnReceived(PacketType type, size_t length) {
+  size_t index = Index(type);
+
+  rx_[index].packets.fetch_add(1, std::memory_order_relaxed);
+  uint64_t bytes =
+      rx_[index].bytes.fetch_add(length, std::memory_order_relaxed) + length;
+
+  if (kRxCounters[index] != nullptr) {
+    ATRACE_INT64(kRxCounters[index], bytes);
+  }
+}
+
+void HciStats::OnOpen(uint64_t duration_ns, bool ok) {
+  opens_.fetch_add(1, std::memory_order_relaxed);
+  if (!ok) {
+    open_failures_.fetch_add(1, std::memory_order_relaxed);
+  }
+  last_open_ns_.store(duration_ns, std::memory_order_relaxed);
+}
+
+void HciStats::OnClose(uint64_t duration_ns) {
+  closes_.fetch_add(1, std::memory_order_relaxed);
+  last_close_ns_.store(duration_ns, std::memory_order_relaxed);
+}
+
+void HciStats::Dump(int fd) const {
+  dprintf(fd, "sessions: %llu opened (%llu failed), %llu closed, %llu disconnects\n",
+          static_cast<unsigned long long>(opens_.load()),
+          static_cast<unsigned long long>(open_failures_.load()),
+          static_cast<unsigned long long>(closes_.load()),
+          static_cast<unsigned long long>(disconnects_.load()));
+  dprintf(fd, "  last initialize %.3f ms, last close %.3f ms\n",
+          last_open_ns_.load() / 1e6, last_close_ns_.load() / 1e6);
+
+  dprintf(fd, "traffic:\n");
+  for (size_t i = 1; i < kTypes; i++) {
+    dprintf(fd, "  %-8s tx %llu packets %llu bytes, rx %llu packets %llu bytes\n",
+            kTypeNames[i], static_cast<unsigned long long>(tx_[i].packets.load()),
+            static_cast<unsigned long long>(tx_[i].bytes.load()),
+            static_cast<unsigned long long>(rx_[i].packets.load()),
+            static_cast<unsigned long long>(rx_[i].bytes.load()));
+  }
+  dprintf(fd, "  socket full: %llu\n",
+          static_cast<unsigned long long>(socket_full_.load()));
+
+  dprintf(fd, "send latency (us):");
+  for (size_t b = 0; b < kLatencyBuckets - 1; b++) {
+    dprintf(fd, " <=%llu", static_cast<unsigned long long>(kLatencyBoundsUs[b]));
+  }
+  dprintf(fd, " more\n");
+  for (size_t i = 1; i < kTypes; i++) {
+    if (tx_[i].packets.load() == 0) continue;
+    dprintf(fd, "  %-8s", kTypeNames[i]);
+    for (size_t b = 0; b < kLatencyBuckets; b++) {
+      dprintf(fd, " %llu", static_cast<unsigned long long>(latency_[i][b].load()));
+    }
+    dprintf(fd, "\n");
+  }
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
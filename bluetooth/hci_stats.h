@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "hci_internals.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Traffic and session counters of the HAL, kept for the life of the service.
+// Updates are relaxed atomics, so any thread can record without locking.
+// Byte counts are also published as atrace counters for Perfetto.
+class HciStats {
+ public:
+  static uint64_t Now();
+
+  // latency_ns covers the time from send() to the socket write.
+  void OnSent(::android::hardware::bluetooth::hci::PacketType type,
+              size_t length, uint64_t latency_ns);
+  void OnReceived(::android::hardware::bluetooth::hci::PacketType type,
+                  size_t length);
+  void OnSocketFull() { socket_full_.fetch_add(1, std::memory_order_relaxed); }
+
+  void OnOpen(uint64_t duration_ns, bool ok);
+  void OnClose(uint64_t duration_ns);
+  void OnDisconnect() { disconnects_.fetch_add(1, std::memory_order_relaxed); }
+
+  void Dump(int fd) const;
+
+ private:
+  // Indexed by PacketType
+  static constexpr size_t kTypes = 6;
+  // Upper bounds in microseconds, the last bucket is open ended.
+  static constexpr uint64_t kLatencyBoundsUs[] = {50,   100,  250,   500,
+                                                  1000, 2000, 5000,  10000,
+                                                  50000};
+  static constexpr size_t kLatencyBuckets =
+      sizeof(kLatencyBoundsUs) / sizeof(kLatencyBoundsUs[0]) + 1;
+
+  struct Counter {
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+  };
+
+  Counter tx_[kTypes];
+  Counter rx_[kTypes];
+  std::atomic<uint64_t> latency_[kTypes][kLatencyBuckets] = {};
+  std::atomic<uint64_t> socket_full_{0};
+
+  std::atomic<uint64_t> opens_{0};
+  std::atomic<uint64_t> open_failures_{0};
+  std::atomic<uint64_t> closes_{0};
+  std::atomic<uint64_t> disconnects_{0};
+  std::atomic<uint64_t> last_open_ns_{0};
+  std::atomic<uint64_t> last_close_ns_{0};
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
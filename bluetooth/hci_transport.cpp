@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.bluetooth.service.rpi"
+
+#include "hci_transport.h"
+
+#include <android-base/properties.h>
+#include <log/log.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "net_bluetooth_mgmt.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+std::unique_ptr<HciTransport> HciTransport::Create() {
+  std::string spec =
+      ::android::base::GetProperty("vendor.bluetooth.hci_transport", "");
+
+  if (spec.compare(0, 7, "socket:") == 0) {
+    ALOGI("using emulated controller at %s", spec.c_str() + 7);
+    return std::make_unique<SocketHciTransport>(spec.substr(7));
+  }
+  if (!spec.empty()) {
+    ALOGE("unknown hci transport %s, using the user channel", spec.c_str());
+  }
+  return std::make_unique<NetBluetoothMgmt>();
+}
+
+int SocketHciTransport::openHci(int /* hci_interface */) {
+  // A socketpair() end is only good for one session.
+  if (path_.empty()) {
+    return fd_;
+  }
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    ALOGE("socket path too long: %s", path_.c_str());
+    return -1;
+  }
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    ALOGE("unable to open unix socket: %s", strerror(errno));
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ALOGE("unable to connect to %s: %s", path_.c_str(), strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+
+  fd_ = fd;
+  return fd;
+}
+
+void SocketHciTransport::closeHci() {
+  if (fd_ != -1) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
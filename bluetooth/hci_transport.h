@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Where BluetoothHci gets its HCI socket from. The socket must carry one H4
+// packet (type byte + HCI packet) per datagram, like the kernel user channel.
+class HciTransport {
+ public:
+  virtual ~HciTransport() = default;
+
+  // Returns the socket, or -1 on failure.
+  virtual int openHci(int hci_interface = 0) = 0;
+  virtual void closeHci() = 0;
+
+  // Transport specific statistics for the binder dump().
+  virtual void dump(int /* fd */) {}
+
+  // Picks the transport named by vendor.bluetooth.hci_transport:
+  //   unset               kernel user channel, see NetBluetoothMgmt
+  //   "socket:<path>"     AF_UNIX seqpacket socket of a controller emulator
+  static std::unique_ptr<HciTransport> Create();
+};
+
+// Controller emulator on an AF_UNIX SOCK_SEQPACKET socket, either connected
+// to a path or handed over as one end of a socketpair().
+class SocketHciTransport : public HciTransport {
+ public:
+  explicit SocketHciTransport(const std::string& path) : path_(path) {}
+  explicit SocketHciTransport(int fd) : fd_(fd) {}
+  ~SocketHciTransport() override { closeHci(); }
+
+  int openHci(int hci_interface = 0) override;
+  void closeHci() override;
+
+ private:
+  std::string path_;
+  int fd_{-1};
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
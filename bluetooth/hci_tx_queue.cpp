@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.bluetooth.service.rpi"
+
+#include "hci_tx_queue.h"
+
+#include <android-base/properties.h>
+#include <log/log.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+using ::android::hardware::bluetooth::hci::PacketType;
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+HciTxQueue::HciTxQueue(int fd, HciSnoop* snoop, HciStats* stats)
+    : fd_(fd),
+      snoop_(snoop),
+      stats_(stats),
+      lanes_{
+          {PacketType::COMMAND, 8, {}},
+          {PacketType::SCO_DATA, 16, {}},
+          {PacketType::ISO_DATA, 32, {}},
+          {PacketType::ACL_DATA, 64, {}},
+      },
+      flow_control_(::android::base::GetBoolProperty(
+          "persist.vendor.bluetooth.flow_control", false)) {}
+
+HciTxQueue::~HciTxQueue() {
+  Stop();
+  if (wake_fd_ >= 0) {
+    ::close(wake_fd_);
+  }
+}
+
+bool HciTxQueue::Start() {
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ < 0) {
+    ALOGE("unable to create tx wake eventfd: %s", strerror(errno));
+    return false;
+  }
+
+  running_ = true;
+  writer_ = std::thread([this]() { WriterLoop(); });
+  return true;
+}
+
+void HciTxQueue::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    running_ = false;
+    for (auto& lane : lanes_) {
+      lane.packets.clear();
+    }
+  }
+  not_empty_.notify_all();
+  not_full_.notify_all();
+
+  if (writer_.joinable()) {
+    uint64_t value = 1;
+    TEMP_FAILURE_RETRY(write(wake_fd_, &value, sizeof(value)));
+    writer_.join();
+  }
+}
+
+bool HciTxQueue::Enqueue(PacketType type, const std::vector<uint8_t>& packet) {
+  Lane* lane = LaneFor(type);
+  if (lane == nullptr) {
+    ALOGE("unexpected outbound packet type %d", static_cast<int>(type));
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_full_.wait(lock, [this, lane]() {
+    return !running_ || lane->packets.size() < lane->capacity;
+  });
+  if (!running_) {
+    return false;
+  }
+
+  lane->packets.push_back({packet, HciStats::Now()});
+  lock.unlock();
+  not_empty_.notify_one();
+  return true;
+}
+
+void HciTxQueue::OnEvent(const std::vector<uint8_t>& event) {
+  bool credits;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    credits = flow_.OnEvent(event);
+  }
+  if (credits && flow_control_) {
+    not_empty_.notify_one();
+  }
+}
+
+void HciTxQueue::Dump(int fd) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  dprintf(fd, "tx flow control: %s\n", flow_control_ ? "enabled" : "disabled");
+  dprintf(fd, "  commands: %u in flight, %u credits\n", flow_.commandsInFlight(),
+          flow_.commandCredits());
+  dprintf(fd, "  acl: %u/%u buffers in use, le: %u/%u buffers in use\n",
+          flow_.aclInFlight(), flow_.aclBuffers(), flow_.leInFlight(),
+          flow_.leBuffers());
+  for (auto& lane : lanes_) {
+    dprintf(fd, "  queue type %d: %zu/%zu\n", static_cast<int>(lane.type),
+            lane.packets.size(), lane.capacity);
+  }
+}
+
+HciTxQueue::Lane* HciTxQueue::LaneFor(PacketType type) {
+  for (auto& lane : lanes_) {
+    if (lane.type == type) {
+      return &lane;
+    }
+  }
+  return nullptr;
+}
+
+HciTxQueue::Lane* HciTxQueue::NextLane() {
+  for (auto& lane : lanes_) {
+    if (!lane.packets.empty() &&
+        (!flow_control_ || flow_.CanSend(lane.type, lane.packets.front().packet))) {
+      return &lane;
+    }
+  }
+  return nullptr;
+}
+
+// The user channel is a datagram socket: a packet is either written whole or
+// not at all, so a full socket buffer shows up as EAGAIN.
+bool HciTxQueue::Write(PacketType type, const Pending& pending) {
+  const std::vector<uint8_t>& packet = pending.packet;
+  uint8_t indicator = static_cast<uint8_t>(type);
+  struct iovec iov[2] = {
+      {&indicator, sizeof(indicator)},
+      {const_cast<uint8_t*>(packet.data()), packet.size()},
+  };
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  for (;;) {
+    if (TEMP_FAILURE_RETRY(sendmsg(fd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) >= 0) {
+      snoop_->Record(type, false, packet.data(), packet.size());
+      stats_->OnSent(type, packet.size(), HciStats::Now() - pending.queued_ns);
+      return true;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ALOGE("error writing to hci socket: %s", strerror(errno));
+      return false;
+    }
+    stats_->OnSocketFull();
+
+    struct pollfd pfds[2] = {
+        {fd_, POLLOUT, 0},
+        {wake_fd_, POLLIN, 0},
+    };
+    if (TEMP_FAILURE_RETRY(poll(pfds, 2, -1)) < 0) {
+      ALOGE("poll error: %s", strerror(errno));
+      return false;
+    }
+    if (pfds[1].revents & POLLIN) {
+      // Stop() gave up on this packet.
+      return false;
+    }
+  }
+}
+
+void HciTxQueue::WriterLoop() {
+  for (;;) {
+    PacketType type;
+    Pending pending;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock,
+                      [this]() { return !running_ || NextLane() != nullptr; });
+      if (!running_) {
+        return;
+      }
+
+      Lane* lane = NextLane();
+      type = lane->type;
+      pending = std::move(lane->packets.front());
+      lane->packets.pop_front();
+      flow_.OnSent(type, pending.packet);
+    }
+    not_full_.notify_all();
+
+    if (!Write(type, pending)) {
+      break;
+    }
+  }
+
+  // The socket is unusable, fail pending and future sends.
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    running_ = false;
+    for (auto& lane : lanes_) {
+      lane.packets.clear();
+    }
+  }
+  not_full_.notify_all();
+}
+
+}  // namespace aidl::android::hardware::bluetooth::impl
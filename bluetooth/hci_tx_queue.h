@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hci_flow_control.h"
+#include "hci_internals.h"
+#include "hci_snoop.h"
+#include "hci_stats.h"
+
+namespace aidl::android::hardware::bluetooth::impl {
+
+// Outbound HCI packets, queued per packet type and written to the user
+// channel socket by a dedicated thread. Commands are written first, then
+// SCO and ISO, then ACL, so an A2DP burst cannot hold back a command. Only
+// the writer thread ever waits for socket buffer space, and Stop() can
+// interrupt it.
+//
+// With persist.vendor.bluetooth.flow_control set, packets are also held back
+// until the controller has credits for them, so an over-sending stack fills
+// these bounded queues, and blocks in Enqueue(), instead of the socket.
+class HciTxQueue {
+ public:
+  HciTxQueue(int fd, HciSnoop* snoop, HciStats* stats);
+  ~HciTxQueue();
+
+  bool Start();
+
+  // Drops anything still queued and joins the writer thread. Senders blocked
+  // in Enqueue() are released and get false.
+  void Stop();
+
+  // Blocks while the queue for this packet type is full. Returns false once
+  // the queue is stopped or the socket failed.
+  bool Enqueue(::android::hardware::bluetooth::hci::PacketType type,
+               const std::vector<uint8_t>& packet);
+
+  // Feeds a received HCI event to the credit accounting.
+  void OnEvent(const std::vector<uint8_t>& event);
+
+  void Dump(int fd);
+
+ private:
+  struct Pending {
+    std::vector<uint8_t> packet;
+    uint64_t queued_ns;
+  };
+  struct Lane {
+    ::android::hardware::bluetooth::hci::PacketType type;
+    size_t capacity;
+    std::deque<Pending> packets;
+  };
+
+  Lane* LaneFor(::android::hardware::bluetooth::hci::PacketType type);
+  Lane* NextLane();
+  bool Write(::android::hardware::bluetooth::hci::PacketType type,
+             const Pending& pending);
+  void WriterLoop();
+
+  int fd_;
+  HciSnoop* snoop_;
+  HciStats* stats_;
+  int wake_fd_{-1};
+
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  // In priority order.
+  Lane lanes_[4];
+  bool running_{false};
+  bool flow_control_;
+  HciFlowControl flow_;
+  std::thread writer_;
+};
+
+}  // namespace aidl::android::hardware::bluetooth::impl
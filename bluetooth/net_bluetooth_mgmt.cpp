@@ -19,6 +19,8 @@
 
 #include "net_bluetooth_mgmt.h"
 
+#include <android-base/properties.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <log/log.h>
 #include <poll.h>
@@ -26,9 +28,14 @@
 #include <unistd.h>
 
 #include <cerrno>
+#include <chrono>
+#include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
+
+#include "hci_stats.h"
 
 // Definitions imported from <linux/net/bluetooth/bluetooth.h>
 #define BTPROTO_HCI 1
@@ -45,8 +52,9 @@ struct sockaddr_hci {
 };
 
 // Definitions imported from <linux/net/bluetooth/mgmt.h>
-#define MGMT_OP_READ_INDEX_LIST 0x0003
-#define MGMT_EV_INDEX_ADDED 0x0004
+#define MGMT_OP_READ_EXT_INDEX_LIST 0x003C
+#define MGMT_EV_EXT_INDEX_ADDED 0x0020
+#define MGMT_EV_EXT_INDEX_REMOVED 0x0021
 #define MGMT_EV_CMD_COMPLETE 0x0001
 #define MGMT_PKT_SIZE_MAX 1024
 #define MGMT_INDEX_NONE 0xFFFF
@@ -61,33 +69,143 @@ struct mgmt_pkt {
   uint8_t data[MGMT_PKT_SIZE_MAX];
 } __attribute__((packed));
 
-struct mgmt_ev_read_index_list {
+struct mgmt_ev_read_ext_index_list {
   uint16_t opcode;
   uint8_t status;
   uint16_t num_controllers;
-  uint16_t index[];
+  struct {
+    uint16_t index;
+    uint8_t type;
+    uint8_t bus;
+  } __attribute__((packed)) entry[];
+} __attribute__((packed));
+
+struct mgmt_ev_ext_index {
+  uint8_t type;
+  uint8_t bus;
 } __attribute__((packed));
 
+// Controller types in the extended index list, only configured primary
+// controllers can be used.
+#define MGMT_TYPE_PRIMARY 0x00
+
+// Definitions imported from <linux/net/bluetooth/hci.h>
+#define HCI_COMMAND_PKT 0x01
+#define HCI_EVENT_PKT 0x04
+#define HCI_EV_CMD_COMPLETE 0x0e
+#define HCI_EV_CMD_STATUS 0x0f
+#define HCI_OP_RESET 0x0c03
+#define HCI_OP_READ_LOCAL_FEATURES 0x1003
+#define HCI_OP_READ_BD_ADDR 0x1009
+#define HCI_OP_LE_READ_LOCAL_FEATURES 0x2003
+
+// LMP feature bit 38, LE Supported (Controller)
+#define LMP_LE_BYTE 4
+#define LMP_LE_BIT 0x40
+
+// LE feature bits
+#define LE_FEATURE_2M_PHY (1ULL << 8)
+#define LE_FEATURE_CODED_PHY (1ULL << 11)
+#define LE_FEATURE_ISO (7ULL << 28)  // CIS central, CIS peripheral, broadcaster
+
 namespace aidl::android::hardware::bluetooth::impl {
 
-// Wait indefinitely for the selected HCI interface to be enabled in the
-// bluetooth driver.
-int NetBluetoothMgmt::waitHciDev(int hci_interface) {
-  ALOGI("waiting for hci interface %d", hci_interface);
+// Upper bound for the HCI interface to show up, covers the firmware download
+// of the onboard controller at boot.
+static constexpr int kWaitHciDevTimeoutMs = 10000;
+
+// Upper bound for each HCI command of a controller probe.
+static constexpr int kProbeTimeoutMs = 2000;
+
+// Upper bound for the HCI_Reset issued when a warm session was parked.
+static constexpr int kResumeTimeoutMs = 500;
+
+// Indexed by the mgmt bus type.
+static const char* const kBusNames[] = {"virtual", "usb",  "pccard", "uart",
+                                        "rs232",   "pci",  "sdio",   "spi",
+                                        "i2c",     "smd",  "virtio"};
+
+static const char* busName(uint8_t bus) {
+  return bus < sizeof(kBusNames) / sizeof(kBusNames[0]) ? kBusNames[bus]
+                                                        : "unknown";
+}
 
-  int ret = -1;
-  struct mgmt_pkt cmd;
-  struct pollfd pollfd;
+// Waits for the Command Complete of opcode on a user channel socket and
+// collects its return parameters, without the status byte. Other events
+// are dropped.
+static bool waitCommandComplete(int fd, uint16_t opcode, int timeout_ms,
+                                std::vector<uint8_t>* params) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeout_ms);
+  struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
+
+  for (;;) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0) {
+      ALOGE("timed out waiting for hci command 0x%04x", opcode);
+      return false;
+    }
+    int ret = poll(&pollfd, 1, remaining.count());
+    if (ret == -1 && errno != EINTR) {
+      ALOGE("poll error: %s", strerror(errno));
+      return false;
+    }
+    if (ret <= 0) continue;
+
+    uint8_t ev[260];
+    ssize_t n = read(fd, ev, sizeof(ev));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      ALOGE("error reading hci event: %s", strerror(errno));
+      return false;
+    }
+    if (n < 7 || ev[0] != HCI_EVENT_PKT) continue;
+
+    if (ev[1] == HCI_EV_CMD_COMPLETE && (ev[4] | ev[5] << 8) == opcode) {
+      if (ev[6] != 0) return false;
+      params->assign(ev + 7, ev + n);
+      return true;
+    }
+    // Unknown commands fail through Command Status.
+    if (ev[1] == HCI_EV_CMD_STATUS && (ev[5] | ev[6] << 8) == opcode &&
+        ev[3] != 0) {
+      return false;
+    }
+  }
+}
+
+static bool sendCommand(int fd, uint16_t opcode) {
+  uint8_t cmd[4] = {HCI_COMMAND_PKT, static_cast<uint8_t>(opcode & 0xff),
+                    static_cast<uint8_t>(opcode >> 8), 0};
+  ssize_t len;
+  WRITE_NO_INTR(len = send(fd, cmd, sizeof(cmd), MSG_DONTWAIT));
+  if (len != sizeof(cmd)) {
+    ALOGE("error writing hci command 0x%04x: %s", opcode, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Sends one HCI command and waits for its Command Complete.
+static bool hciCommand(int fd, uint16_t opcode, std::vector<uint8_t>* params) {
+  return sendCommand(fd, opcode) &&
+         waitCommandComplete(fd, opcode, kProbeTimeoutMs, params);
+}
+
+// Open and bind a socket to the bluetooth control interface in the kernel
+// driver, used to send control commands and receive control events. The
+// socket is kept for the lifetime of the HAL so later opens only need the
+// events queued since.
+int NetBluetoothMgmt::openControl() {
   struct sockaddr_hci hci_addr = {
       .hci_family = AF_BLUETOOTH,
       .hci_dev = HCI_DEV_NONE,
       .hci_channel = HCI_CHANNEL_CONTROL,
   };
 
-  // Open and bind a socket to the bluetooth control interface in the
-  // kernel driver, used to send control commands and receive control
-  // events.
-  int fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+  int fd = socket(PF_BLUETOOTH, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  BTPROTO_HCI);
   if (fd < 0) {
     ALOGE("unable to open raw bluetooth socket: %s", strerror(errno));
     return -1;
@@ -95,127 +213,371 @@ int NetBluetoothMgmt::waitHciDev(int hci_interface) {
 
   if (bind(fd, (struct sockaddr*)&hci_addr, sizeof(hci_addr)) < 0) {
     ALOGE("unable to bind bluetooth control channel: %s", strerror(errno));
-    goto end;
+    ::close(fd);
+    return -1;
   }
 
-  // Send the control command [Read Index List].
-  cmd = {
-      .opcode = MGMT_OP_READ_INDEX_LIST,
+  // Send the control command [Read Extended Index List], the response is
+  // picked up by readControlEvents() like any other event. From then on the
+  // kernel sends this socket the extended index events, which carry the bus.
+  struct mgmt_pkt cmd = {
+      .opcode = MGMT_OP_READ_EXT_INDEX_LIST,
       .index = MGMT_INDEX_NONE,
       .len = 0,
   };
 
   if (write(fd, &cmd, 6) != 6) {
     ALOGE("error writing mgmt command: %s", strerror(errno));
-    goto end;
+    ::close(fd);
+    return -1;
   }
 
-  // Poll the control socket waiting for the command response,
-  // and subsequent [Index Added] events. The loops continue without
-  // timeout until the selected hci interface is detected.
-  pollfd = {.fd = fd, .events = POLLIN};
+  ctrl_fd_ = fd;
+  controllers_.clear();
+  claimed_.clear();
+  selected_ = -1;
+  control_opens_++;
+  return 0;
+}
 
-  for (;;) {
-    ret = poll(&pollfd, 1, -1);
+void NetBluetoothMgmt::closeControl() {
+  if (ctrl_fd_ >= 0) {
+    ::close(ctrl_fd_);
+    ctrl_fd_ = -1;
+  }
+  controllers_.clear();
+  claimed_.clear();
+  selected_ = -1;
+}
 
-    // Poll interrupted, try again.
-    if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
+// Apply the control events queued on the control socket to the cached
+// index list. Returns -1 if the socket failed.
+int NetBluetoothMgmt::readControlEvents() {
+  for (;;) {
+    struct mgmt_pkt ev {};
+    ssize_t ret = read(ctrl_fd_, &ev, sizeof(ev));
+    if (ret < 0 && errno == EINTR) {
       continue;
     }
-
-    // Poll failure, abandon.
-    if (ret == -1) {
-      ALOGE("poll error: %s", strerror(errno));
-      break;
-    }
-
-    // Spurious wakeup, try again.
-    if (ret == 0 || (pollfd.revents & POLLIN) == 0) {
-      continue;
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
     }
-
-    // Read the next control event.
-    struct mgmt_pkt ev {};
-    ret = read(fd, &ev, sizeof(ev));
     if (ret < 0) {
       ALOGE("error reading mgmt event: %s", strerror(errno));
-      goto end;
+      return -1;
     }
 
-    // Received [Read Index List] command response.
-    if (ev.opcode == MGMT_EV_CMD_COMPLETE) {
-      struct mgmt_ev_read_index_list* data =
-          (struct mgmt_ev_read_index_list*)ev.data;
-
-      // Prefer the exact hci_interface
-      for (int i = 0; i < data->num_controllers; i++) {
-        if (data->index[i] == hci_interface) {
-          ALOGI("hci interface %d found", data->index[i]);
-          ret = data->index[i];
-          goto end;
+    switch (ev.opcode) {
+      // Received [Read Extended Index List] command response.
+      case MGMT_EV_CMD_COMPLETE: {
+        struct mgmt_ev_read_ext_index_list* data =
+            (struct mgmt_ev_read_ext_index_list*)ev.data;
+        if (data->opcode != MGMT_OP_READ_EXT_INDEX_LIST || data->status != 0) {
+          break;
         }
+        controllers_.clear();
+        for (int i = 0; i < data->num_controllers; i++) {
+          if (data->entry[i].type != MGMT_TYPE_PRIMARY) continue;
+          controllers_[data->entry[i].index].bus = data->entry[i].bus;
+        }
+        break;
+      }
+
+      // Received [Extended Index Added] event.
+      case MGMT_EV_EXT_INDEX_ADDED: {
+        struct mgmt_ev_ext_index* data = (struct mgmt_ev_ext_index*)ev.data;
+        if (data->type != MGMT_TYPE_PRIMARY) break;
+        ALOGI("hci interface %d added, bus %s", ev.index, busName(data->bus));
+        // A new controller may be a better pick.
+        if (controllers_.count(ev.index) == 0) selected_ = -1;
+        Controller& controller = controllers_[ev.index];
+        controller.present = true;
+        controller.bus = data->bus;
+        break;
       }
 
-      // Accept a larger one if we can't find the exact one
-      for (int i = 0; i < data->num_controllers; i++) {
-        if (data->index[i] >= hci_interface) {
-          ALOGI("hci interface %d found", data->index[i]);
-          ret = data->index[i];
-          goto end;
+      // Received [Extended Index Removed] event, this is also sent while the
+      // user channel holds the interface.
+      case MGMT_EV_EXT_INDEX_REMOVED:
+        ALOGI("hci interface %d removed", ev.index);
+        if (auto claim = claimed_.find(ev.index); claim != claimed_.end()) {
+          claimed_.erase(claim);
+          auto it = controllers_.find(ev.index);
+          if (it != controllers_.end()) it->second.present = false;
+        } else {
+          controllers_.erase(ev.index);
+          if (selected_ == ev.index) selected_ = -1;
         }
+        break;
+    }
+  }
+}
+
+// Reads the address and LE features of a controller. This resets it, so it
+// is done once per controller and only when the selection needs it.
+bool NetBluetoothMgmt::probeController(int hci, Controller& controller) {
+  if (controller.probed) return true;
+
+  int fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+  if (fd < 0) {
+    ALOGE("unable to open raw bluetooth socket: %s", strerror(errno));
+    return false;
+  }
+
+  struct sockaddr_hci hci_addr = {
+      .hci_family = AF_BLUETOOTH,
+      .hci_dev = static_cast<uint16_t>(hci),
+      .hci_channel = HCI_CHANNEL_USER,
+  };
+  if (bind(fd, (struct sockaddr*)&hci_addr, sizeof(hci_addr)) < 0) {
+    ALOGE("unable to probe hci interface %d: %s", hci, strerror(errno));
+    ::close(fd);
+    return false;
+  }
+  claimed_.insert(hci);
+
+  std::vector<uint8_t> params;
+  bool ok = hciCommand(fd, HCI_OP_RESET, &params) &&
+            hciCommand(fd, HCI_OP_READ_BD_ADDR, &params) && params.size() >= 6;
+  if (ok) {
+    memcpy(controller.address, params.data(), 6);
+    controller.le_features = 0;
+    if (hciCommand(fd, HCI_OP_READ_LOCAL_FEATURES, &params) &&
+        params.size() >= 8 && (params[LMP_LE_BYTE] & LMP_LE_BIT) &&
+        hciCommand(fd, HCI_OP_LE_READ_LOCAL_FEATURES, &params) &&
+        params.size() >= 8) {
+      for (int i = 0; i < 8; i++) {
+        controller.le_features |= static_cast<uint64_t>(params[i]) << (8 * i);
+      }
+    }
+    controller.probed = true;
+    ALOGI("hci interface %d: %02x:%02x:%02x:%02x:%02x:%02x, le features %016llx",
+          hci, controller.address[5], controller.address[4],
+          controller.address[3], controller.address[2], controller.address[1],
+          controller.address[0],
+          static_cast<unsigned long long>(controller.le_features));
+  }
+  ::close(fd);
+  return ok;
+}
+
+bool NetBluetoothMgmt::matches(const std::string& selector, int hci,
+                               Controller& controller) {
+  unsigned index;
+  uint8_t addr[6];
+  char end;
+
+  if (sscanf(selector.c_str(), "hci%u%c", &index, &end) == 1) {
+    return static_cast<int>(index) == hci;
+  }
+  if (sscanf(selector.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c", &addr[5],
+             &addr[4], &addr[3], &addr[2], &addr[1], &addr[0], &end) == 6) {
+    return probeController(hci, controller) &&
+           memcmp(addr, controller.address, sizeof(addr)) == 0;
+  }
+  if (selector == "iso") {
+    return probeController(hci, controller) &&
+           (controller.le_features & LE_FEATURE_ISO);
+  }
+  if (selector == "coded") {
+    return probeController(hci, controller) &&
+           (controller.le_features & LE_FEATURE_CODED_PHY);
+  }
+  return selector == busName(controller.bus);
+}
+
+int NetBluetoothMgmt::score(int hci, Controller& controller) {
+  int score = controller.bus == 1 /* usb */ ? 1 : 0;
+
+  if (probeController(hci, controller)) {
+    if (controller.le_features & LE_FEATURE_ISO) score += 8;
+    if (controller.le_features & LE_FEATURE_CODED_PHY) score += 4;
+    if (controller.le_features & LE_FEATURE_2M_PHY) score += 2;
+  }
+  return score;
+}
+
+// Picks the controller to use among those at or above hci_interface, or
+// returns -1 if none of them fits the selector yet. The choice stands for
+// as long as that controller stays plugged in and the selector is unchanged.
+int NetBluetoothMgmt::selectController(int hci_interface) {
+  if (selected_ >= hci_interface && controllers_.count(selected_) &&
+      controllers_[selected_].present) {
+    return selected_;
+  }
+
+  int best = -1;
+  int best_score = -1;
+  size_t candidates = 0;
+  for (auto& [hci, controller] : controllers_) {
+    if (hci >= hci_interface && controller.present) candidates++;
+  }
+
+  for (auto& [hci, controller] : controllers_) {
+    if (hci < hci_interface || !controller.present) continue;
+
+    if (selector_ != "auto") {
+      if (matches(selector_, hci, controller)) {
+        best = hci;
+        break;
       }
+      continue;
     }
 
-    // Received [Index Added] event.
-    if (ev.opcode == MGMT_EV_INDEX_ADDED && ev.index == hci_interface) {
-      ALOGI("hci interface %d added", hci_interface);
-      ret = hci_interface;
-      goto end;
+    // Nothing to compare, spare the controller a reset.
+    if (candidates == 1) {
+      best = hci;
+      break;
+    }
+    int s = score(hci, controller);
+    if (s > best_score) {
+      best = hci;
+      best_score = s;
     }
   }
 
-end:
-  ::close(fd);
-  return ret;
+  selected_ = best;
+  if (best >= 0) updateSummary();
+  return best;
+}
+
+void NetBluetoothMgmt::updateSummary() {
+  std::string summary;
+  char line[128];
+
+  for (auto& [hci, controller] : controllers_) {
+    if (controller.probed) {
+      snprintf(line, sizeof(line),
+               "  %shci%d: bus %s, %02x:%02x:%02x:%02x:%02x:%02x, le features "
+               "%016llx\n",
+               hci == selected_ ? "*" : " ", hci, busName(controller.bus),
+               controller.address[5], controller.address[4],
+               controller.address[3], controller.address[2],
+               controller.address[1], controller.address[0],
+               static_cast<unsigned long long>(controller.le_features));
+    } else {
+      snprintf(line, sizeof(line), "  %shci%d: bus %s, not probed\n",
+               hci == selected_ ? "*" : " ", hci, busName(controller.bus));
+    }
+    summary += line;
+  }
+
+  std::lock_guard<std::mutex> guard(summary_mutex_);
+  summary_ = std::move(summary);
+}
+
+// Wait for the selected HCI interface to be enabled in the bluetooth driver,
+// for at most kWaitHciDevTimeoutMs.
+int NetBluetoothMgmt::waitHciDev(int hci_interface) {
+  std::string selector = ::android::base::GetProperty(
+      "persist.vendor.bluetooth.controller", "auto");
+  if (selector.empty()) selector = "auto";
+  if (selector != selector_) {
+    selector_ = selector;
+    selected_ = -1;
+  }
+  ALOGI("waiting for hci interface %d, controller %s", hci_interface,
+        selector_.c_str());
+
+  if (ctrl_fd_ < 0 && openControl() < 0) {
+    return -1;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(kWaitHciDevTimeoutMs);
+  struct pollfd pollfd = {.fd = ctrl_fd_, .events = POLLIN};
+
+  for (;;) {
+    if (readControlEvents() < 0) {
+      closeControl();
+      return -1;
+    }
+
+    int hci = selectController(hci_interface);
+    if (hci >= 0) {
+      ALOGI("hci interface %d found", hci);
+      return hci;
+    }
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0) {
+      ALOGE("timed out waiting for hci interface %d", hci_interface);
+      return -1;
+    }
+
+    int ret = poll(&pollfd, 1, remaining.count());
+
+    // Poll failure, abandon. The control socket is reopened next time.
+    if (ret == -1 && errno != EINTR && errno != EAGAIN) {
+      ALOGE("poll error: %s", strerror(errno));
+      closeControl();
+      return -1;
+    }
+  }
 }
 
 int NetBluetoothMgmt::findRfKill() {
-    char rfkill_type[64];
-    char type[16];
-    int fd, size, i;
-    for(i = 0; rfkill_state_ == NULL; i++)
-    {
-        snprintf(rfkill_type, sizeof(rfkill_type), "/sys/class/rfkill/rfkill%d/type", i);
-        if ((fd = open(rfkill_type, O_RDONLY)) < 0)
-        {
-            ALOGE("open(%s) failed: %s (%d)\n", rfkill_type, strerror(errno), errno);
-            return -1;
-        }
+  char path[PATH_MAX];
+  char type[16];
+  struct dirent* entry;
+  DIR* dir;
+  int fd, size;
 
-        size = read(fd, &type, sizeof(type));
-        ::close(fd);
+  if (rfkill_state_ != NULL) return 0;
 
-        if ((size >= 9) && !memcmp(type, "bluetooth", 9))
-        {
-            ::asprintf(&rfkill_state_, "/sys/class/rfkill/rfkill%d/state", i);
-            break;
-        }
+  dir = opendir("/sys/class/rfkill");
+  if (dir == NULL) {
+    ALOGE("opendir(/sys/class/rfkill) failed: %s (%d)\n", strerror(errno), errno);
+    return -1;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "rfkill", 6)) continue;
+
+    snprintf(path, sizeof(path), "/sys/class/rfkill/%s/type", entry->d_name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) continue;
+
+    size = read(fd, &type, sizeof(type));
+    ::close(fd);
+
+    if ((size >= 9) && !memcmp(type, "bluetooth", 9)) {
+      ::asprintf(&rfkill_state_, "/sys/class/rfkill/%s/state", entry->d_name);
+      break;
     }
-    return 0;
+  }
+  closedir(dir);
+
+  return rfkill_state_ != NULL ? 0 : -1;
 }
 
 int NetBluetoothMgmt::rfKill(int block) {
   int fd;
   char on = (block)?'1':'0';
+  char state;
   if (findRfKill() != 0) return 0;
 
-  fd = open(rfkill_state_, O_WRONLY);
+  fd = open(rfkill_state_, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT) {
+    // The rfkill device was re-registered under another index.
+    free(rfkill_state_);
+    rfkill_state_ = NULL;
+    if (findRfKill() != 0) return 0;
+    fd = open(rfkill_state_, O_RDWR | O_CLOEXEC);
+  }
   if (fd < 0) {
     ALOGE( "Unable to open /dev/rfkill");
     return -1;
   }
+
+  // Skip the write, and the driver work behind it, if nothing changes.
+  if (read(fd, &state, 1) == 1 && state == on) {
+    ::close(fd);
+    return 0;
+  }
+
   ssize_t len;
-  WRITE_NO_INTR(len = write(fd, &on, 1));
+  WRITE_NO_INTR(len = pwrite(fd, &on, 1, 0));
   if (len < 0) {
     ALOGE( "Failed to change rfkill state");
     ::close(fd);
@@ -227,13 +589,28 @@ int NetBluetoothMgmt::rfKill(int block) {
 
 int NetBluetoothMgmt::openHci(int hci_interface) {
   ALOGI("opening hci interface %d", hci_interface);
+  opens_++;
+
+  uint64_t start = HciStats::Now();
+  if (parked_) {
+    int fd = resumeHci(hci_interface);
+    if (fd >= 0) {
+      wait_ns_ = HciStats::Now() - start;
+      rfkill_ns_ = 0;
+      bind_ns_ = 0;
+      return fd;
+    }
+  }
 
   // Block Bluetooth.
-  rfkill_state_ = NULL;
   rfKill(1);
+  uint64_t rfkilled = HciStats::Now();
+  rfkill_ns_ = rfkilled - start;
 
   // Wait for the HCI interface to complete initialization or to come online.
   int hci = waitHciDev(hci_interface);
+  uint64_t found = HciStats::Now();
+  wait_ns_ = found - rfkilled;
   if (hci < 0) {
     ALOGE("hci interface %d not found", hci_interface);
     return -1;
@@ -253,18 +630,33 @@ int NetBluetoothMgmt::openHci(int hci_interface) {
   };
 
   // Bind the socket to the selected interface.
-  if (bind(fd, (struct sockaddr*)&hci_addr, sizeof(hci_addr)) < 0) {
+  int ret = bind(fd, (struct sockaddr*)&hci_addr, sizeof(hci_addr));
+  bind_ns_ = HciStats::Now() - found;
+  if (ret < 0) {
     ALOGE("unable to bind bluetooth user channel: %s", strerror(errno));
     ::close(fd);
     return -1;
   }
 
   ALOGI("hci interface %d ready", hci);
+  claimed_.insert(hci);
+  hci_dev_ = hci;
   bt_fd_ = fd;
   return fd;
 }
 
 void NetBluetoothMgmt::closeHci() {
+  if (bt_fd_ != -1 && ::android::base::GetBoolProperty(
+                          "persist.vendor.bluetooth.warm_restart", false) &&
+      sendCommand(bt_fd_, HCI_OP_RESET)) {
+    // Keep the user channel bound and the controller powered. The reset
+    // stops whatever the controller was doing, its completion is collected
+    // by the next openHci() so close does not wait for it.
+    ALOGI("hci interface %d parked", hci_dev_.load());
+    parked_ = true;
+    return;
+  }
+
   if (bt_fd_ != -1) {
     ::close(bt_fd_);
     bt_fd_ = -1;
@@ -272,7 +664,44 @@ void NetBluetoothMgmt::closeHci() {
 
   // Unblock Bluetooth.
   rfKill(0);
-  free(rfkill_state_);
+}
+
+// Picks up the user channel kept by closeHci(): drops whatever the last
+// session left in the socket, up to the completion of the parking reset.
+// On failure the socket is closed and openHci() takes the cold path.
+int NetBluetoothMgmt::resumeHci(int hci_interface) {
+  parked_ = false;
+
+  std::string selector = ::android::base::GetProperty(
+      "persist.vendor.bluetooth.controller", "auto");
+  if (selector.empty()) selector = "auto";
+
+  std::vector<uint8_t> params;
+  if (hci_dev_ >= hci_interface && selector == selector_ &&
+      waitCommandComplete(bt_fd_, HCI_OP_RESET, kResumeTimeoutMs, &params)) {
+    ALOGI("hci interface %d resumed", hci_dev_.load());
+    warm_opens_++;
+    return bt_fd_;
+  }
+
+  ALOGW("unable to resume hci interface %d", hci_dev_.load());
+  ::close(bt_fd_);
+  bt_fd_ = -1;
+  return -1;
+}
+
+void NetBluetoothMgmt::dump(int fd) {
+  dprintf(fd,
+          "user channel: hci%d, %llu opens (%llu warm), %llu control socket "
+          "opens\n",
+          hci_dev_.load(), static_cast<unsigned long long>(opens_.load()),
+          static_cast<unsigned long long>(warm_opens_.load()),
+          static_cast<unsigned long long>(control_opens_.load()));
+  dprintf(fd, "  last open: rfkill %.3f ms, wait for hci %.3f ms, bind %.3f ms\n",
+          rfkill_ns_.load() / 1e6, wait_ns_.load() / 1e6, bind_ns_.load() / 1e6);
+
+  std::lock_guard<std::mutex> guard(summary_mutex_);
+  dprintf(fd, "%s", summary_.c_str());
 }
 
 }  // namespace aidl::android::hardware::bluetooth::impl
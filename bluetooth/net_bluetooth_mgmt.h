@@ -19,26 +19,103 @@
 
 #include <unistd.h>
 
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "hci_transport.h"
+
 namespace aidl::android::hardware::bluetooth::impl {
 
-class NetBluetoothMgmt {
+// Kernel HCI user channel.
+//
+// With several controllers, e.g. the onboard one and a USB dongle, the one
+// to use is picked by persist.vendor.bluetooth.controller:
+//   unset or "auto"       best LE feature set, USB first on a tie
+//   "hci<N>"              that interface
+//   "usb", "uart", ...    first controller on that bus
+//   "xx:xx:xx:xx:xx:xx"   controller with that public address
+//   "iso", "coded"        first controller with LE ISO channels or Coded PHY
+// Ties go to the lowest interface number. Addresses and features are read
+// once per controller over the user channel and cached.
+//
+// With persist.vendor.bluetooth.warm_restart set, closeHci() only resets the
+// controller and keeps the user channel, skipping the rfkill transitions and
+// the rebind on the next openHci().
+class NetBluetoothMgmt : public HciTransport {
  public:
   NetBluetoothMgmt() {}
-  ~NetBluetoothMgmt() {
+  ~NetBluetoothMgmt() override {
     ::close(bt_fd_);
+    if (ctrl_fd_ >= 0) ::close(ctrl_fd_);
+    free(rfkill_state_);
   }
 
-  int openHci(int hci_interface = 0);
-  void closeHci();
+  int openHci(int hci_interface = 0) override;
+  void closeHci() override;
+  void dump(int fd) override;
 
  private:
+  struct Controller {
+    bool present{true};
+    uint8_t bus{0};
+    // Filled in by probeController()
+    bool probed{false};
+    uint8_t address[6]{};  // as on the wire, least significant byte first
+    uint64_t le_features{0};
+  };
+
+  int openControl();
+  void closeControl();
+  int readControlEvents();
+  bool matches(const std::string& selector, int hci, Controller& controller);
+  int score(int hci, Controller& controller);
+  int selectController(int hci_interface);
+  bool probeController(int hci, Controller& controller);
+  void updateSummary();
   int waitHciDev(int hci_interface);
+  int resumeHci(int hci_interface);
   int findRfKill();
   int rfKill(int block);
-  char *rfkill_state_;
 
-  // File descriptor opened to the bluetooth user channel.
+  // Cached across openHci() calls, rescanned only once the path goes away.
+  char *rfkill_state_{nullptr};
+
+  // File descriptor opened to the bluetooth user channel, still open after
+  // closeHci() while parked.
   int bt_fd_{-1};
+  bool parked_{false};
+
+  // Long-lived socket on the mgmt control channel, and the controllers it
+  // reported through [Read Extended Index List] and [Extended Index
+  // Added/Removed].
+  int ctrl_fd_{-1};
+  std::map<int, Controller> controllers_;
+  // One entry per user channel bind, the matching [Index Removed] is our
+  // own doing and keeps the cached probe.
+  std::multiset<int> claimed_;
+
+  // Selector the cached choice was made for.
+  std::string selector_;
+  int selected_{-1};
+
+  // Controller list as printed by dump(), rebuilt on each selection.
+  std::mutex summary_mutex_;
+  std::string summary_;
+
+  // Bring-up timings of the last openHci(), read by dump() from binder
+  // threads.
+  std::atomic<uint64_t> opens_{0};
+  std::atomic<uint64_t> warm_opens_{0};
+  std::atomic<uint64_t> control_opens_{0};
+  std::atomic<uint64_t> rfkill_ns_{0};
+  std::atomic<uint64_t> wait_ns_{0};
+  std::atomic<uint64_t> bind_ns_{0};
+  std::atomic<int> hci_dev_{-1};
 };
 
 }  // namespace aidl::android::hardware::bluetooth::impl
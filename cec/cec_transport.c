@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2021-2022 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hdmi_cec"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <log/log.h>
+#include <cutils/properties.h>
+
+#include "cec_transport.h"
+
+uint64_t cec_transport_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(cec_transport_t *t, uint8_t type, uint64_t ts_ns,
+        const void *data, uint8_t len)
+{
+    struct cec_record rec;
+
+    if (t->record_fd < 0)
+        return;
+
+    rec.hdr.ts_ns = ts_ns;
+    rec.hdr.type = type;
+    rec.hdr.len = len;
+    memcpy(rec.data, data, len);
+
+    pthread_mutex_lock(&t->record_lock);
+    if (write(t->record_fd, &rec, sizeof(rec.hdr) + len) < 0)
+        ALOGE("%s: %m\n", __func__);
+    pthread_mutex_unlock(&t->record_lock);
+}
+
+static void record_msg(cec_transport_t *t, uint8_t type, const struct cec_msg *msg)
+{
+    uint8_t data[CEC_RECORD_PAYLOAD_MAX];
+    uint8_t len = msg->len > CEC_MAX_MSG_SIZE ? CEC_MAX_MSG_SIZE : msg->len;
+
+    memcpy(data, msg->msg, len);
+    if (type == CEC_REC_TX) {
+        data[len++] = msg->tx_status;
+        record(t, type, msg->tx_ts ? msg->tx_ts : cec_transport_now_ns(), data, len);
+    } else {
+        record(t, type, msg->rx_ts ? msg->rx_ts : cec_transport_now_ns(), data, len);
+    }
+}
+
+static void record_event(cec_transport_t *t, const struct cec_event *ev)
+{
+    struct cec_record_event data = {
+        .event = ev->event,
+    };
+
+    if (ev->event == CEC_EVENT_STATE_CHANGE) {
+        data.phys_addr = ev->state_change.phys_addr;
+        data.log_addr_mask = ev->state_change.log_addr_mask;
+    }
+    record(t, CEC_REC_EVENT, ev->ts ? ev->ts : cec_transport_now_ns(),
+            &data, sizeof(data));
+}
+
+int cec_transport_start_recording(cec_transport_t *t, const char *path)
+{
+    struct cec_trace_header header = {
+        .version = CEC_TRACE_VERSION,
+    };
+
+    memcpy(header.magic, CEC_TRACE_MAGIC, sizeof(header.magic));
+
+    t->record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (t->record_fd < 0) {
+        ALOGE("%s: failed to open %s: %m\n", __func__, path);
+        return -errno;
+    }
+
+    if (write(t->record_fd, &header, sizeof(header)) != sizeof(header)) {
+        ALOGE("%s: failed to write header: %m\n", __func__);
+        close(t->record_fd);
+        t->record_fd = -1;
+        return -EIO;
+    }
+
+    ALOGI("%s: recording CEC traffic to %s\n", __func__, path);
+    return 0;
+}
+
+/*
+ * Emulated adapter, used when the peer is a socket rather than a CEC device.
+ * Frames and events arrive as cec_record datagrams; the adapter state that the
+ * kernel would normally keep is tracked locally.
+ */
+static int emul_ioctl(cec_transport_t *t, unsigned long request, void *arg)
+{
+    switch (request) {
+        case CEC_ADAP_G_CAPS: {
+            struct cec_caps *caps = arg;
+
+            memset(caps, 0, sizeof(*caps));
+            strlcpy(caps->driver, "hdmi_cec", sizeof(caps->driver));
+            strlcpy(caps->name, t->kind == CEC_TRANSPORT_REPLAY ? "replay" : "socket",
+                    sizeof(caps->name));
+            caps->available_log_addrs = 1;
+            caps->capabilities = CEC_CAP_PHYS_ADDR | CEC_CAP_LOG_ADDRS |
+                    CEC_CAP_TRANSMIT | CEC_CAP_PASSTHROUGH;
+            return 0;
+        }
+        case CEC_G_MODE:
+            *(uint32_t *)arg = t->mode;
+            return 0;
+        case CEC_S_MODE:
+            t->mode = *(uint32_t *)arg;
+            return 0;
+        case CEC_ADAP_G_PHYS_ADDR:
+            *(uint16_t *)arg = t->phys_addr;
+            return 0;
+        case CEC_ADAP_S_PHYS_ADDR:
+            t->phys_addr = *(uint16_t *)arg;
+            return 0;
+        case CEC_ADAP_G_LOG_ADDRS:
+            memcpy(arg, &t->log_addrs, sizeof(t->log_addrs));
+            return 0;
+        case CEC_ADAP_S_LOG_ADDRS: {
+            struct cec_log_addrs *laddrs = arg;
+            unsigned int i;
+
+            laddrs->log_addr_mask = 0;
+            for (i = 0; i < laddrs->num_log_addrs && i < CEC_MAX_LOG_ADDRS; i++)
+                laddrs->log_addr_mask |= 1 << laddrs->log_addr[i];
+            memcpy(&t->log_addrs, laddrs, sizeof(t->log_addrs));
+            return 0;
+        }
+        case CEC_TRANSMIT: {
+            struct cec_msg *msg = arg;
+            struct cec_record rec = { };
+            uint8_t len = msg->len > CEC_MAX_MSG_SIZE ? CEC_MAX_MSG_SIZE : msg->len;
+
+            msg->tx_ts = cec_transport_now_ns();
+            msg->tx_status = CEC_TX_STATUS_OK;
+
+            // A replayed trace already contains the responses of the original
+            // peer, so frames sent by the HAL are only recorded.
+            if (t->kind == CEC_TRANSPORT_SOCKET) {
+                // Same layout as record_msg(): raw message + tx_status
+                rec.hdr.ts_ns = msg->tx_ts;
+                rec.hdr.type = CEC_REC_TX;
+                rec.hdr.len = len + 1;
+                memcpy(rec.data, msg->msg, len);
+                rec.data[len] = msg->tx_status;
+                if (send(t->fd, &rec, sizeof(rec.hdr) + rec.hdr.len, MSG_NOSIGNAL) < 0)
+                    msg->tx_status = CEC_TX_STATUS_ERROR | CEC_TX_STATUS_MAX_RETRIES;
+            }
+            return 0;
+        }
+        case CEC_RECEIVE: {
+            struct cec_msg *msg = arg;
+
+            if (!t->has_pending || t->pending.hdr.type != CEC_REC_RX) {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            memset(msg, 0, sizeof(*msg));
+            msg->len = t->pending.hdr.len > CEC_MAX_MSG_SIZE ?
+                    CEC_MAX_MSG_SIZE : t->pending.hdr.len;
+            memcpy(msg->msg, t->pending.data, msg->len);
+            msg->rx_ts = t->pending.hdr.ts_ns;
+            msg->rx_status = CEC_RX_STATUS_OK;
+            t->has_pending = false;
+            return 0;
+        }
+        case CEC_DQEVENT: {
+            struct cec_event *ev = arg;
+            struct cec_record_event data;
+
+            if (!t->has_pending || t->pending.hdr.type != CEC_REC_EVENT) {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            memcpy(&data, t->pending.data, sizeof(data));
+            memset(ev, 0, sizeof(*ev));
+            ev->event = data.event;
+            ev->ts = t->pending.hdr.ts_ns;
+            if (ev->event == CEC_EVENT_STATE_CHANGE) {
+                ev->state_change.phys_addr = data.phys_addr;
+                ev->state_change.log_addr_mask = data.log_addr_mask;
+                t->phys_addr = data.phys_addr;
+            }
+            t->has_pending = false;
+            return 0;
+        }
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+
+int cec_transport_ioctl(cec_transport_t *t, unsigned long request, void *arg)
+{
+    int ret;
+
+    if (t->kind == CEC_TRANSPORT_DEV)
+        ret = ioctl(t->fd, request, arg);
+    else
+        ret = emul_ioctl(t, request, arg);
+
+    if (ret || t->record_fd < 0)
+        return ret;
+
+    switch (request) {
+        case CEC_RECEIVE:
+            record_msg(t, CEC_REC_RX, arg);
+            break;
+        case CEC_TRANSMIT:
+            record_msg(t, CEC_REC_TX, arg);
+            break;
+        case CEC_DQEVENT:
+            record_event(t, arg);
+            break;
+    }
+    return ret;
+}
+
+int cec_transport_ready(cec_transport_t *t, short revents)
+{
+    int ready = 0;
+    ssize_t len;
+
+    if (t->kind == CEC_TRANSPORT_DEV) {
+        // An unregistered adapter reports POLLERR | POLLHUP forever
+        if (revents & (POLLERR | POLLHUP))
+            return CEC_READY_HUP;
+        if (revents & POLLIN)
+            ready |= CEC_READY_MSG;
+        if (revents & POLLPRI)
+            ready |= CEC_READY_EVENT;
+        return ready;
+    }
+
+    if (!t->has_pending && (revents & POLLIN)) {
+        len = recv(t->fd, &t->pending, sizeof(t->pending), MSG_DONTWAIT);
+        if (len == 0)
+            return CEC_READY_HUP;
+        if (len >= (ssize_t)sizeof(t->pending.hdr) &&
+                t->pending.hdr.len <= len - sizeof(t->pending.hdr))
+            t->has_pending = true;
+        else if (len > 0)
+            ALOGE("%s: dropping malformed record (%zd bytes)\n", __func__, len);
+    }
+
+    if (t->has_pending) {
+        switch (t->pending.hdr.type) {
+            case CEC_REC_RX:
+                ready |= CEC_READY_MSG;
+                break;
+            case CEC_REC_EVENT:
+                ready |= CEC_READY_EVENT;
+                break;
+            case CEC_REC_END:
+                ready |= CEC_READY_END;
+                t->has_pending = false;
+                break;
+            default:
+                // TX records only describe the peer's view, nothing to deliver
+                t->has_pending = false;
+                break;
+        }
+    }
+
+    if (!ready && (revents & (POLLHUP | POLLERR)))
+        ready |= CEC_READY_HUP;
+
+    return ready;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, p, len));
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sleeps until due_ns, returns false if woken up to exit */
+static bool feeder_sleep(cec_transport_t *t, uint64_t due_ns)
+{
+    struct pollfd pfd = {
+        .fd = t->feeder_exit_fd,
+        .events = POLLIN,
+    };
+    uint64_t now;
+
+    while ((now = cec_transport_now_ns()) < due_ns) {
+        struct timespec timeout = {
+            .tv_sec = (due_ns - now) / 1000000000ull,
+            .tv_nsec = (due_ns - now) % 1000000000ull,
+        };
+        int ret = ppoll(&pfd, 1, &timeout, NULL);
+
+        if (ret > 0)
+            return false;
+        if (ret < 0 && errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static void *feeder_thread(void *arg)
+{
+    cec_transport_t *t = arg;
+    struct cec_record rec;
+    uint64_t first_ts = 0, start_ns = cec_transport_now_ns();
+    unsigned int count = 0;
+
+    while (read_full(t->log_fd, &rec.hdr, sizeof(rec.hdr)) == 0) {
+        if (rec.hdr.len > sizeof(rec.data) ||
+                read_full(t->log_fd, rec.data, rec.hdr.len)) {
+            ALOGE("%s: truncated trace after %u records\n", __func__, count);
+            break;
+        }
+
+        if (rec.hdr.type == CEC_REC_TX)
+            continue;
+
+        if (t->paced) {
+            if (!first_ts)
+                first_ts = rec.hdr.ts_ns;
+            if (!feeder_sleep(t, start_ns + (rec.hdr.ts_ns - first_ts)))
+                return NULL;
+        }
+
+        // Restamp with the injection time so the event thread can measure
+        // dispatch latency against the same clock as kernel rx_ts.
+        rec.hdr.ts_ns = cec_transport_now_ns();
+        if (send(t->feeder_fd, &rec, sizeof(rec.hdr) + rec.hdr.len, MSG_NOSIGNAL) < 0) {
+            ALOGE("%s: %m\n", __func__);
+            return NULL;
+        }
+        count++;
+    }
+
+    memset(&rec, 0, sizeof(rec.hdr));
+    rec.hdr.ts_ns = cec_transport_now_ns();
+    rec.hdr.type = CEC_REC_END;
+    send(t->feeder_fd, &rec, sizeof(rec.hdr), MSG_NOSIGNAL);
+
+    ALOGI("%s: replayed %u records\n", __func__, count);
+    return NULL;
+}
+
+static int open_replay(cec_transport_t *t, const char *path)
+{
+    struct cec_trace_header header;
+    int sv[2];
+
+    t->log_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (t->log_fd < 0) {
+        ALOGE("%s: failed to open %s: %m\n", __func__, path);
+        return -errno;
+    }
+
+    if (read_full(t->log_fd, &header, sizeof(header)) ||
+            memcmp(header.magic, CEC_TRACE_MAGIC, sizeof(header.magic)) ||
+            header.version != CEC_TRACE_VERSION) {
+        ALOGE("%s: %s is not a CEC trace\n", __func__, path);
+        return -EINVAL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+        return -errno;
+
+    t->fd = sv[0];
+    t->feeder_fd = sv[1];
+    t->feeder_exit_fd = eventfd(0, EFD_CLOEXEC);
+    if (t->feeder_exit_fd < 0)
+        return -errno;
+    t->paced = property_get_bool("vendor.hdmi.cec.replay_paced", true);
+
+    ALOGI("%s: loaded %s (%s)\n", __func__, path, t->paced ? "paced" : "unpaced");
+    return 0;
+}
+
+int cec_transport_start_replay(cec_transport_t *t)
+{
+    if (t->kind != CEC_TRANSPORT_REPLAY || t->feeder)
+        return 0;
+
+    if (pthread_create(&t->feeder, NULL, feeder_thread, t)) {
+        ALOGE("%s: can't create feeder thread\n", __func__);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+static int open_socket(cec_transport_t *t, const char *path)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+
+    strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    t->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (t->fd < 0)
+        return -errno;
+
+    if (connect(t->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ALOGE("%s: failed to connect to %s: %m\n", __func__, path);
+        return -errno;
+    }
+
+    return 0;
+}
+
+int cec_transport_open(cec_transport_t *t, const char *spec)
+{
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+    t->feeder_fd = -1;
+    t->feeder_exit_fd = -1;
+    t->log_fd = -1;
+    t->record_fd = -1;
+    t->phys_addr = CEC_PHYS_ADDR_INVALID;
+    pthread_mutex_init(&t->record_lock, NULL);
+
+    if (!strncmp(spec, "socket:", 7)) {
+        t->kind = CEC_TRANSPORT_SOCKET;
+        return open_socket(t, spec + 7);
+    }
+
+    if (!strncmp(spec, "replay:", 7)) {
+        t->kind = CEC_TRANSPORT_REPLAY;
+        return open_replay(t, spec + 7);
+    }
+
+    t->kind = CEC_TRANSPORT_DEV;
+    snprintf(t->path, sizeof(t->path), "/dev/%s", spec);
+    t->fd = open(t->path, O_RDWR | O_CLOEXEC);
+    if (t->fd < 0) {
+        ALOGE("faild to open %s, ret=%s\n", t->path, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+int cec_transport_reopen(cec_transport_t *t)
+{
+    int fd, ret = 0;
+
+    if (t->kind != CEC_TRANSPORT_DEV)
+        return -EINVAL;
+
+    fd = open(t->path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    // Swapped atomically, other threads never see a closed or reused fd
+    if (dup3(fd, t->fd, O_CLOEXEC) < 0)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
+void cec_transport_close(cec_transport_t *t)
+{
+    uint64_t one = 1;
+
+    // Closing our end makes a blocked feeder send() fail with EPIPE, the
+    // eventfd wakes it up from the gap to its next record.
+    if (t->fd >= 0)
+        close(t->fd);
+    t->fd = -1;
+    if (t->feeder_exit_fd >= 0 && write(t->feeder_exit_fd, &one, sizeof(one)) < 0)
+        ALOGE("%s: %m\n", __func__);
+
+    if (t->feeder) {
+        pthread_join(t->feeder, NULL);
+        t->feeder = 0;
+    }
+    if (t->feeder_fd >= 0)
+        close(t->feeder_fd);
+    t->feeder_fd = -1;
+    if (t->feeder_exit_fd >= 0)
+        close(t->feeder_exit_fd);
+    t->feeder_exit_fd = -1;
+    if (t->log_fd >= 0)
+        close(t->log_fd);
+    t->log_fd = -1;
+    if (t->record_fd >= 0)
+        close(t->record_fd);
+    t->record_fd = -1;
+    pthread_mutex_destroy(&t->record_lock);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021-2022 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDMI_CEC_TRANSPORT_H
+#define HDMI_CEC_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <linux/cec.h>
+
+/*
+ * Trace log layout: a cec_trace_header followed by cec_record entries.
+ * The same records are exchanged as SOCK_SEQPACKET datagrams by the
+ * socket and replay transports, so a recorded trace can be fed back
+ * to the HAL unchanged.
+ */
+#define CEC_TRACE_MAGIC "CECT"
+#define CEC_TRACE_VERSION 1
+
+enum {
+    CEC_REC_RX = 1,     /* received frame, payload is the raw message */
+    CEC_REC_TX = 2,     /* transmitted frame, raw message + tx_status */
+    CEC_REC_EVENT = 3,  /* adapter event, payload is cec_record_event */
+    CEC_REC_END = 4,    /* end of replay, no payload */
+};
+
+struct cec_trace_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+} __attribute__((packed));
+
+struct cec_record_hdr {
+    uint64_t ts_ns;     /* CLOCK_MONOTONIC */
+    uint8_t type;
+    uint8_t len;
+} __attribute__((packed));
+
+struct cec_record_event {
+    uint32_t event;
+    uint16_t phys_addr;
+    uint16_t log_addr_mask;
+} __attribute__((packed));
+
+#define CEC_RECORD_PAYLOAD_MAX (CEC_MAX_MSG_SIZE + 1)
+
+struct cec_record {
+    struct cec_record_hdr hdr;
+    uint8_t data[CEC_RECORD_PAYLOAD_MAX];
+} __attribute__((packed));
+
+enum cec_transport_kind {
+    CEC_TRANSPORT_DEV,      /* /dev/cecN character device */
+    CEC_TRANSPORT_SOCKET,   /* AF_UNIX seqpacket peer emulating an adapter */
+    CEC_TRANSPORT_REPLAY,   /* trace log fed by an internal feeder thread */
+};
+
+/* Bits returned by cec_transport_ready() */
+#define CEC_READY_MSG   (1 << 0)
+#define CEC_READY_EVENT (1 << 1)
+#define CEC_READY_END   (1 << 2)
+#define CEC_READY_HUP   (1 << 3)
+
+#define CEC_TRANSPORT_PATH_MAX 128
+
+typedef struct cec_transport
+{
+    enum cec_transport_kind kind;
+    int fd;
+    char path[CEC_TRANSPORT_PATH_MAX];  /* device node, CEC_TRANSPORT_DEV only */
+
+    /* Emulated adapter state, socket and replay transports only */
+    uint32_t mode;
+    uint16_t phys_addr;
+    struct cec_log_addrs log_addrs;
+    bool has_pending;
+    struct cec_record pending;
+
+    /* Replay feeder */
+    int feeder_fd;
+    int feeder_exit_fd;     /* eventfd, wakes a paced feeder for close */
+    int log_fd;
+    bool paced;
+    pthread_t feeder;
+
+    /* Recorder */
+    int record_fd;
+    pthread_mutex_t record_lock;
+} cec_transport_t;
+
+/*
+ * Opens a transport described by spec:
+ *   "cec0"              /dev/cec0
+ *   "socket:<path>"     connect to an AF_UNIX seqpacket socket
+ *   "replay:<path>"     replay a trace previously written by the recorder
+ */
+int cec_transport_open(cec_transport_t *t, const char *spec);
+void cec_transport_close(cec_transport_t *t);
+
+/*
+ * Opens the device node again in place of t->fd, which keeps its number.
+ * An unregistered adapter fails with ENODEV on the old fd forever, even
+ * after it came back. CEC_TRANSPORT_DEV only.
+ */
+int cec_transport_reopen(cec_transport_t *t);
+
+/* Starts feeding a replay transport, no-op for other transports. */
+int cec_transport_start_replay(cec_transport_t *t);
+
+/* Same contract as ioctl(2) on a CEC device node. */
+int cec_transport_ioctl(cec_transport_t *t, unsigned long request, void *arg);
+
+/* Translates poll revents on t->fd into CEC_READY_* bits. */
+int cec_transport_ready(cec_transport_t *t, short revents);
+
+/* Starts writing rx/tx frames and events to a trace log at path. */
+int cec_transport_start_recording(cec_transport_t *t, const char *path);
+
+uint64_t cec_transport_now_ns(void);
+
+#endif  // HDMI_CEC_TRANSPORT_H
@@ -27,34 +27,348 @@
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/param.h>
 
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/cec.h>
 #include <sys/eventfd.h>
+#include <sys/stat.h>
 
 #include <log/log.h>
 #include <cutils/properties.h>
 #include <hardware/hdmi_cec.h>
 
+#include "cec_transport.h"
+
+/* Dispatch statistics, owned by the event thread */
+struct hdmicec_stats
+{
+    uint64_t start_ns;
+    unsigned int messages;
+    unsigned int events;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+    uint64_t callback_total_ns;
+
+    /* Event loop watchdog */
+    unsigned int loops;             /* heartbeat, bumped on every wakeup */
+    unsigned int idle_wakeups;      /* wakeups that found nothing to do */
+    unsigned int errors;
+    unsigned int throttled;
+    uint64_t window_ns;
+    unsigned int window_idle;
+};
+
+#define WAKE_LOCK_PATH "/sys/power/wake_lock"
+#define WAKE_UNLOCK_PATH "/sys/power/wake_unlock"
+#define WAKE_LOCK_NAME "hdmi_cec_wake"
+/* Long enough for the framework to take over after the callback */
+#define WAKE_LOCK_TIMEOUT_NS 5000000000ull
+#define WAKE_HISTORY_SIZE 8
+#define DUMP_PATH "/data/vendor/cec/dump.txt"
+/* The dump is written once the bus has been quiet this long after a wake */
+#define DUMP_DELAY_NS 1000000000ull
+
+/* Timeline of one wake request handled by the fast path */
+struct hdmicec_wake_record
+{
+    int port_id;
+    uint8_t opcode;
+    uint8_t operand;
+    uint64_t rx_ns;             /* frame received by the adapter */
+    uint64_t wake_ns;           /* wake lock taken */
+    uint64_t active_source_ns;  /* <Image View On>/<Active Source> sent */
+    uint64_t notify_ns;         /* framework callback returned */
+};
+
+/* Audio Return Channel state of a port */
+enum hdmicec_arc_state
+{
+    ARC_STATE_IDLE,
+    ARC_STATE_REQUESTED,    /* <Request ARC Initiation> sent, waiting for the audio system */
+    ARC_STATE_INITIATED,    /* <Initiate ARC> received, audio pre-routed, waiting for the framework */
+    ARC_STATE_ACTIVE,
+};
+
+/* How long REQUESTED and INITIATED wait for an answer before going back to IDLE */
+#define ARC_TIMEOUT_NS 3000000000ull
+
+#define HDMICEC_MAX_PORTS 4
+
+/*
+ * The event loop is edge triggered: a port is drained on every wakeup, but
+ * at most HDMICEC_DRAIN_BUDGET messages and events at a time so a chatty bus
+ * cannot starve the other ports; leftovers are picked up on the next pass
+ * without waiting. A port reporting an error is taken out of the loop and
+ * probed again with exponential backoff.
+ */
+#define HDMICEC_DRAIN_BUDGET 16
+#define HDMICEC_BACKOFF_MIN_MS 100
+#define HDMICEC_BACKOFF_MAX_MS 5000
+
+/* More idle wakeups than this within a second means the loop is spinning */
+#define HDMICEC_SPIN_LIMIT 200
+#define HDMICEC_SPIN_THROTTLE_MS 10
+
+/* One CEC adapter, i.e. one HDMI port */
+struct hdmicec_port
+{
+    cec_transport_t transport;
+    struct hdmi_port_info *info;    /* entry in hdmicec_context.port_info */
+    enum hdmicec_arc_state arc_state;
+    uint64_t arc_deadline_ns;       /* 0 unless REQUESTED or INITIATED */
+    uint64_t arc_routed_ns;         /* when audio was last routed to this port */
+    uint16_t seen_mask;             /* logical addresses seen on this bus */
+
+    /* Event loop state, only touched by the event thread */
+    bool backlog;                   /* drain budget ran out, more to read */
+    bool failed;                    /* removed from epoll, waiting to retry */
+    uint64_t retry_ns;
+    unsigned int backoff_ms;
+    unsigned int errors;
+};
+
 typedef struct hdmicec_context
 {
     hdmi_cec_device_t device; /* must be first */
-    int cec_fd;
+    struct hdmicec_port ports[HDMICEC_MAX_PORTS];
+    struct hdmi_port_info port_info[HDMICEC_MAX_PORTS];
+    int num_ports;
     unsigned int vendor_id;
     unsigned int type;
     unsigned int version;
-    struct hdmi_port_info port_info;
+    uint8_t log_addr;
+    struct cec_log_addrs laddrs;    /* last claimed, for adapters coming back */
     event_callback_t p_event_cb;
     void *cb_arg;
     pthread_t thread;
     int exit_fd;
+    int epoll_fd;
     pthread_mutex_t options_lock;
+    pthread_mutex_t arc_lock;       /* serializes publishing arc_device */
+    char arc_device[PROPERTY_VALUE_MAX];    /* last published, under arc_lock */
     bool cec_enabled;
     bool cec_control_enabled;
+    struct hdmicec_stats stats;
+    bool fast_wake;
+    int wake_lock_fd;
+    int wake_unlock_fd;
+    unsigned int wake_count;
+    struct hdmicec_wake_record wake_history[WAKE_HISTORY_SIZE];
+    uint64_t dump_due_ns;           /* 0 when no dump is pending */
 } hdmicec_context_t;
 
+/*
+ * ARC is negotiated between a TV and the audio system on its input port:
+ * the audio system sends <Initiate ARC> / <Terminate ARC> and the TV answers
+ * with <Report ARC Initiated> / <Report ARC Terminated>. The answers are left
+ * to the framework, which knows whether the user enabled ARC and confirms
+ * through set_audio_return_channel. To save the round trip the HAL asks for
+ * ARC as soon as it can, and pre-routes audio to the port on <Initiate ARC>:
+ * the active port is published to the audio HAL, which routes HDMI output to
+ * it. Without the framework's confirmation the routing is undone after
+ * ARC_TIMEOUT_NS.
+ */
+static int hal_transmit(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        uint8_t destination, const uint8_t *body, uint8_t length)
+{
+    struct cec_msg msg;
+    uint8_t initiator;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    initiator = ctx->log_addr;
+    bool cec_enabled = ctx->cec_enabled;
+    pthread_mutex_unlock(&ctx->options_lock);
+    if (!cec_enabled || initiator == CEC_LOG_ADDR_INVALID)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg[0] = (initiator << 4) | destination;
+    memcpy(&msg.msg[1], body, length);
+    msg.len = length + 1;
+
+    if (cec_transport_ioctl(&port->transport, CEC_TRANSMIT, &msg)) {
+        ALOGD("%s: %m\n", __func__);
+        return -1;
+    }
+
+    if (msg.tx_status != CEC_TX_STATUS_OK) {
+        ALOGD("%s: opcode=%x tx_status=%d\n", __func__, body[0], msg.tx_status);
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool arc_routed(enum hdmicec_arc_state state)
+{
+    return state == ARC_STATE_INITIATED || state == ARC_STATE_ACTIVE;
+}
+
+/* must be called with options_lock held, arc_publish() applies the routing */
+static void arc_set_state_locked(struct hdmicec_port *port, enum hdmicec_arc_state state)
+{
+    if (port->arc_state == state)
+        return;
+
+    ALOGI("%s: port %d arc %d -> %d\n", __func__, port->info->port_id,
+            port->arc_state, state);
+
+    if (arc_routed(state) && !arc_routed(port->arc_state))
+        port->arc_routed_ns = cec_transport_now_ns();
+    if (state == ARC_STATE_REQUESTED || state == ARC_STATE_INITIATED)
+        port->arc_deadline_ns = cec_transport_now_ns() + ARC_TIMEOUT_NS;
+    else
+        port->arc_deadline_ns = 0;
+
+    port->arc_state = state;
+}
+
+/*
+ * Publishes the port audio is routed to, the one routed last if several are.
+ * property_set() is an IPC to init, so it runs outside options_lock; arc_lock
+ * keeps concurrent callers from publishing out of order.
+ */
+static void arc_publish(struct hdmicec_context *ctx)
+{
+    char device[PROPERTY_VALUE_MAX] = "";
+    uint64_t routed_ns = 0;
+    int i;
+
+    pthread_mutex_lock(&ctx->arc_lock);
+
+    pthread_mutex_lock(&ctx->options_lock);
+    for (i = 0; i < ctx->num_ports; i++) {
+        struct hdmicec_port *port = &ctx->ports[i];
+
+        if (arc_routed(port->arc_state) && port->arc_routed_ns >= routed_ns) {
+            snprintf(device, sizeof(device), "vc4hdmi%d", port->info->port_id - 1);
+            routed_ns = port->arc_routed_ns;
+        }
+    }
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    if (strcmp(device, ctx->arc_device)) {
+        property_set("vendor.audio.hdmi.arc_device", device);
+        strlcpy(ctx->arc_device, device, sizeof(ctx->arc_device));
+    }
+
+    pthread_mutex_unlock(&ctx->arc_lock);
+}
+
+static void arc_set_state(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        enum hdmicec_arc_state state)
+{
+    pthread_mutex_lock(&ctx->options_lock);
+    arc_set_state_locked(port, state);
+    pthread_mutex_unlock(&ctx->options_lock);
+    arc_publish(ctx);
+}
+
+static void arc_request_initiation(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    static const uint8_t body[] = { CEC_MESSAGE_REQUEST_ARC_INITIATION };
+
+    pthread_mutex_lock(&ctx->options_lock);
+    bool request = port->info->arc_supported && port->arc_state == ARC_STATE_IDLE;
+    if (request)
+        arc_set_state_locked(port, ARC_STATE_REQUESTED);
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    if (request && hal_transmit(ctx, port, CEC_ADDR_AUDIO_SYSTEM, body, sizeof(body))) {
+        pthread_mutex_lock(&ctx->options_lock);
+        if (port->arc_state == ARC_STATE_REQUESTED)
+            arc_set_state_locked(port, ARC_STATE_IDLE);
+        pthread_mutex_unlock(&ctx->options_lock);
+    }
+}
+
+/*
+ * Follows ARC requests from the audio system, called from the event thread.
+ * The messages still go to the framework, which answers them.
+ */
+static void arc_handle_message(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        struct cec_msg *msg)
+{
+    if (!port->info->arc_supported || (msg->msg[0] >> 4) != CEC_ADDR_AUDIO_SYSTEM)
+        return;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    switch (msg->msg[1]) {
+        case CEC_MESSAGE_INITIATE_ARC:
+            if (port->arc_state != ARC_STATE_ACTIVE)
+                arc_set_state_locked(port, ARC_STATE_INITIATED);
+            break;
+        case CEC_MESSAGE_TERMINATE_ARC:
+            arc_set_state_locked(port, ARC_STATE_IDLE);
+            break;
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    arc_publish(ctx);
+}
+
+/*
+ * The framework refuses <Initiate ARC> with <Feature Abort> when the user
+ * disabled ARC, undo the pre-routing right away then.
+ */
+static void arc_handle_reply(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        const cec_message_t *msg)
+{
+    if (msg->destination != CEC_ADDR_AUDIO_SYSTEM || msg->length < 2 ||
+            msg->body[0] != CEC_MESSAGE_FEATURE_ABORT ||
+            msg->body[1] != CEC_MESSAGE_INITIATE_ARC)
+        return;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    if (port->arc_state == ARC_STATE_INITIATED)
+        arc_set_state_locked(port, ARC_STATE_IDLE);
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    arc_publish(ctx);
+}
+
+/* Drops ARC requests nobody answered, returns the number of ports reset */
+static int arc_expire(struct hdmicec_context *ctx)
+{
+    uint64_t now = cec_transport_now_ns();
+    int expired = 0;
+    int i;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    for (i = 0; i < ctx->num_ports; i++) {
+        struct hdmicec_port *port = &ctx->ports[i];
+
+        if (port->arc_deadline_ns && port->arc_deadline_ns <= now) {
+            ALOGI("%s: port %d arc %d timed out\n", __func__, port->info->port_id,
+                    port->arc_state);
+            arc_set_state_locked(port, ARC_STATE_IDLE);
+            expired++;
+        }
+    }
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    if (expired)
+        arc_publish(ctx);
+    return expired;
+}
+
+static struct hdmicec_port *find_port(struct hdmicec_context *ctx, int port_id)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        if (ctx->port_info[i].port_id == port_id)
+            return &ctx->ports[i];
+    }
+    return NULL;
+}
+
 static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_logical_address_t addr)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
@@ -62,16 +376,15 @@ static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_lo
     unsigned int all_dev_types = 0;
     unsigned int prim_type = 0xff;
     struct cec_log_addrs laddrs;
-    int ret;
+    int ret = -1;
+    int i;
+    bool claimed = false;
 
     ALOGD("%s: addr:%x\n", __func__, addr);
 
     if (addr >= CEC_ADDR_BROADCAST)
         return -1;
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_LOG_ADDRS, &laddrs);
-    if (ret)
-        return ret;
     memset(&laddrs, 0, sizeof(laddrs));
 
     laddrs.cec_version = ctx->version;
@@ -131,13 +444,32 @@ static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_lo
     laddrs.features[0][0] = 0;
     laddrs.features[0][1] = 0;
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
-    if (ret) {
-        ALOGD("%s: %m\n", __func__);
-        return ret;
+    // The same logical address is claimed on every bus we are attached to
+    for (i = 0; i < ctx->num_ports; i++) {
+        struct cec_log_addrs port_laddrs = laddrs;
+
+        ret = cec_transport_ioctl(&ctx->ports[i].transport, CEC_ADAP_S_LOG_ADDRS,
+                &port_laddrs);
+        if (ret) {
+            ALOGD("%s: port %d: %m\n", __func__, ctx->port_info[i].port_id);
+            continue;
+        }
+
+        ALOGD("%s: port %d: log_addr_mask=%x\n", __func__, ctx->port_info[i].port_id,
+                port_laddrs.log_addr_mask);
+        claimed = true;
     }
 
-    ALOGD("%s: log_addr_mask=%x\n", __func__,  laddrs.log_addr_mask);
+    if (!claimed)
+        return ret;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    ctx->log_addr = addr;
+    ctx->laddrs = laddrs;
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    for (i = 0; i < ctx->num_ports; i++)
+        arc_request_initiation(ctx, &ctx->ports[i]);
 
     return 0;
 }
@@ -147,55 +479,74 @@ static void hdmicec_clear_logical_address(const struct hdmi_cec_device *dev)
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     struct cec_log_addrs laddrs;
     int ret;
+    int i;
 
-    memset(&laddrs, 0, sizeof(laddrs));
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
-    if (ret)
-        ALOGD("%s: %m\n", __func__);
+    pthread_mutex_lock(&ctx->options_lock);
+    ctx->log_addr = CEC_LOG_ADDR_INVALID;
+    memset(&ctx->laddrs, 0, sizeof(ctx->laddrs));
+    for (i = 0; i < ctx->num_ports; i++)
+        ctx->ports[i].seen_mask = 0;
+    pthread_mutex_unlock(&ctx->options_lock);
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        memset(&laddrs, 0, sizeof(laddrs));
+        ret = cec_transport_ioctl(&ctx->ports[i].transport, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+        if (ret)
+            ALOGD("%s: port %d: %m\n", __func__, ctx->port_info[i].port_id);
+    }
+}
+
+/* Returns the port whose address the device reports, the first connected one */
+static struct hdmicec_port *primary_port(struct hdmicec_context *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        if (ctx->port_info[i].physical_address != CEC_PHYS_ADDR_INVALID)
+            return &ctx->ports[i];
+    }
+    return &ctx->ports[0];
 }
 
 static int hdmicec_get_physical_address(const struct hdmi_cec_device *dev, uint16_t *addr)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
-    int ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR, addr);
+    int ret = cec_transport_ioctl(&primary_port(ctx)->transport, CEC_ADAP_G_PHYS_ADDR, addr);
     if (ret)
         ALOGD("%s: %m\n", __func__);
 
     return ret;
 }
 
-static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg)
+static int port_send_message(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        const cec_message_t *msg)
 {
-    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     struct cec_msg cec_msg;
     int ret;
 
-    pthread_mutex_lock(&ctx->options_lock);
-    bool cec_enabled = ctx->cec_enabled;
-    pthread_mutex_unlock(&ctx->options_lock);
-    if (!cec_enabled) {
-        return HDMI_RESULT_FAIL;
-    }
-
-    ALOGD("%s: len=%u\n", __func__, (unsigned int)msg->length);
-
     memset(&cec_msg, 0, sizeof(cec_msg));
     cec_msg.msg[0] = (msg->initiator << 4) | msg->destination;
 
     memcpy(&cec_msg.msg[1], msg->body, msg->length);
     cec_msg.len = msg->length + 1;
 
-    ret = ioctl(ctx->cec_fd, CEC_TRANSMIT, &cec_msg);
+    ret = cec_transport_ioctl(&port->transport, CEC_TRANSMIT, &cec_msg);
     if (ret) {
-        ALOGD("%s: %m\n", __func__);
+        ALOGD("%s: port %d: %m\n", __func__, port->info->port_id);
         return HDMI_RESULT_FAIL;
     }
 
     if (cec_msg.tx_status != CEC_TX_STATUS_OK)
-        ALOGD("%s: tx_status=%d\n", __func__, cec_msg.tx_status);
+        ALOGD("%s: port %d: tx_status=%d\n", __func__, port->info->port_id,
+                cec_msg.tx_status);
 
     switch (cec_msg.tx_status) {
         case CEC_TX_STATUS_OK:
+            if (msg->destination != CEC_ADDR_BROADCAST) {
+                pthread_mutex_lock(&ctx->options_lock);
+                port->seen_mask |= 1 << msg->destination;
+                pthread_mutex_unlock(&ctx->options_lock);
+            }
             return HDMI_RESULT_SUCCESS;
         case CEC_TX_STATUS_ARB_LOST:
             return HDMI_RESULT_BUSY;
@@ -208,6 +559,105 @@ static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_mes
     }
 }
 
+static int result_rank(int result)
+{
+    switch (result) {
+        case HDMI_RESULT_SUCCESS:
+            return 3;
+        case HDMI_RESULT_BUSY:
+            return 2;
+        case HDMI_RESULT_NACK:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Messages whose first operand is the sender's physical address. The
+ * framework fills it in from hdmicec_get_physical_address(), i.e. with the
+ * address on the primary port.
+ */
+static bool carries_own_address(const cec_message_t *msg)
+{
+    if (msg->length < 3)
+        return false;
+
+    switch (msg->body[0]) {
+        case CEC_MESSAGE_REPORT_PHYSICAL_ADDRESS:
+        case CEC_MESSAGE_ACTIVE_SOURCE:
+        case CEC_MESSAGE_INACTIVE_SOURCE:
+        case CEC_MESSAGE_ROUTING_INFORMATION:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    uint16_t routed = 0, connected = 0, targets;
+    uint16_t phys_addr[HDMICEC_MAX_PORTS];
+    int result = HDMI_RESULT_FAIL;
+    int i;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    bool cec_enabled = ctx->cec_enabled;
+    uint16_t own_addr = primary_port(ctx)->info->physical_address;
+    for (i = 0; i < ctx->num_ports; i++) {
+        if (ctx->ports[i].seen_mask & (1 << msg->destination))
+            routed |= 1 << i;
+        if (ctx->port_info[i].physical_address != CEC_PHYS_ADDR_INVALID)
+            connected |= 1 << i;
+        phys_addr[i] = ctx->port_info[i].physical_address;
+    }
+    pthread_mutex_unlock(&ctx->options_lock);
+    if (!cec_enabled) {
+        return HDMI_RESULT_FAIL;
+    }
+
+    ALOGD("%s: len=%u\n", __func__, (unsigned int)msg->length);
+
+    // Directed messages go to the bus their destination was seen on, anything
+    // else goes to every connected bus.
+    if (msg->destination != CEC_ADDR_BROADCAST && routed)
+        targets = routed;
+    else if (connected)
+        targets = connected;
+    else
+        targets = (1 << ctx->num_ports) - 1;
+
+    bool rewrite = carries_own_address(msg) && own_addr != CEC_PHYS_ADDR_INVALID &&
+            ((msg->body[1] << 8) | msg->body[2]) == own_addr;
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        cec_message_t port_msg;
+        const cec_message_t *out = msg;
+
+        if (!(targets & (1 << i)))
+            continue;
+
+        // Each bus is told our address on that bus
+        if (rewrite && phys_addr[i] != own_addr) {
+            if (phys_addr[i] == CEC_PHYS_ADDR_INVALID)
+                continue;
+            port_msg = *msg;
+            port_msg.body[1] = phys_addr[i] >> 8;
+            port_msg.body[2] = phys_addr[i] & 0xff;
+            out = &port_msg;
+        }
+
+        // Report the best outcome across buses
+        int ret = port_send_message(ctx, &ctx->ports[i], out);
+        arc_handle_reply(ctx, &ctx->ports[i], msg);
+        if (result_rank(ret) > result_rank(result))
+            result = ret;
+    }
+
+    return result;
+}
+
 static void hdmicec_register_event_callback(const struct hdmi_cec_device *dev,
         event_callback_t callback, void *arg)
 {
@@ -215,6 +665,10 @@ static void hdmicec_register_event_callback(const struct hdmi_cec_device *dev,
 
     ctx->p_event_cb = callback;
     ctx->cb_arg = arg;
+
+    // Hold back a replayed trace until somebody is listening
+    for (int i = 0; i < ctx->num_ports; i++)
+        cec_transport_start_replay(&ctx->ports[i].transport);
 }
 
 static void hdmicec_get_version(const struct hdmi_cec_device *dev, int *version)
@@ -235,23 +689,29 @@ static void hdmicec_get_port_info(const struct hdmi_cec_device *dev,
         struct hdmi_port_info *list[], int *total)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    struct hdmi_port_info *info;
     int ret;
-
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR, &ctx->port_info.physical_address);
-    if (ret)
-        ALOGD("%s: %m\n", __func__);
-
-    ALOGD("type:%s, id:%d, cec support:%d, arc support:%d, physical address:%x",
-            ctx->port_info.type ? "output" : "input",
-            ctx->port_info.port_id,
-            ctx->port_info.cec_supported,
-            ctx->port_info.arc_supported,
-            ctx->port_info.physical_address);
-
-    if (ctx->port_info.physical_address != CEC_PHYS_ADDR_INVALID) {
-        *list = &ctx->port_info;
-        *total = 1;
+    int i;
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        info = &ctx->port_info[i];
+        ret = cec_transport_ioctl(&ctx->ports[i].transport, CEC_ADAP_G_PHYS_ADDR,
+                &info->physical_address);
+        if (ret)
+            ALOGD("%s: %m\n", __func__);
+
+        ALOGD("type:%s, id:%d, cec support:%d, arc support:%d, physical address:%x",
+                info->type ? "output" : "input",
+                info->port_id,
+                info->cec_supported,
+                info->arc_supported,
+                info->physical_address);
     }
+
+    // Every adapter is reported, also while unplugged, so that the port list
+    // stays stable; hotplug events carry the connection state.
+    *list = ctx->port_info;
+    *total = ctx->num_ports;
 }
 
 static void hdmicec_set_option(const struct hdmi_cec_device *dev, int flag, int value)
@@ -278,18 +738,20 @@ static void hdmicec_set_option(const struct hdmi_cec_device *dev, int flag, int
 static int hdmicec_is_connected(const struct hdmi_cec_device *dev, int port_id)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    struct hdmicec_port *port = find_port(ctx, port_id);
     int ret;
 
-    (void)port_id;
+    if (!port)
+        return false;
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR,
-            &ctx->port_info.physical_address);
+    ret = cec_transport_ioctl(&port->transport, CEC_ADAP_G_PHYS_ADDR,
+            &port->info->physical_address);
     if (ret) {
         ALOGD("%s: %m\n", __func__);
         return ret;
     }
 
-    if (ctx->port_info.physical_address == CEC_PHYS_ADDR_INVALID)
+    if (port->info->physical_address == CEC_PHYS_ADDR_INVALID)
         return false;
 
     return true;
@@ -339,124 +801,646 @@ static bool is_transferable_in_sleep(struct cec_msg* message) {
     }
 }
 
-static void *event_thread(void *arg)
+static bool is_wake_message(struct hdmicec_context *ctx, struct hdmicec_port *port,
+        struct cec_msg *message) {
+    uint16_t phys_addr;
+
+    switch (get_opcode(message)) {
+        case CEC_MESSAGE_USER_CONTROL_PRESSED:
+            switch (get_first_param(message)) {
+                case CEC_OP_UI_CMD_POWER:
+                case CEC_OP_UI_CMD_POWER_ON_FUNCTION:
+                case CEC_OP_UI_CMD_POWER_TOGGLE_FUNCTION:
+                    return true;
+                default:
+                    return false;
+            }
+        case CEC_MESSAGE_IMAGE_VIEW_ON:
+        case CEC_MESSAGE_TEXT_VIEW_ON:
+            return ctx->type == CEC_DEVICE_TV;
+        case CEC_MESSAGE_SET_STREAM_PATH:
+            if (ctx->type == CEC_DEVICE_TV || message->len < 4)
+                return false;
+            phys_addr = (message->msg[2] << 8) | message->msg[3];
+            return phys_addr == port->info->physical_address;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Wakes the device for a power request received while in standby, ahead of
+ * the framework: a timed wake lock keeps the system from suspending again and
+ * a source announces itself before the framework callback runs.
+ */
+static struct hdmicec_wake_record *fast_wake_begin(struct hdmicec_context *ctx,
+        struct hdmicec_port *port, struct cec_msg *msg)
 {
-    struct hdmicec_context *ctx = (struct hdmicec_context *)arg;
-    int ret;
-    struct pollfd ufds[3] = {
-        { ctx->cec_fd, POLLIN, 0 },
-        { ctx->cec_fd, POLLERR, 0 },
-        { ctx->exit_fd, POLLIN, 0 },
-    };
+    struct hdmicec_wake_record *rec =
+            &ctx->wake_history[ctx->wake_count++ % WAKE_HISTORY_SIZE];
+    char wake_lock[64];
+    int len;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->port_id = port->info->port_id;
+    rec->opcode = get_opcode(msg);
+    rec->operand = msg->len > 2 ? get_first_param(msg) : 0;
+    rec->rx_ns = msg->rx_ts ? msg->rx_ts : cec_transport_now_ns();
+
+    len = snprintf(wake_lock, sizeof(wake_lock), "%s %llu", WAKE_LOCK_NAME,
+            (unsigned long long)WAKE_LOCK_TIMEOUT_NS);
+    if (ctx->wake_lock_fd >= 0 && write(ctx->wake_lock_fd, wake_lock, len) < 0)
+        ALOGE("%s: failed to take wake lock: %m\n", __func__);
+    rec->wake_ns = cec_transport_now_ns();
+
+    // One Touch Play: turn the TV on, then claim the active source
+    if (ctx->type != CEC_DEVICE_TV &&
+            port->info->physical_address != CEC_PHYS_ADDR_INVALID) {
+        const uint8_t image_view_on[] = { CEC_MESSAGE_IMAGE_VIEW_ON };
+        const uint8_t active_source[] = {
+            CEC_MESSAGE_ACTIVE_SOURCE,
+            port->info->physical_address >> 8,
+            port->info->physical_address & 0xff,
+        };
+
+        hal_transmit(ctx, port, CEC_ADDR_TV, image_view_on, sizeof(image_view_on));
+        hal_transmit(ctx, port, CEC_ADDR_BROADCAST, active_source, sizeof(active_source));
+        rec->active_source_ns = cec_transport_now_ns();
+    }
 
-    ALOGI("%s start!", __func__);
+    return rec;
+}
 
-    while (1) {
-        ufds[0].revents = 0;
-        ufds[1].revents = 0;
-        ufds[2].revents = 0;
+static void fast_wake_release(struct hdmicec_context *ctx)
+{
+    if (ctx->wake_unlock_fd >= 0 &&
+            write(ctx->wake_unlock_fd, WAKE_LOCK_NAME, strlen(WAKE_LOCK_NAME)) < 0 &&
+            errno != EINVAL)
+        ALOGE("%s: failed to release wake lock: %m\n", __func__);
+}
 
-        ret = poll(ufds, 3, -1);
+static void hdmicec_dump(struct hdmicec_context *ctx, int fd)
+{
+    struct hdmicec_stats *stats = &ctx->stats;
+    unsigned int i, first;
+    int p;
 
-        if (ret <= 0)
-            continue;
+    for (p = 0; p < ctx->num_ports; p++) {
+        struct hdmicec_port *port = &ctx->ports[p];
 
-        if (ufds[2].revents == POLLIN)   /* Exit */
-            break;
+        dprintf(fd, "port %d: type=%s physical_address=%04x arc_supported=%d arc_state=%d"
+                " seen=%04x\n", port->info->port_id, port->info->type ? "output" : "input",
+                port->info->physical_address, port->info->arc_supported,
+                port->arc_state, port->seen_mask);
+    }
+    dprintf(fd, "dispatch: messages=%u events=%u latency_max_us=%llu\n",
+            stats->messages, stats->events,
+            (unsigned long long)(stats->latency_max_ns / 1000));
+    dprintf(fd, "event loop: loops=%u idle=%u errors=%u throttled=%u\n",
+            stats->loops, stats->idle_wakeups, stats->errors, stats->throttled);
+    for (p = 0; p < ctx->num_ports; p++) {
+        struct hdmicec_port *port = &ctx->ports[p];
+
+        if (port->errors)
+            dprintf(fd, "  port %d: errors=%u failed=%d backoff_ms=%u\n",
+                    port->info->port_id, port->errors, port->failed, port->backoff_ms);
+    }
+
+    dprintf(fd, "fast wake: %s, %u requests\n",
+            ctx->fast_wake ? "enabled" : "disabled", ctx->wake_count);
+    first = ctx->wake_count > WAKE_HISTORY_SIZE ? ctx->wake_count - WAKE_HISTORY_SIZE : 0;
+    for (i = first; i < ctx->wake_count; i++) {
+        struct hdmicec_wake_record *rec = &ctx->wake_history[i % WAKE_HISTORY_SIZE];
+
+        dprintf(fd, "  #%u port=%d opcode=%02x operand=%02x wake=+%lluus"
+                " active_source=+%lluus notify=+%lluus\n", i, rec->port_id,
+                rec->opcode, rec->operand,
+                (unsigned long long)((rec->wake_ns - rec->rx_ns) / 1000),
+                (unsigned long long)(rec->active_source_ns ?
+                        (rec->active_source_ns - rec->rx_ns) / 1000 : 0),
+                (unsigned long long)((rec->notify_ns - rec->rx_ns) / 1000));
+    }
+}
 
-        if (ufds[1].revents == POLLERR) { /* CEC Event */
-            hdmi_event_t event = { };
-            struct cec_event ev;
+static void write_dump(struct hdmicec_context *ctx)
+{
+    int fd = open(DUMP_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
 
-            ret = ioctl(ctx->cec_fd, CEC_DQEVENT, &ev);
-            if (ret)
-                continue;
+    if (fd < 0)
+        return;
+    hdmicec_dump(ctx, fd);
+    close(fd);
+}
+
+static void log_stats(struct hdmicec_context *ctx)
+{
+    struct hdmicec_stats *stats = &ctx->stats;
+    uint64_t elapsed_ns = cec_transport_now_ns() - stats->start_ns;
+
+    if (!stats->messages) {
+        ALOGI("%s: %u events, no messages dispatched\n", __func__, stats->events);
+        return;
+    }
+
+    ALOGI("%s: %u messages, %u events in %llu ms\n", __func__,
+            stats->messages, stats->events,
+            (unsigned long long)(elapsed_ns / 1000000));
+    ALOGI("%s: dispatch latency avg=%llu us max=%llu us, callback avg=%llu us\n", __func__,
+            (unsigned long long)(stats->latency_total_ns / stats->messages / 1000),
+            (unsigned long long)(stats->latency_max_ns / 1000),
+            (unsigned long long)(stats->callback_total_ns / stats->messages / 1000));
+    if (elapsed_ns)
+        ALOGI("%s: throughput=%llu msg/s\n", __func__,
+                (unsigned long long)stats->messages * 1000000000ull / elapsed_ns);
+}
+
+static void account_message(struct hdmicec_context *ctx, const struct cec_msg *msg,
+        uint64_t cb_start_ns)
+{
+    struct hdmicec_stats *stats = &ctx->stats;
+    uint64_t now = cec_transport_now_ns();
+
+    stats->messages++;
+    stats->callback_total_ns += now - cb_start_ns;
+    if (msg->rx_ts && msg->rx_ts <= now) {
+        uint64_t latency = now - msg->rx_ts;
+
+        stats->latency_total_ns += latency;
+        if (latency > stats->latency_max_ns)
+            stats->latency_max_ns = latency;
+    }
+}
+
+static int handle_event(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    hdmi_event_t event = { };
+    struct cec_event ev;
+    int ret;
+
+    ret = cec_transport_ioctl(&port->transport, CEC_DQEVENT, &ev);
+    if (ret)
+        return errno == EAGAIN ? 0 : -errno;
+
+    ctx->stats.events++;
 
+    pthread_mutex_lock(&ctx->options_lock);
+    bool cec_enabled = ctx->cec_enabled;
+    pthread_mutex_unlock(&ctx->options_lock);
+    if (!cec_enabled) {
+        return 0;
+    }
+
+    if (ev.event == CEC_EVENT_STATE_CHANGE) {
+        event.type = HDMI_EVENT_HOT_PLUG;
+        event.dev = &ctx->device;
+        event.hotplug.port_id = port->info->port_id;
+        port->info->physical_address = ev.state_change.phys_addr;
+        if (ev.state_change.phys_addr == CEC_PHYS_ADDR_INVALID)
+            event.hotplug.connected = false;
+        else
+            event.hotplug.connected = true;
+
+        if (event.hotplug.connected) {
+            arc_request_initiation(ctx, port);
+        } else {
             pthread_mutex_lock(&ctx->options_lock);
-            bool cec_enabled = ctx->cec_enabled;
+            arc_set_state_locked(port, ARC_STATE_IDLE);
+            port->seen_mask = 0;
             pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_enabled) {
-                continue;
-            }
+            arc_publish(ctx);
+        }
 
-            if (ev.event == CEC_EVENT_STATE_CHANGE) {
-                event.type = HDMI_EVENT_HOT_PLUG;
-                event.dev = &ctx->device;
-                event.hotplug.port_id = 1;
-                if (ev.state_change.phys_addr == CEC_PHYS_ADDR_INVALID)
-                    event.hotplug.connected = false;
-                else
-                    event.hotplug.connected = true;
-
-                if (ctx->p_event_cb != NULL) {
-                    ctx->p_event_cb(&event, ctx->cb_arg);
-                } else {
-                    ALOGE("no event callback for hotplug\n");
-                }
-            }
+        if (ctx->p_event_cb != NULL) {
+            ctx->p_event_cb(&event, ctx->cb_arg);
+        } else {
+            ALOGE("no event callback for hotplug\n");
         }
+    }
 
-        if (ufds[0].revents == POLLIN) { /* CEC Driver */
-            struct cec_msg msg = { };
-            hdmi_event_t event = { };
+    return 0;
+}
 
-            ret = ioctl(ctx->cec_fd, CEC_RECEIVE, &msg);
-            if (ret) {
-                ALOGE("%s: CEC_RECEIVE error (%m)\n", __func__);
-                continue;
-            }
+static int handle_message(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    struct cec_msg msg = { };
+    hdmi_event_t event = { };
+    int ret;
 
-            if (msg.rx_status != CEC_RX_STATUS_OK) {
-                ALOGD("%s: rx_status=%d\n", __func__, msg.rx_status);
-                continue;
-            }
+    ret = cec_transport_ioctl(&port->transport, CEC_RECEIVE, &msg);
+    if (ret) {
+        if (errno == EAGAIN)
+            return 0;
+        ALOGE("%s: CEC_RECEIVE error (%m)\n", __func__);
+        return -errno;
+    }
 
-            pthread_mutex_lock(&ctx->options_lock);
-            bool cec_enabled = ctx->cec_enabled;
-            pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_enabled) {
-                continue;
-            }
+    if (msg.rx_status != CEC_RX_STATUS_OK) {
+        ALOGD("%s: rx_status=%d\n", __func__, msg.rx_status);
+        return 0;
+    }
 
-            pthread_mutex_lock(&ctx->options_lock);
-            bool cec_control_enabled = ctx->cec_control_enabled;
-            pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_control_enabled && !is_transferable_in_sleep(&msg)) {
-                ALOGD("%s: filter message in standby mode\n", __func__);
+    pthread_mutex_lock(&ctx->options_lock);
+    bool cec_enabled = ctx->cec_enabled;
+    bool cec_control_enabled = ctx->cec_control_enabled;
+    if ((msg.msg[0] >> 4) != CEC_ADDR_UNREGISTERED)
+        port->seen_mask |= 1 << (msg.msg[0] >> 4);
+    pthread_mutex_unlock(&ctx->options_lock);
+    if (!cec_enabled) {
+        return 0;
+    }
+
+    struct hdmicec_wake_record *wake = NULL;
+    if (ctx->fast_wake) {
+        if (!cec_control_enabled && is_wake_message(ctx, port, &msg))
+            wake = fast_wake_begin(ctx, port, &msg);
+        else if (get_opcode(&msg) == CEC_MESSAGE_STANDBY)
+            fast_wake_release(ctx);
+    }
+
+    if (!cec_control_enabled && !wake && !is_transferable_in_sleep(&msg)) {
+        ALOGD("%s: filter message in standby mode\n", __func__);
+        return 0;
+    }
+
+    arc_handle_message(ctx, port, &msg);
+
+    if (ctx->p_event_cb != NULL) {
+        uint64_t cb_start_ns = cec_transport_now_ns();
+
+        event.type = HDMI_EVENT_CEC_MESSAGE;
+        event.dev = &ctx->device;
+        event.cec.initiator = msg.msg[0] >> 4;
+        event.cec.destination = msg.msg[0] & 0xf;
+        event.cec.length = msg.len - 1;
+        memcpy(event.cec.body, &msg.msg[1], msg.len - 1);
+
+        ctx->p_event_cb(&event, ctx->cb_arg);
+        account_message(ctx, &msg, cb_start_ns);
+    } else {
+        ALOGE("no event callback for msg\n");
+    }
+
+    if (wake) {
+        wake->notify_ns = cec_transport_now_ns();
+        ALOGI("%s: fast wake for opcode %02x, notified after %llu us\n", __func__,
+                wake->opcode,
+                (unsigned long long)((wake->notify_ns - wake->rx_ns) / 1000));
+        ctx->dump_due_ns = wake->notify_ns + DUMP_DELAY_NS;
+    }
+
+    return 0;
+}
+
+static int cec_init_port(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    struct cec_log_addrs laddrs = {};
+    struct cec_caps caps = {};
+    uint32_t mode;
+    int ret;
+
+    // Ensure the CEC device supports required capabilities
+    ret = cec_transport_ioctl(&port->transport, CEC_ADAP_G_CAPS, &caps);
+    if (ret)
+        return ret;
+
+    if (!(caps.capabilities & (CEC_CAP_LOG_ADDRS |
+                    CEC_CAP_TRANSMIT |
+                    CEC_CAP_PASSTHROUGH))) {
+        ALOGE("%s: wrong cec adapter capabilities %x\n",
+                __func__, caps.capabilities);
+        return -1;
+    }
+
+    // This is an exclusive follower, in addition put the CEC device into passthrough mode
+    mode = CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER_PASSTHRU;
+    ret = cec_transport_ioctl(&port->transport, CEC_S_MODE, &mode);
+    if (ret)
+        return ret;
+
+    port->info->type = ctx->type == CEC_DEVICE_TV ? HDMI_INPUT : HDMI_OUTPUT;
+    port->info->cec_supported = 1;
+    // Only a TV can receive ARC, from the audio system on its input port
+    port->info->arc_supported = ctx->type == CEC_DEVICE_TV &&
+            property_get_bool("ro.hdmi.arc_supported", true);
+    port->arc_state = ARC_STATE_IDLE;
+
+    ret = cec_transport_ioctl(&port->transport, CEC_ADAP_G_PHYS_ADDR,
+            &port->info->physical_address);
+    if (ret)
+        return ret;
+
+    memset(&laddrs, 0, sizeof(laddrs));
+    ret = cec_transport_ioctl(&port->transport, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+    if (ret)
+        return ret;
+
+    ALOGD("%s: port %d: %s, physical address %x\n", __func__, port->info->port_id,
+            caps.name, port->info->physical_address);
+
+    return 0;
+}
+
+static void port_fail(struct hdmicec_context *ctx, struct hdmicec_port *port, int err)
+{
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, port->transport.fd, NULL);
+    port->backlog = false;
+    port->errors++;
+    ctx->stats.errors++;
+
+    // Emulated adapters only fail when the peer is gone for good
+    if (port->transport.kind != CEC_TRANSPORT_DEV) {
+        ALOGE("%s: port %d transport hung up\n", __func__, port->info->port_id);
+        log_stats(ctx);
+        return;
+    }
+
+    port->backoff_ms = port->backoff_ms ?
+            MIN(port->backoff_ms * 2, HDMICEC_BACKOFF_MAX_MS) : HDMICEC_BACKOFF_MIN_MS;
+    port->retry_ns = cec_transport_now_ns() + port->backoff_ms * 1000000ull;
+    port->failed = true;
+    ALOGE("%s: port %d: %s, retrying in %u ms\n", __func__, port->info->port_id,
+            strerror(-err), port->backoff_ms);
+}
+
+/*
+ * An unregistered adapter (cable or USB adapter pulled) fails with ENODEV on
+ * the old fd for good. Opens the node again and sets it up like at startup,
+ * claiming the logical address in use again.
+ */
+static int port_reopen(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    struct cec_log_addrs laddrs;
+    int ret;
+
+    pthread_mutex_lock(&ctx->options_lock);
+    arc_set_state_locked(port, ARC_STATE_IDLE);
+    laddrs = ctx->laddrs;
+    pthread_mutex_unlock(&ctx->options_lock);
+    arc_publish(ctx);
+
+    ret = cec_transport_reopen(&port->transport);
+    if (ret)
+        return ret;
+
+    if (cec_init_port(ctx, port))
+        return -EIO;
+
+    if (laddrs.num_log_addrs &&
+            cec_transport_ioctl(&port->transport, CEC_ADAP_S_LOG_ADDRS, &laddrs))
+        ALOGW("%s: port %d: failed to claim logical address: %m\n", __func__,
+                port->info->port_id);
+
+    return 0;
+}
+
+static void port_retry(struct hdmicec_context *ctx, struct hdmicec_port *port)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLPRI | EPOLLET,
+        .data.ptr = port,
+    };
+    uint16_t phys_addr;
+    int ret = 0;
+
+    if (cec_transport_ioctl(&port->transport, CEC_ADAP_G_PHYS_ADDR, &phys_addr))
+        ret = -errno;
+
+    if (ret == -ENODEV) {
+        ALOGI("%s: port %d: adapter unregistered, reopening %s\n", __func__,
+                port->info->port_id, port->transport.path);
+        ret = port_reopen(ctx, port);
+        phys_addr = port->info->physical_address;
+    }
+
+    if (!ret && epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, port->transport.fd, &ev))
+        ret = -errno;
+
+    if (ret) {
+        port_fail(ctx, port, ret);
+        return;
+    }
+
+    ALOGI("%s: port %d back after %u errors\n", __func__, port->info->port_id, port->errors);
+    port->info->physical_address = phys_addr;
+    port->failed = false;
+    port->backoff_ms = 0;
+    // Anything queued while the port was out is only reported by the next edge
+    port->backlog = true;
+}
+
+/*
+ * Handles up to HDMICEC_DRAIN_BUDGET messages and events from one port.
+ * revents is the epoll readiness for the first pass, or 0 to poll for it;
+ * the port is polled without blocking for the rest. Returns the number of
+ * items handled. The device nodes are blocking, so readiness must never be
+ * made up: CEC_RECEIVE would sleep and keep the thread from seeing exit_fd.
+ */
+static int port_drain(struct hdmicec_context *ctx, struct hdmicec_port *port, short revents)
+{
+    struct pollfd pfd = {
+        .fd = port->transport.fd,
+        .events = POLLIN | POLLPRI,
+    };
+    int handled = 0;
+    int ready, ret;
+
+    port->backlog = false;
+
+    if (!revents) {
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) <= 0)
+            return 0;
+        revents = pfd.revents;
+    }
+
+    while (handled < HDMICEC_DRAIN_BUDGET) {
+        ready = cec_transport_ready(&port->transport, revents);
+        if (!ready)
+            return handled;
+
+        if (ready & CEC_READY_END)
+            log_stats(ctx);
+
+        if (ready & CEC_READY_HUP) {
+            port_fail(ctx, port, -EPIPE);
+            return handled;
+        }
+
+        ret = 0;
+        if (ready & CEC_READY_EVENT) /* CEC Event */
+            ret = handle_event(ctx, port);
+
+        if (!ret && (ready & CEC_READY_MSG)) /* CEC Driver */
+            ret = handle_message(ctx, port);
+
+        if (ret) {
+            port_fail(ctx, port, ret);
+            return handled;
+        }
+
+        handled++;
+
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) <= 0)
+            return handled;
+        revents = pfd.revents;
+    }
+
+    port->backlog = true;
+    return handled;
+}
+
+/* Milliseconds until the event loop has work that no fd will signal */
+static int next_timeout(struct hdmicec_context *ctx)
+{
+    uint64_t now = cec_transport_now_ns();
+    int timeout = -1;
+    int i;
+
+    if (ctx->dump_due_ns)
+        timeout = ctx->dump_due_ns > now ? (ctx->dump_due_ns - now + 999999) / 1000000 : 0;
+
+    for (i = 0; i < ctx->num_ports; i++) {
+        struct hdmicec_port *port = &ctx->ports[i];
+        uint64_t due;
+        int ms;
+
+        if (port->backlog)
+            return 0;
+
+        pthread_mutex_lock(&ctx->options_lock);
+        due = port->arc_deadline_ns;
+        pthread_mutex_unlock(&ctx->options_lock);
+        if (port->failed && (!due || port->retry_ns < due))
+            due = port->retry_ns;
+        if (!due)
+            continue;
+
+        ms = due > now ? (due - now + 999999) / 1000000 : 0;
+        if (timeout < 0 || ms < timeout)
+            timeout = ms;
+    }
+
+    return timeout;
+}
+
+/*
+ * Counts wakeups that did not make progress; a loop that keeps waking up
+ * for nothing is throttled instead of spinning a core.
+ */
+static void watchdog(struct hdmicec_context *ctx, bool idle)
+{
+    struct hdmicec_stats *stats = &ctx->stats;
+    uint64_t now = cec_transport_now_ns();
+
+    stats->loops++;
+    if (!idle)
+        return;
+
+    stats->idle_wakeups++;
+    if (now - stats->window_ns > 1000000000ull) {
+        stats->window_ns = now;
+        stats->window_idle = 0;
+    }
+
+    if (++stats->window_idle > HDMICEC_SPIN_LIMIT) {
+        if (stats->window_idle == HDMICEC_SPIN_LIMIT + 1)
+            ALOGW("%s: %u idle wakeups within 1s, throttling event loop\n", __func__,
+                    stats->window_idle);
+        stats->throttled++;
+        usleep(HDMICEC_SPIN_THROTTLE_MS * 1000);
+    }
+}
+
+/* All adapters are served from one thread, epoll data points at the port. */
+static void *event_thread(void *arg)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)arg;
+    struct epoll_event events[HDMICEC_MAX_PORTS + 1];
+    int ret, i, handled;
+
+    ALOGI("%s start!", __func__);
+    ctx->stats.start_ns = cec_transport_now_ns();
+
+    while (1) {
+        ret = epoll_wait(ctx->epoll_fd, events, HDMICEC_MAX_PORTS + 1, next_timeout(ctx));
+
+        if (ret < 0) {
+            if (errno == EINTR)
                 continue;
+            ALOGE("%s: epoll_wait failed (%m)\n", __func__);
+            ctx->stats.errors++;
+            usleep(HDMICEC_BACKOFF_MIN_MS * 1000);
+            continue;
+        }
+
+        handled = 0;
+
+        for (i = 0; i < ret; i++) {
+            struct hdmicec_port *port = events[i].data.ptr;
+
+            if (!port)   /* Exit */
+                goto exit;
+
+            handled += port_drain(ctx, port,
+                    (events[i].events & EPOLLIN ? POLLIN : 0) |
+                    (events[i].events & EPOLLPRI ? POLLPRI : 0) |
+                    (events[i].events & EPOLLERR ? POLLERR : 0) |
+                    (events[i].events & EPOLLHUP ? POLLHUP : 0));
+        }
+
+        // Ports with leftovers from the previous pass, and failed ports due a retry
+        for (i = 0; i < ctx->num_ports; i++) {
+            struct hdmicec_port *port = &ctx->ports[i];
+
+            if (port->failed && port->retry_ns <= cec_transport_now_ns()) {
+                port_retry(ctx, port);
+                handled++;
+            } else if (port->backlog) {
+                handled += port_drain(ctx, port, 0);
             }
+        }
+        handled += arc_expire(ctx);
+
+        // Keep the dump file write out of the traffic that follows a wake
+        if (ctx->dump_due_ns) {
+            uint64_t now = cec_transport_now_ns();
 
-            if (ctx->p_event_cb != NULL) {
-                event.type = HDMI_EVENT_CEC_MESSAGE;
-                event.dev = &ctx->device;
-                event.cec.initiator = msg.msg[0] >> 4;
-                event.cec.destination = msg.msg[0] & 0xf;
-                event.cec.length = msg.len - 1;
-                memcpy(event.cec.body, &msg.msg[1], msg.len - 1);
-
-                ctx->p_event_cb(&event, ctx->cb_arg);
-            } else {
-                ALOGE("no event callback for msg\n");
+            if (handled) {
+                ctx->dump_due_ns = now + DUMP_DELAY_NS;
+            } else if (now >= ctx->dump_due_ns) {
+                ctx->dump_due_ns = 0;
+                write_dump(ctx);
             }
         }
+
+        watchdog(ctx, ret > 0 && !handled);
     }
 
+exit:
+    log_stats(ctx);
     ALOGI("%s exit!", __func__);
     return NULL;
 }
 
 static void hdmicec_set_arc(const struct hdmi_cec_device *dev, int port_id, int flag)
 {
-    (void)dev;
-    (void)port_id;
-    (void)flag;
-    /* Not supported */
+    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    struct hdmicec_port *port = find_port(ctx, port_id);
+
+    ALOGD("%s: port_id=%d, flag=%d\n", __func__, port_id, flag);
+
+    if (!port || !port->info->arc_supported)
+        return;
+
+    // The framework enables ARC once it answered <Initiate ARC>, confirming
+    // the routing arc_handle_message() set up.
+    arc_set_state(ctx, port, flag ? ARC_STATE_ACTIVE : ARC_STATE_IDLE);
 }
 
 static int hdmicec_close(struct hdmi_cec_device *dev)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     uint64_t tmp = 1;
+    int i;
 
     ALOGD("%s\n", __func__);
 
@@ -466,40 +1450,30 @@ static int hdmicec_close(struct hdmi_cec_device *dev)
             pthread_join(ctx->thread, NULL);
     }
 
-    if (ctx->cec_fd > 0)
-        close(ctx->cec_fd);
+    for (i = 0; i < ctx->num_ports; i++)
+        cec_transport_close(&ctx->ports[i].transport);
+    if (ctx->epoll_fd > 0)
+        close(ctx->epoll_fd);
     if (ctx->exit_fd > 0)
         close(ctx->exit_fd);
+    if (ctx->wake_lock_fd >= 0)
+        close(ctx->wake_lock_fd);
+    if (ctx->wake_unlock_fd >= 0)
+        close(ctx->wake_unlock_fd);
+    pthread_mutex_destroy(&ctx->options_lock);
+    pthread_mutex_destroy(&ctx->arc_lock);
     free(ctx);
     return 0;
 }
 
 static int cec_init(struct hdmicec_context *ctx)
 {
-    struct cec_log_addrs laddrs = {};
-    struct cec_caps caps = {};
-    uint32_t mode;
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
     int ret;
 
-    // Ensure the CEC device supports required capabilities
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_CAPS, &caps);
-    if (ret)
-        return ret;
-
-    if (!(caps.capabilities & (CEC_CAP_LOG_ADDRS |
-                    CEC_CAP_TRANSMIT |
-                    CEC_CAP_PASSTHROUGH))) {
-        ALOGE("%s: wrong cec adapter capabilities %x\n",
-                __func__, caps.capabilities);
-        return -1;
-    }
-
-    // This is an exclusive follower, in addition put the CEC device into passthrough mode
-    mode = CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER_PASSTHRU;
-    ret = ioctl(ctx->cec_fd, CEC_S_MODE, &mode);
-    if (ret)
-        return ret;
-
     ctx->type = property_get_int32("ro.hdmi.device_type", CEC_DEVICE_PLAYBACK);
 
     ctx->vendor_id = property_get_int32("ro.hdmi.vendor_id",
@@ -508,32 +1482,92 @@ static int cec_init(struct hdmicec_context *ctx)
     ctx->version = property_get_bool("ro.hdmi.cec_version",
             CEC_OP_CEC_VERSION_1_4);
 
-    ctx->port_info.type = ctx->type == CEC_DEVICE_TV ? HDMI_INPUT : HDMI_OUTPUT;
-    ctx->port_info.port_id = 1;
-    ctx->port_info.cec_supported = 1;
-    ctx->port_info.arc_supported = 0;
+    ctx->log_addr = CEC_LOG_ADDR_INVALID;
 
     ALOGD("%s: type=%d\n", __func__, ctx->type);
     ALOGD("%s: vendor_id=%04x\n", __func__, ctx->vendor_id);
     ALOGD("%s: version=%d\n", __func__, ctx->version);
 
-    memset(&laddrs, 0, sizeof(laddrs));
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epoll_fd < 0)
+        return -1;
+
+    ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->exit_fd, &ev);
     if (ret)
         return ret;
 
-    pthread_mutex_init(&ctx->options_lock, NULL);
+    return 0;
+}
 
-    ALOGD("%s: initialized CEC controller\n", __func__);
+/*
+ * ro.hdmi.cec_device (or vendor.hdmi.cec.transport) is a comma separated
+ * list of adapters, one per HDMI port; port ids are assigned in list order
+ * starting at 1. Adapters that fail to open or initialize are skipped and
+ * keep their port id unused, the HAL fails only when none is left.
+ */
+static int open_ports(struct hdmicec_context *ctx, char *spec)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLPRI | EPOLLET,
+    };
+    char prop[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX + 8];
+    bool multi = strchr(spec, ',') != NULL;
+    char *save = NULL;
+    char *name;
+    int port_id = 0;
+    int ret;
 
-    return ret;
+    property_get("vendor.hdmi.cec.record", prop, "");
+
+    for (name = strtok_r(spec, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        struct hdmicec_port *port;
+
+        port_id++;
+        if (ctx->num_ports == HDMICEC_MAX_PORTS) {
+            ALOGE("%s: ignoring %s, at most %d adapters\n", __func__, name,
+                    HDMICEC_MAX_PORTS);
+            break;
+        }
+
+        port = &ctx->ports[ctx->num_ports];
+
+        port->info = &ctx->port_info[ctx->num_ports];
+        port->info->port_id = port_id;
+
+        ret = cec_transport_open(&port->transport, name);
+        if (!ret)
+            ret = cec_init_port(ctx, port);
+        ev.data.ptr = port;
+        if (!ret)
+            ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, port->transport.fd, &ev);
+        if (ret) {
+            ALOGE("%s: skipping port %d (%s), adapter not usable\n", __func__, port_id, name);
+            cec_transport_close(&port->transport);
+            continue;
+        }
+        ctx->num_ports++;
+
+        // One trace per adapter when more than one is driven
+        if (prop[0]) {
+            if (multi)
+                snprintf(path, sizeof(path), "%s.%d", prop, port->info->port_id);
+            else
+                snprintf(path, sizeof(path), "%s", prop);
+            cec_transport_start_recording(&port->transport, path);
+        }
+    }
+
+    ALOGD("%s: initialized %d CEC controller(s)\n", __func__, ctx->num_ports);
+
+    return ctx->num_ports ? 0 : -ENODEV;
 }
 
 static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
         struct hw_device_t **device)
 {
-    char path[32];
     char prop[PROPERTY_VALUE_MAX];
+    char dev[PROPERTY_VALUE_MAX];
     hdmicec_context_t *ctx;
     int ret;
 
@@ -544,15 +1578,10 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
         return -ENOMEM;
 
     memset(ctx, 0, sizeof(*ctx));
-
-    property_get("ro.hdmi.cec_device", prop, "cec0");
-    snprintf(path, sizeof(path), "/dev/%s", prop);
-
-    ctx->cec_fd = open(path, O_RDWR);
-    if (ctx->cec_fd < 0) {
-        ALOGE("faild to open %s, ret=%s\n", path, strerror(errno));
-        goto fail;
-    }
+    ctx->wake_lock_fd = -1;
+    ctx->wake_unlock_fd = -1;
+    pthread_mutex_init(&ctx->options_lock, NULL);
+    pthread_mutex_init(&ctx->arc_lock, NULL);
 
     ctx->exit_fd = eventfd(0, EFD_NONBLOCK);
     if (ctx->exit_fd < 0) {
@@ -560,6 +1589,15 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
         goto fail;
     }
 
+    // Wake/standby requests handled in the HAL before the framework sees them
+    ctx->fast_wake = property_get_bool("ro.hdmi.cec.fast_wake", false);
+    if (ctx->fast_wake) {
+        ctx->wake_lock_fd = open(WAKE_LOCK_PATH, O_WRONLY | O_CLOEXEC);
+        ctx->wake_unlock_fd = open(WAKE_UNLOCK_PATH, O_WRONLY | O_CLOEXEC);
+        if (ctx->wake_lock_fd < 0 || ctx->wake_unlock_fd < 0)
+            ALOGE("%s: wake lock interface unavailable: %s\n", __func__, strerror(errno));
+    }
+
     ctx->device.common.tag = HARDWARE_DEVICE_TAG;
     ctx->device.common.version = HDMI_CEC_DEVICE_API_VERSION_1_0;
     ctx->device.common.module = (struct hw_module_t *)module;
@@ -582,6 +1620,17 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
     if (ret)
         goto fail;
 
+    // vendor.hdmi.cec.transport overrides the device nodes with sockets or
+    // trace replays, see cec_transport.h.
+    property_get("ro.hdmi.cec_device", dev, "cec0");
+    property_get("vendor.hdmi.cec.transport", prop, dev);
+
+    ret = open_ports(ctx, prop);
+    if (ret) {
+        errno = -ret;
+        goto fail;
+    }
+
     *device = &ctx->device.common;
 
     /* thread loop for receiving cec msg */
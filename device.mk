@@ -254,7 +254,8 @@ PRODUCT_PACKAGES += \
 # USB
 PRODUCT_PACKAGES += \
     android.hardware.usb-service.example \
-    android.hardware.usb.gadget-service.rpi
+    android.hardware.usb.gadget-service.rpi \
+    usb_bulk_rpi
 
 PRODUCT_COPY_FILES += \
     frameworks/native/data/etc/android.hardware.usb.accessory.xml:$(TARGET_COPY_OUT_VENDOR)/etc/permissions/android.hardware.usb.accessory.xml \
@@ -16,10 +16,13 @@
  */
 
 #define LOG_TAG "android.hardware.usb.gadget-service.rpi"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
 #include "UsbGadget.h"
+#include <cutils/trace.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/inotify.h>
 #include <sys/mount.h>
@@ -33,15 +36,98 @@ namespace hardware {
 namespace usb {
 namespace gadget {
 
-UsbGadget::UsbGadget() {
-    if (access(OS_DESC_PATH, R_OK) != 0) {
+// Microseconds from one time to another, -1 if either was never reached.
+static int64_t durationUs(steady_clock::time_point from, steady_clock::time_point to) {
+    if (from == steady_clock::time_point() || to == steady_clock::time_point()) return -1;
+    return std::chrono::duration_cast<microseconds>(to - from).count();
+}
+
+// Microseconds since *stage, which then moves on to now.
+static int64_t lapUs(steady_clock::time_point* stage) {
+    steady_clock::time_point now = steady_clock::now();
+    int64_t us = durationUs(*stage, now);
+    *stage = now;
+    return us;
+}
+
+static string formatUs(int64_t us) {
+    return us < 0 ? "-" : ::android::base::StringPrintf("%.1f ms", us / 1000.0);
+}
+
+static UsbSpeed toUsbSpeed(const std::string& speed) {
+    if (speed == "low-speed")
+        return UsbSpeed::LOWSPEED;
+    else if (speed == "full-speed")
+        return UsbSpeed::FULLSPEED;
+    else if (speed == "high-speed")
+        return UsbSpeed::HIGHSPEED;
+    else if (speed == "super-speed")
+        return UsbSpeed::SUPERSPEED;
+    else if (speed == "super-speed-plus")
+        return UsbSpeed::SUPERSPEED_10Gb;
+    else
+        return UsbSpeed::UNKNOWN;
+}
+
+// Runs on the UdcWatcher thread. There is no state callback in
+// IUsbGadgetCallback, so speed changes are pushed through getUsbSpeedCb to
+// the callback of the last getUsbSpeed() call.
+void udcStateChangedCallback(const std::string& /* state */, const std::string& speed,
+                             void* payload) {
+    UsbGadget* gadget = (UsbGadget*)payload;
+    UsbSpeed usbSpeed = toUsbSpeed(speed);
+    shared_ptr<IUsbGadgetCallback> callback;
+    int64_t transactionId;
+
+    {
+        std::lock_guard<std::mutex> lock(gadget->mSpeedLock);
+        if (usbSpeed == gadget->mUsbSpeed) return;
+        gadget->mUsbSpeed = usbSpeed;
+        callback = gadget->mSpeedCallback;
+        transactionId = gadget->mSpeedTransactionId;
+    }
+
+    if (callback) {
+        ScopedAStatus ret = callback->getUsbSpeedCb(usbSpeed, transactionId);
+
+        if (!ret.isOk())
+            ALOGE("Call to getUsbSpeedCb failed %s", ret.getDescription().c_str());
+    }
+}
+
+UsbGadget::UsbGadget()
+    : mCurrentUsbFunctions(GadgetFunction::NONE),
+      mCurrentUsbFunctionsApplied(false),
+      mUsbSpeed(UsbSpeed::UNKNOWN),
+      mSpeedTransactionId(0),
+      mUdcWatcher(kGadgetName),
+      mShutdown(false) {
+    if (access(gadgetPath(kOsDescDir).c_str(), R_OK) != 0) {
         ALOGE("configfs setup not done yet");
         abort();
     }
+
+    mUdcWatcher.registerListener(&udcStateChangedCallback, this);
+    // getUsbSpeed() falls back to reading sysfs without it.
+    if (!mUdcWatcher.start()) ALOGE("UDC state not watched");
+
+    mExecutor = std::thread(&UsbGadget::executeRequests, this);
+}
+
+UsbGadget::~UsbGadget() {
+    {
+        std::lock_guard<std::mutex> lock(mRequestLock);
+        mShutdown = true;
+        mRequestCv.notify_one();
+    }
+    monitorFfs.abortWaitForPullUp();
+    mExecutor.join();
 }
 
+// Runs on the MonitorFfs thread, with its lock held.
 void currentFunctionsAppliedCallback(bool functionsApplied, void* payload) {
     UsbGadget* gadget = (UsbGadget*)payload;
+    std::lock_guard<std::mutex> lock(gadget->mStateLock);
     gadget->mCurrentUsbFunctionsApplied = functionsApplied;
 }
 
@@ -51,9 +137,17 @@ ScopedAStatus UsbGadget::getCurrentUsbFunctions(const shared_ptr<IUsbGadgetCallb
         return ScopedAStatus::fromExceptionCode(EX_NULL_POINTER);
     }
 
+    long functions;
+    bool applied;
+    {
+        std::lock_guard<std::mutex> lock(mStateLock);
+        functions = mCurrentUsbFunctions;
+        applied = mCurrentUsbFunctionsApplied;
+    }
+
     ScopedAStatus ret = callback->getCurrentUsbFunctionsCb(
-        mCurrentUsbFunctions,
-        mCurrentUsbFunctionsApplied ? Status::FUNCTIONS_APPLIED : Status::FUNCTIONS_NOT_APPLIED,
+        functions,
+        applied ? Status::FUNCTIONS_APPLIED : Status::FUNCTIONS_NOT_APPLIED,
         in_transactionId);
     if (!ret.isOk())
         ALOGE("Call to getCurrentUsbFunctionsCb failed %s", ret.getDescription().c_str());
@@ -64,30 +158,30 @@ ScopedAStatus UsbGadget::getCurrentUsbFunctions(const shared_ptr<IUsbGadgetCallb
 ScopedAStatus UsbGadget::getUsbSpeed(const shared_ptr<IUsbGadgetCallback> &callback,
 	int64_t in_transactionId) {
     std::string current_speed;
-    if (ReadFileToString(SPEED_PATH, &current_speed)) {
+    UsbSpeed usbSpeed;
+
+    if (mUdcWatcher.isRunning()) {
+        usbSpeed = toUsbSpeed(mUdcWatcher.speed());
+    } else if (ReadFileToString(udcPath(kGadgetName, "current_speed"), &current_speed)) {
         current_speed = Trim(current_speed);
         ALOGI("current USB speed is %s", current_speed.c_str());
-        if (current_speed == "low-speed")
-            mUsbSpeed = UsbSpeed::LOWSPEED;
-        else if (current_speed == "full-speed")
-            mUsbSpeed = UsbSpeed::FULLSPEED;
-        else if (current_speed == "high-speed")
-            mUsbSpeed = UsbSpeed::HIGHSPEED;
-        else if (current_speed == "super-speed")
-            mUsbSpeed = UsbSpeed::SUPERSPEED;
-        else if (current_speed == "super-speed-plus")
-            mUsbSpeed = UsbSpeed::SUPERSPEED_10Gb;
-        else if (current_speed == "UNKNOWN")
-            mUsbSpeed = UsbSpeed::UNKNOWN;
-        else
-            mUsbSpeed = UsbSpeed::UNKNOWN;
+        usbSpeed = toUsbSpeed(current_speed);
     } else {
         ALOGE("Fail to read current speed");
-        mUsbSpeed = UsbSpeed::UNKNOWN;
+        usbSpeed = UsbSpeed::UNKNOWN;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mSpeedLock);
+        mUsbSpeed = usbSpeed;
+        if (callback) {
+            mSpeedCallback = callback;
+            mSpeedTransactionId = in_transactionId;
+        }
     }
 
     if (callback) {
-        ScopedAStatus ret = callback->getUsbSpeedCb(mUsbSpeed, in_transactionId);
+        ScopedAStatus ret = callback->getUsbSpeedCb(usbSpeed, in_transactionId);
 
         if (!ret.isOk())
             ALOGE("Call to getUsbSpeedCb failed %s", ret.getDescription().c_str());
@@ -96,8 +190,100 @@ ScopedAStatus UsbGadget::getUsbSpeed(const shared_ptr<IUsbGadgetCallback> &callb
     return ScopedAStatus::ok();
 }
 
+static double megabits(uint64_t bytes, double seconds) {
+    return seconds > 0 ? bytes * 8 / seconds / 1e6 : 0;
+}
+
+binder_status_t UsbGadget::dump(int fd, const char** /* args */, uint32_t /* numArgs */) {
+    std::lock_guard<std::mutex> lock(mDumpLock);
+    long functions;
+    bool applied;
+    size_t queued;
+
+    {
+        std::lock_guard<std::mutex> stateLock(mStateLock);
+        functions = mCurrentUsbFunctions;
+        applied = mCurrentUsbFunctionsApplied;
+    }
+    {
+        std::lock_guard<std::mutex> requestLock(mRequestLock);
+        queued = mRequests.size();
+    }
+
+    dprintf(fd, "functions: 0x%lx %s, %zu requests queued\n", functions,
+            applied ? "applied" : "not applied", queued);
+    if (mUdcWatcher.isRunning())
+        dprintf(fd, "udc: %s %s\n", mUdcWatcher.state().c_str(), mUdcWatcher.speed().c_str());
+
+    for (const FunctionDesc& desc : kFunctions) {
+        bool tethering = false;
+        for (const EtherProfile& profile : kEtherProfiles)
+            tethering |= profile.function == desc.function;
+        if (!tethering || (functions & desc.function) == 0) continue;
+
+        EtherStats stats;
+        if (!readEtherStats(desc, &stats)) {
+            dprintf(fd, "%s: no interface\n", functionName(desc).c_str());
+            continue;
+        }
+
+        dprintf(fd, "%s (%s): rx %" PRIu64 " bytes %" PRIu64 " packets %" PRIu64
+                    " dropped, tx %" PRIu64 " bytes %" PRIu64 " packets %" PRIu64 " dropped\n",
+                functionName(desc).c_str(), stats.ifname.c_str(), stats.rxBytes, stats.rxPackets,
+                stats.rxDropped, stats.txBytes, stats.txPackets, stats.txDropped);
+
+        auto last = mEtherSamples.find(desc.function);
+        if (last != mEtherSamples.end() && last->second.ifname == stats.ifname &&
+            stats.rxBytes >= last->second.rxBytes && stats.txBytes >= last->second.txBytes) {
+            double seconds = std::chrono::duration<double>(stats.sampled - last->second.sampled)
+                                     .count();
+            dprintf(fd, "  since last dump (%.1f s): rx %.2f Mbit/s, tx %.2f Mbit/s\n", seconds,
+                    megabits(stats.rxBytes - last->second.rxBytes, seconds),
+                    megabits(stats.txBytes - last->second.txBytes, seconds));
+        }
+        mEtherSamples[desc.function] = stats;
+    }
+
+    std::string bulkStats;
+    if (::android::base::GetBoolProperty(kBulkProperty, false) &&
+        ReadFileToString(kBulkStatsPath, &bulkStats))
+        dprintf(fd, "%s:\n%s", kBulkFunction.configfsName, bulkStats.c_str());
+
+    std::lock_guard<std::mutex> timingLock(mTimingLock);
+    dprintf(fd, "last %zu switches, newest first:\n", mSwitchTimings.size());
+    steady_clock::time_point now = steady_clock::now();
+    for (auto it = mSwitchTimings.rbegin(); it != mSwitchTimings.rend(); ++it) {
+        dprintf(fd, "  %.1f s ago: %s\n",
+                std::chrono::duration<double>(now - it->started).count(),
+                formatSwitchTiming(*it).c_str());
+    }
+
+    return STATUS_OK;
+}
+
+string UsbGadget::formatSwitchTiming(const SwitchTiming& timing) {
+    return ::android::base::StringPrintf(
+            "0x%" PRIx64 " (tid %" PRId64 ") %s in %s: teardown %s, vid/pid %s, link %s, "
+            "endpoints %s, pull up %s, callback %s",
+            timing.functions, timing.transactionId, toString(timing.status).c_str(),
+            formatUs(timing.totalUs).c_str(), formatUs(timing.teardownUs).c_str(),
+            formatUs(timing.vidPidUs).c_str(), formatUs(timing.linkUs).c_str(),
+            formatUs(timing.endpointsUs).c_str(), formatUs(timing.pullUpUs).c_str(),
+            formatUs(timing.callbackUs).c_str());
+}
+
+void UsbGadget::recordSwitchTiming(SwitchTiming timing) {
+    timing.totalUs = durationUs(timing.started, steady_clock::now());
+    ALOGI("switch %s", formatSwitchTiming(timing).c_str());
+
+    std::lock_guard<std::mutex> lock(mTimingLock);
+    mSwitchTimings.push_back(timing);
+    if (mSwitchTimings.size() > kMaxSwitchTimings) mSwitchTimings.pop_front();
+}
+
 Status UsbGadget::tearDownGadget() {
-    if (resetGadget() != Status::SUCCESS) return Status::ERROR;
+    ATRACE_NAME("UsbGadget::tearDownGadget");
+    if (pullDownGadget(kGadgetName) != Status::SUCCESS) return Status::ERROR;
 
     if (monitorFfs.isMonitorRunning()) {
         monitorFfs.reset();
@@ -107,120 +293,76 @@ Status UsbGadget::tearDownGadget() {
     return Status::SUCCESS;
 }
 
-ScopedAStatus UsbGadget::reset(const shared_ptr<IUsbGadgetCallback> &callback,
-                               int64_t in_transactionId) {
-    if (!WriteStringToFile("none", PULLUP_PATH)) {
-        ALOGI("Gadget cannot be pulled down");
-        if (callback)
-            callback->resetCb(Status::ERROR, in_transactionId);
-
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling resetCb");
-    }
-
-    usleep(kDisconnectWaitUs);
-
-    if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) {
-        ALOGI("Gadget cannot be pulled up");
-        if (callback)
-            callback->resetCb(Status::ERROR, in_transactionId);
+static Status validateAndSetVidPid(uint64_t functions, bool bulk) {
+    ATRACE_NAME("validateAndSetVidPid");
+    int productId = productIdFor(functions, bulk);
+    char pid[8];
 
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling resetCb");
+    if (productId < 0) {
+        ALOGE("Combination not supported");
+        return Status::CONFIGURATION_NOT_SUPPORTED;
     }
 
-    if (callback)
-        callback->resetCb(Status::SUCCESS, in_transactionId);
-
-    return ScopedAStatus::ok();
+    snprintf(pid, sizeof(pid), "0x%04x", productId);
+    return setVidPid(kVendorId, pid);
 }
 
-static Status validateAndSetVidPid(uint64_t functions) {
-    Status ret = Status::SUCCESS;
-
-    switch (functions) {
-        case GadgetFunction::MTP:
-            ret = setVidPid("0x18d1", "0x4ee1");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::MTP:
-            ret = setVidPid("0x18d1", "0x4ee2");
-            break;
-        case GadgetFunction::RNDIS:
-            ret = setVidPid("0x18d1", "0x4ee3");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::RNDIS:
-            ret = setVidPid("0x18d1", "0x4ee4");
-            break;
-        case GadgetFunction::PTP:
-            ret = setVidPid("0x18d1", "0x4ee5");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::PTP:
-            ret = setVidPid("0x18d1", "0x4ee6");
-            break;
-        case GadgetFunction::ADB:
-            ret = setVidPid("0x18d1", "0x4ee7");
-            break;
-        case GadgetFunction::MIDI:
-            ret = setVidPid("0x18d1", "0x4ee8");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::MIDI:
-            ret = setVidPid("0x18d1", "0x4ee9");
-            break;
-        case GadgetFunction::NCM:
-            ret = setVidPid("0x18d1", "0x4eeb");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::NCM:
-            ret = setVidPid("0x18d1", "0x4eec");
-            break;
-        case GadgetFunction::ACCESSORY:
-            ret = setVidPid("0x18d1", "0x2d00");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::ACCESSORY:
-            ret = setVidPid("0x18d1", "0x2d01");
-            break;
-        case GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d02");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d03");
-            break;
-        case GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d04");
-            break;
-        case GadgetFunction::ADB | GadgetFunction::ACCESSORY |
-                GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d05");
-            break;
-        default:
-            ALOGE("Combination not supported");
-            ret = Status::CONFIGURATION_NOT_SUPPORTED;
-    }
-    return ret;
+// The bulk function only joins a composition once usb_bulk_rpi serves it.
+// Linked without its daemon, it would hold off the pull up, ADB's included.
+static bool bulkFunctionReady() {
+    return ::android::base::GetBoolProperty(kBulkProperty, false) &&
+           ffsEndpointsPresent(kBulkFunction);
 }
 
-Status UsbGadget::setupFunctions(long functions,
-                                 const shared_ptr<IUsbGadgetCallback> &callback, uint64_t timeout,
-                                 int64_t in_transactionId) {
-    bool ffsEnabled = false;
+Status UsbGadget::linkFunctions(long functions, bool bulk, bool* ffsEnabled) {
+    ATRACE_NAME("UsbGadget::linkFunctions");
     int i = 0;
 
-    if (addGenericAndroidFunctions(&monitorFfs, functions, &ffsEnabled, &i) !=
+    if (addGenericAndroidFunctions(&monitorFfs, functions, ffsEnabled, &i) !=
         Status::SUCCESS)
         return Status::ERROR;
 
+    if (bulk) {
+        *ffsEnabled = true;
+        if (addFunction(&monitorFfs, kBulkFunction, &i) != Status::SUCCESS) return Status::ERROR;
+    }
+
     if ((functions & GadgetFunction::ADB) != 0) {
-        ffsEnabled = true;
+        *ffsEnabled = true;
         if (addAdb(&monitorFfs, &i) != Status::SUCCESS) return Status::ERROR;
     }
 
+    // Drop the links of functions no longer requested.
+    if (unlinkFunctions(gadgetPath(kConfigDir).c_str(), i)) return Status::ERROR;
+    if (!*ffsEnabled && !writeIfChanged("0", gadgetPath(kDescUseFile))) return Status::ERROR;
+
+    return Status::SUCCESS;
+}
+
+Status UsbGadget::setupFunctions(long functions, bool bulk,
+                                 const shared_ptr<IUsbGadgetCallback> &callback, uint64_t timeout,
+                                 int64_t in_transactionId, SwitchTiming* timing) {
+    steady_clock::time_point stage = steady_clock::now();
+    bool ffsEnabled = false;
+
+    if (linkFunctions(functions, bulk, &ffsEnabled) != Status::SUCCESS) return Status::ERROR;
+    timing->linkUs = lapUs(&stage);
+
     // Pull up the gadget right away when there are no ffs functions.
     if (!ffsEnabled) {
-        if (!WriteStringToFile(kGadgetName, PULLUP_PATH))
+        if (!WriteStringToFile(kGadgetName, gadgetPath(kPullUpFile)))
             return Status::ERROR;
-        mCurrentUsbFunctionsApplied = true;
-
-        if (callback)
+        timing->pullUpUs = lapUs(&stage);
+        {
+            std::lock_guard<std::mutex> lock(mStateLock);
+            mCurrentUsbFunctionsApplied = true;
+        }
+
+        if (callback) {
+            ATRACE_NAME("setCurrentUsbFunctionsCb");
             callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS, in_transactionId);
+            timing->callbackUs = lapUs(&stage);
+        }
 
         return Status::SUCCESS;
     }
@@ -233,75 +375,196 @@ Status UsbGadget::setupFunctions(long functions,
 
     if (kDebug) ALOGI("Mainthread in Cv");
 
+    bool pullup = false;
     if (callback) {
-        bool pullup = monitorFfs.waitForPullUp(timeout);
-        ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions,
-                                                               pullup ? Status::SUCCESS : Status::ERROR,
+        ATRACE_NAME("MonitorFfs::waitForPullUp");
+        // A newer request aborts the wait, this one is then superseded.
+        pullup = !isSuperseded() && monitorFfs.waitForPullUp(timeout);
+    }
+
+    // Also fills in a pull up that came too late for the callback.
+    MonitorFfs::PullUpTimes times = monitorFfs.getPullUpTimes();
+    timing->endpointsUs = durationUs(times.armed, times.endpointsReady);
+    timing->pullUpUs = durationUs(times.endpointsReady, times.pulledUp);
+
+    if (callback) {
+        ATRACE_NAME("setCurrentUsbFunctionsCb");
+        timing->status = pullup          ? Status::SUCCESS
+                         : isSuperseded() ? Status::FUNCTIONS_NOT_APPLIED
+                                          : Status::ERROR;
+        stage = steady_clock::now();
+        ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, timing->status,
                                                                in_transactionId);
         if (!ret.isOk())
             ALOGE("setCurrentUsbFunctionsCb error %s", ret.getMessage());
+        timing->callbackUs = lapUs(&stage);
     }
 
     return Status::SUCCESS;
 }
 
-ScopedAStatus UsbGadget::setCurrentUsbFunctions(int64_t functions,
-                                                const shared_ptr<IUsbGadgetCallback> &callback,
-                                                int64_t timeoutMs,
-                                                int64_t in_transactionId) {
-    std::unique_lock<std::mutex> lk(mLockSetCurrentFunction);
+void UsbGadget::completeSetFunctions(const Request& request, Status status) {
+    if (request.callback == nullptr) return;
+    ATRACE_NAME("setCurrentUsbFunctionsCb");
+
+    ScopedAStatus ret =
+            request.callback->setCurrentUsbFunctionsCb(request.functions, status,
+                                                       request.transactionId);
+    if (!ret.isOk())
+        ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
+}
 
-    mCurrentUsbFunctions = functions;
-    mCurrentUsbFunctionsApplied = false;
+bool UsbGadget::isSuperseded() {
+    std::lock_guard<std::mutex> lock(mRequestLock);
 
-    // Unlink the gadget and stop the monitor if running.
+    for (const Request& request : mRequests) {
+        if (request.type == Request::Type::SET_FUNCTIONS) return true;
+    }
+    return false;
+}
+
+void UsbGadget::queueRequest(Request request) {
+    std::vector<Request> superseded;
+
+    {
+        std::lock_guard<std::mutex> lock(mRequestLock);
+        // Nothing would ever see the functions of a request that another one
+        // replaces before it started. RESET is kept and stays in order.
+        while (request.type == Request::Type::SET_FUNCTIONS && !mRequests.empty() &&
+               mRequests.back().type == Request::Type::SET_FUNCTIONS) {
+            superseded.push_back(mRequests.back());
+            mRequests.pop_back();
+        }
+        mRequests.push_back(request);
+        mRequestCv.notify_one();
+
+        // The request in progress stops waiting for the pull up. Done under
+        // mRequestLock, or mExecutor could already be waiting for this one.
+        if (request.type == Request::Type::SET_FUNCTIONS) monitorFfs.abortWaitForPullUp();
+    }
+
+    for (const Request& dropped : superseded) {
+        ALOGI("setCurrentUsbFunctions 0x%" PRIx64 " superseded", dropped.functions);
+        completeSetFunctions(dropped, Status::FUNCTIONS_NOT_APPLIED);
+    }
+}
+
+void UsbGadget::executeRequests() {
+    for (;;) {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lk(mRequestLock);
+            mRequestCv.wait(lk, [this] { return mShutdown || !mRequests.empty(); });
+            if (mShutdown) return;
+            request = mRequests.front();
+            mRequests.pop_front();
+        }
+
+        if (request.type == Request::Type::RESET)
+            runReset(request);
+        else
+            runSetFunctions(request);
+    }
+}
+
+void UsbGadget::runReset(const Request& request) {
+    Status status = Status::SUCCESS;
+
+    if (pullDownGadget(kGadgetName) != Status::SUCCESS) {
+        status = Status::ERROR;
+    } else if (!WriteStringToFile(kGadgetName, gadgetPath(kPullUpFile))) {
+        ALOGI("Gadget cannot be pulled up");
+        status = Status::ERROR;
+    }
+
+    if (request.callback) request.callback->resetCb(status, request.transactionId);
+}
+
+void UsbGadget::runSetFunctions(const Request& request) {
+    ATRACE_NAME("UsbGadget::setCurrentUsbFunctions");
+    SwitchTiming timing = {request.functions, request.transactionId, Status::SUCCESS,
+                           steady_clock::now(), -1, -1, -1, -1, -1, -1, -1};
+    steady_clock::time_point stage = timing.started;
+    // Decided once per switch, so the product ID matches the links.
+    bool bulk = false;
+    {
+        std::lock_guard<std::mutex> lock(mStateLock);
+        mCurrentUsbFunctions = request.functions;
+        mCurrentUsbFunctionsApplied = false;
+    }
+
+    // Pull down the gadget and stop the monitor if running. The function
+    // links are only updated where they differ from the request.
     Status status = tearDownGadget();
+    timing.teardownUs = lapUs(&stage);
     if (status != Status::SUCCESS) {
         goto error;
     }
 
     ALOGI("Returned from tearDown gadget");
 
-    // Leave the gadget pulled down to give time for the host to sense disconnect.
-    usleep(kDisconnectWaitUs);
+    if (request.functions == GadgetFunction::NONE) {
+        if (resetGadget() != Status::SUCCESS)
+            ALOGE("Gadget cannot be reset");
+        timing.linkUs = lapUs(&stage);
 
-    if (functions == GadgetFunction::NONE) {
-        if (callback == NULL)
-            return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "callback == NULL");
-        ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling setCurrentUsbFunctionsCb");
+        completeSetFunctions(request, Status::SUCCESS);
+        timing.callbackUs = lapUs(&stage);
+        recordSwitchTiming(timing);
+        return;
     }
 
-    status = validateAndSetVidPid(functions);
+    bulk = bulkFunctionReady();
+    status = validateAndSetVidPid(request.functions, bulk);
+    timing.vidPidUs = lapUs(&stage);
 
     if (status != Status::SUCCESS) {
         goto error;
     }
 
-    status = setupFunctions(functions, callback, timeoutMs, in_transactionId);
+    status = setupFunctions(request.functions, bulk, request.callback, request.timeoutMs,
+                            request.transactionId, &timing);
     if (status != Status::SUCCESS) {
         goto error;
     }
 
     ALOGI("Usb Gadget setcurrent functions called successfully");
-    return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Usb Gadget setcurrent functions called successfully");
+    recordSwitchTiming(timing);
+    return;
 
 error:
     ALOGI("Usb Gadget setcurrent functions failed");
-    if (callback == NULL)
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Usb Gadget setcurrent functions failed");
-    ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, status, in_transactionId);
-    if (!ret.isOk())
-        ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
-    return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling setCurrentUsbFunctionsCb");
+    timing.status = status;
+    stage = steady_clock::now();
+    completeSetFunctions(request, status);
+    timing.callbackUs = lapUs(&stage);
+    recordSwitchTiming(timing);
 }
+
+ScopedAStatus UsbGadget::setCurrentUsbFunctions(int64_t functions,
+                                                const shared_ptr<IUsbGadgetCallback> &callback,
+                                                int64_t timeoutMs,
+                                                int64_t in_transactionId) {
+    Request request = {Request::Type::SET_FUNCTIONS, functions, callback, timeoutMs,
+                       in_transactionId};
+
+    // Rejected right away, the current functions stay up.
+    if (functions != GadgetFunction::NONE && productIdFor(functions) < 0) {
+        ALOGE("Combination not supported");
+        completeSetFunctions(request, Status::CONFIGURATION_NOT_SUPPORTED);
+        return ScopedAStatus::ok();
+    }
+
+    queueRequest(request);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus UsbGadget::reset(const shared_ptr<IUsbGadgetCallback> &callback,
+                               int64_t in_transactionId) {
+    queueRequest({Request::Type::RESET, 0, callback, 0, in_transactionId});
+    return ScopedAStatus::ok();
+}
+
 }  // namespace gadget
 }  // namespace usb
 }  // namespace hardware
@@ -21,6 +21,7 @@
 #include <android-base/file.h>
 #include <android-base/properties.h>
 #include <android-base/unique_fd.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <aidl/android/hardware/usb/gadget/BnUsbGadget.h>
 #include <aidl/android/hardware/usb/gadget/BnUsbGadgetCallback.h>
@@ -32,6 +33,8 @@
 #include <utils/Log.h>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -58,19 +61,25 @@ using ::std::shared_ptr;
 using ::std::string;
 
 constexpr char kGadgetName[] = "fe980000.usb";
+// Counters written by usb_bulk_rpi.
+constexpr char kBulkStatsPath[] = "/data/vendor/usb/bulk_stats";
 static MonitorFfs monitorFfs(kGadgetName);
 
-#define UDC_PATH "/sys/class/udc/fe980000.usb/"
-#define SPEED_PATH UDC_PATH "current_speed"
-
 struct UsbGadget : public BnUsbGadget {
     UsbGadget();
+    ~UsbGadget();
 
-    // Makes sure that only one request is processed at a time.
-    std::mutex mLockSetCurrentFunction;
+    // protects the current functions, written by mExecutor and the
+    // MonitorFfs thread and read by binder calls.
+    std::mutex mStateLock;
     long mCurrentUsbFunctions;
     bool mCurrentUsbFunctionsApplied;
+
+    // protects the speed and the callback it is pushed to.
+    std::mutex mSpeedLock;
     UsbSpeed mUsbSpeed;
+    shared_ptr<IUsbGadgetCallback> mSpeedCallback;
+    int64_t mSpeedTransactionId;
 
     ScopedAStatus setCurrentUsbFunctions(int64_t functions,
                                          const shared_ptr<IUsbGadgetCallback> &callback,
@@ -85,10 +94,72 @@ struct UsbGadget : public BnUsbGadget {
     ScopedAStatus getUsbSpeed(const shared_ptr<IUsbGadgetCallback> &callback,
                               int64_t in_transactionId) override;
 
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
   private:
+    // A binder request carried out by mExecutor.
+    struct Request {
+        enum class Type { SET_FUNCTIONS, RESET } type;
+        int64_t functions;
+        shared_ptr<IUsbGadgetCallback> callback;
+        int64_t timeoutMs;
+        int64_t transactionId;
+    };
+
+    // How long each stage of a SET_FUNCTIONS request took, in microseconds,
+    // -1 for the stages it did not go through.
+    struct SwitchTiming {
+        int64_t functions;
+        int64_t transactionId;
+        Status status;
+        steady_clock::time_point started;
+        int64_t teardownUs;
+        int64_t vidPidUs;
+        // configfs links and os_desc.
+        int64_t linkUs;
+        // From arming MonitorFfs to the last FunctionFS endpoint showing up.
+        int64_t endpointsUs;
+        // From then on to the UDC write.
+        int64_t pullUpUs;
+        int64_t callbackUs;
+        int64_t totalUs;
+    };
+    static constexpr size_t kMaxSwitchTimings = 16;
+
+    UdcWatcher mUdcWatcher;
+
+    // Requests not started yet. setCurrentUsbFunctions() and reset() only
+    // queue them, mExecutor carries them out one at a time.
+    std::mutex mRequestLock;
+    std::condition_variable mRequestCv;
+    std::deque<Request> mRequests;
+    bool mShutdown;
+    std::thread mExecutor;
+
+    // Tethering counters at the previous dump, for the throughput since.
+    std::mutex mDumpLock;
+    std::map<int64_t, EtherStats> mEtherSamples;
+
+    // The last kMaxSwitchTimings requests carried out, newest last.
+    std::mutex mTimingLock;
+    std::deque<SwitchTiming> mSwitchTimings;
+
+    void queueRequest(Request request);
+    // Whether a newer SET_FUNCTIONS request is waiting.
+    bool isSuperseded();
+    void executeRequests();
+    void runSetFunctions(const Request& request);
+    void runReset(const Request& request);
+    void completeSetFunctions(const Request& request, Status status);
+    void recordSwitchTiming(SwitchTiming timing);
+    static string formatSwitchTiming(const SwitchTiming& timing);
     Status tearDownGadget();
-    Status setupFunctions(long functions, const shared_ptr<IUsbGadgetCallback> &callback,
-                          uint64_t timeout, int64_t in_transactionId);
+    // Links the requested functions, kBulkFunction if bulk is set, and
+    // unlinks the others.
+    Status linkFunctions(long functions, bool bulk, bool* ffsEnabled);
+    Status setupFunctions(long functions, bool bulk,
+                          const shared_ptr<IUsbGadgetCallback> &callback, uint64_t timeout,
+                          int64_t in_transactionId, SwitchTiming* timing);
 };
 
 }  // namespace gadget
@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Vendor bulk function on FunctionFS (ffs.bulk). Every transfer the host
+// sends on the OUT endpoint is echoed back on the IN endpoint, so a host,
+// e.g. an AOA head unit, can measure the throughput and round trip the
+// gadget sustains. Transfers go through Linux AIO with kQueueDepth requests
+// queued per direction, and a completed read is resubmitted as the write
+// from the same buffer without copying it.
+//
+// Counters are written to kStatsPath once per second and shown by the
+// gadget HAL's dump().
+
+#define LOG_TAG "usb_bulk_rpi"
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/aio_abi.h>
+#include <linux/usb/functionfs.h>
+#include <log/log.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+using ::android::base::unique_fd;
+using ::android::base::WriteStringToFile;
+
+namespace {
+
+constexpr char kFfsPath[] = "/dev/usb-ffs/bulk/";
+constexpr char kStatsPath[] = "/data/vendor/usb/bulk_stats";
+
+constexpr int kQueueDepth = 8;
+constexpr size_t kBufferSize = 16384;
+constexpr uint64_t kStatsIntervalNs = 1000000000ULL;
+
+// Upper bounds in microseconds, the last bucket is open ended.
+constexpr uint64_t kLatencyBoundsUs[] = {125, 250, 500, 1000, 2000, 5000, 10000, 50000};
+constexpr size_t kLatencyBuckets = sizeof(kLatencyBoundsUs) / sizeof(kLatencyBoundsUs[0]) + 1;
+
+struct FuncDesc {
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio source;
+    struct usb_endpoint_descriptor_no_audio sink;
+} __attribute__((packed));
+
+struct Descriptors {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct FuncDesc fs_descs, hs_descs;
+} __attribute__((packed));
+
+constexpr struct usb_interface_descriptor kInterface = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bAlternateSetting = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+        .bInterfaceSubClass = 0xf0,
+        .bInterfaceProtocol = 0x01,
+        .iInterface = 1,
+};
+
+// ep1 is the OUT endpoint, ep2 the IN one.
+constexpr struct FuncDesc endpoints(uint16_t maxPacketSize) {
+    return {
+            .intf = kInterface,
+            .source =
+                    {
+                            .bLength = sizeof(struct usb_endpoint_descriptor_no_audio),
+                            .bDescriptorType = USB_DT_ENDPOINT,
+                            .bEndpointAddress = 1 | USB_DIR_OUT,
+                            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+                            .wMaxPacketSize = maxPacketSize,
+                            .bInterval = 0,
+                    },
+            .sink =
+                    {
+                            .bLength = sizeof(struct usb_endpoint_descriptor_no_audio),
+                            .bDescriptorType = USB_DT_ENDPOINT,
+                            .bEndpointAddress = 2 | USB_DIR_IN,
+                            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+                            .wMaxPacketSize = maxPacketSize,
+                            .bInterval = 0,
+                    },
+    };
+}
+
+constexpr char kInterfaceName[] = "Bulk";
+
+struct Strings {
+    struct usb_functionfs_strings_head header;
+    struct {
+        __le16 code;
+        char str1[sizeof(kInterfaceName)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed));
+
+uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int io_setup(unsigned nr, aio_context_t* ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+int io_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+int io_submit(aio_context_t ctx, long nr, struct iocb** iocbpp) {
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+int io_getevents(aio_context_t ctx, long min_nr, long max_nr, struct io_event* events,
+                 struct timespec* timeout) {
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+int io_cancel(aio_context_t ctx, struct iocb* iocb, struct io_event* result) {
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+// Transfer counters of one direction.
+struct Direction {
+    uint64_t transfers = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    uint64_t latency[kLatencyBuckets] = {};
+    // Bytes at the start of the current stats interval, and the best rate
+    // seen over a full interval.
+    uint64_t intervalBytes = 0;
+    double peakMBps = 0;
+
+    void complete(size_t length, uint64_t latencyNs) {
+        uint64_t latencyUs = latencyNs / 1000;
+        size_t bucket = 0;
+
+        while (bucket < kLatencyBuckets - 1 && latencyUs > kLatencyBoundsUs[bucket]) bucket++;
+        transfers++;
+        bytes += length;
+        latency[bucket]++;
+    }
+};
+
+struct Request {
+    struct iocb iocb;
+    bool write;
+    bool pending;
+    uint64_t submitted;
+    void* buffer;
+};
+
+class BulkFunction {
+  public:
+    ~BulkFunction();
+    bool open();
+    void run();
+
+  private:
+    bool writeDescriptors();
+    bool submit(Request& request, bool write, size_t length);
+    void start();
+    void stop();
+    void handleControl();
+    void handleCompletions();
+    void writeStats(uint64_t time);
+
+    unique_fd mControl;
+    unique_fd mOut;
+    unique_fd mIn;
+    unique_fd mEventFd;
+    aio_context_t mContext = 0;
+    Request mRequests[kQueueDepth] = {};
+    bool mEnabled = false;
+
+    Direction mRx;
+    Direction mTx;
+    uint64_t mSessions = 0;
+    uint64_t mIntervalStart = 0;
+};
+
+BulkFunction::~BulkFunction() {
+    if (mContext) io_destroy(mContext);
+    for (Request& request : mRequests) free(request.buffer);
+}
+
+bool BulkFunction::writeDescriptors() {
+    struct Descriptors descriptors = {
+            .header =
+                    {
+                            .magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+                            .length = htole32(sizeof(descriptors)),
+                            .flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC,
+                    },
+            .fs_count = htole32(3),
+            .hs_count = htole32(3),
+            .fs_descs = endpoints(64),
+            .hs_descs = endpoints(512),
+    };
+    struct Strings strings = {
+            .header =
+                    {
+                            .magic = htole32(FUNCTIONFS_STRINGS_MAGIC),
+                            .length = htole32(sizeof(strings)),
+                            .str_count = htole32(1),
+                            .lang_count = htole32(1),
+                    },
+            .lang0 = {htole16(0x0409), {}},
+    };
+    memcpy(strings.lang0.str1, kInterfaceName, sizeof(kInterfaceName));
+
+    if (!::android::base::WriteFully(mControl, &descriptors, sizeof(descriptors))) {
+        ALOGE("Cannot write descriptors errno:%d", errno);
+        return false;
+    }
+    if (!::android::base::WriteFully(mControl, &strings, sizeof(strings))) {
+        ALOGE("Cannot write strings errno:%d", errno);
+        return false;
+    }
+    return true;
+}
+
+bool BulkFunction::open() {
+    std::string path = kFfsPath;
+
+    mControl.reset(TEMP_FAILURE_RETRY(::open((path + "ep0").c_str(), O_RDWR | O_CLOEXEC)));
+    if (mControl < 0) {
+        ALOGE("Cannot open %sep0 errno:%d", kFfsPath, errno);
+        return false;
+    }
+
+    // ep1 and ep2 show up once the descriptors are written, which is what
+    // MonitorFfs waits for before pulling up the gadget.
+    if (!writeDescriptors()) return false;
+
+    mOut.reset(TEMP_FAILURE_RETRY(::open((path + "ep1").c_str(), O_RDONLY | O_CLOEXEC)));
+    mIn.reset(TEMP_FAILURE_RETRY(::open((path + "ep2").c_str(), O_WRONLY | O_CLOEXEC)));
+    if (mOut < 0 || mIn < 0) {
+        ALOGE("Cannot open the endpoints errno:%d", errno);
+        return false;
+    }
+
+    mEventFd.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (mEventFd < 0 || io_setup(kQueueDepth, &mContext) < 0) {
+        ALOGE("Cannot set up AIO errno:%d", errno);
+        return false;
+    }
+
+    for (Request& request : mRequests) {
+        if (posix_memalign(&request.buffer, 4096, kBufferSize)) {
+            ALOGE("Cannot allocate buffers");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BulkFunction::submit(Request& request, bool write, size_t length) {
+    struct iocb* iocb = &request.iocb;
+
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = reinterpret_cast<uintptr_t>(&request);
+    iocb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+    iocb->aio_fildes = write ? mIn : mOut;
+    iocb->aio_buf = reinterpret_cast<uintptr_t>(request.buffer);
+    iocb->aio_nbytes = length;
+    iocb->aio_flags = IOCB_FLAG_RESFD;
+    iocb->aio_resfd = mEventFd;
+
+    request.write = write;
+    request.submitted = now();
+    if (io_submit(mContext, 1, &iocb) != 1) {
+        ALOGE("io_submit failed errno:%d", errno);
+        (write ? mTx : mRx).errors++;
+        return false;
+    }
+    request.pending = true;
+    return true;
+}
+
+void BulkFunction::start() {
+    if (mEnabled) return;
+
+    ALOGI("Function enabled");
+    mEnabled = true;
+    mSessions++;
+    for (Request& request : mRequests) {
+        if (!request.pending) submit(request, false, kBufferSize);
+    }
+}
+
+void BulkFunction::stop() {
+    struct io_event event;
+
+    if (!mEnabled) return;
+
+    ALOGI("Function disabled");
+    mEnabled = false;
+    // The completions of cancelled requests are still delivered.
+    // handleCompletions() drops them, or reads again if already re-enabled.
+    for (Request& request : mRequests) {
+        if (request.pending) io_cancel(mContext, &request.iocb, &event);
+    }
+}
+
+void BulkFunction::handleControl() {
+    struct usb_functionfs_event events[4];
+    ssize_t len = TEMP_FAILURE_RETRY(read(mControl, events, sizeof(events)));
+
+    for (ssize_t i = 0; i < len / (ssize_t)sizeof(events[0]); i++) {
+        switch (events[i].type) {
+            case FUNCTIONFS_ENABLE:
+            case FUNCTIONFS_RESUME:
+                start();
+                break;
+            case FUNCTIONFS_DISABLE:
+            case FUNCTIONFS_UNBIND:
+                stop();
+                break;
+            case FUNCTIONFS_SETUP:
+                // No vendor requests. Transferring in the wrong direction
+                // stalls them.
+                if ((events[i].u.setup.bRequestType & USB_DIR_IN
+                             ? TEMP_FAILURE_RETRY(read(mControl, NULL, 0))
+                             : TEMP_FAILURE_RETRY(write(mControl, NULL, 0))) < 0 &&
+                    errno != EL2HLT)
+                    ALOGE("Cannot stall request errno:%d", errno);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void BulkFunction::handleCompletions() {
+    struct io_event events[kQueueDepth];
+    struct timespec timeout = {0, 0};
+    uint64_t count;
+
+    if (read(mEventFd, &count, sizeof(count)) < 0) return;
+
+    int n = io_getevents(mContext, 0, kQueueDepth, events, &timeout);
+    uint64_t time = now();
+    for (int i = 0; i < n; i++) {
+        Request& request = *reinterpret_cast<Request*>(events[i].data);
+        Direction& direction = request.write ? mTx : mRx;
+        long long res = events[i].res;
+
+        request.pending = false;
+        if (res < 0) {
+            // While disabled the request waits for FUNCTIONFS_ENABLE. A quick
+            // reconnect can handle that before the completion arrives, so
+            // read again whatever the error. ESHUTDOWN on disconnect,
+            // ECONNRESET and ECANCELED from io_cancel() in stop() are no
+            // transfer errors.
+            if (!mEnabled) continue;
+            if (res != -ESHUTDOWN && res != -ECONNRESET && res != -ECANCELED) direction.errors++;
+            submit(request, false, kBufferSize);
+            continue;
+        }
+
+        direction.complete(res, time - request.submitted);
+        if (!mEnabled) continue;
+
+        // Echo the data from the same buffer, then read into it again.
+        if (!request.write && res > 0)
+            submit(request, true, res);
+        else
+            submit(request, false, kBufferSize);
+    }
+}
+
+void BulkFunction::writeStats(uint64_t time) {
+    double seconds = (time - mIntervalStart) / 1e9;
+    std::string stats;
+    char line[160];
+
+    for (Direction* direction : {&mRx, &mTx}) {
+        double mbps = (direction->bytes - direction->intervalBytes) / seconds / 1e6;
+        if (mbps > direction->peakMBps) direction->peakMBps = mbps;
+
+        snprintf(line, sizeof(line),
+                 "%s: %" PRIu64 " transfers %" PRIu64 " bytes %" PRIu64
+                 " errors, %.2f MB/s (peak %.2f)\n",
+                 direction == &mRx ? "out" : "in", direction->transfers, direction->bytes,
+                 direction->errors, mbps, direction->peakMBps);
+        stats += line;
+        direction->intervalBytes = direction->bytes;
+    }
+
+    stats += "in latency (us):";
+    for (size_t b = 0; b < kLatencyBuckets - 1; b++) {
+        snprintf(line, sizeof(line), " <=%" PRIu64 ":%" PRIu64, kLatencyBoundsUs[b],
+                 mTx.latency[b]);
+        stats += line;
+    }
+    snprintf(line, sizeof(line), " more:%" PRIu64 "\nsessions: %" PRIu64 ", %s\n",
+             mTx.latency[kLatencyBuckets - 1], mSessions, mEnabled ? "enabled" : "disabled");
+    stats += line;
+
+    std::string tmp = std::string(kStatsPath) + ".tmp";
+    if (WriteStringToFile(stats, tmp)) rename(tmp.c_str(), kStatsPath);
+    mIntervalStart = time;
+}
+
+void BulkFunction::run() {
+    struct pollfd fds[2] = {{mControl, POLLIN, 0}, {mEventFd, POLLIN, 0}};
+
+    mIntervalStart = now();
+    for (;;) {
+        uint64_t time = now();
+        int timeout = 0;
+
+        if (time < mIntervalStart + kStatsIntervalNs)
+            timeout = (mIntervalStart + kStatsIntervalNs - time) / 1000000 + 1;
+
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, timeout)) < 0) {
+            ALOGE("poll failed errno:%d", errno);
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) handleControl();
+        if (fds[1].revents & POLLIN) handleCompletions();
+
+        if (now() >= mIntervalStart + kStatsIntervalNs) writeStats(now());
+    }
+}
+
+}  // namespace
+
+int main() {
+    BulkFunction function;
+
+    if (!function.open()) return EXIT_FAILURE;
+
+    function.run();
+    return EXIT_FAILURE;
+}
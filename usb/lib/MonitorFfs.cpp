@@ -16,30 +16,36 @@
  */
 
 #define LOG_TAG "libusbconfigfs"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
 #include "include/UsbGadgetCommon.h"
 
+#include <cutils/trace.h>
+
 namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
 namespace gadget {
 
-static volatile bool gadgetPullup;
-
 MonitorFfs::MonitorFfs(const char* const gadget)
     : mWatchFd(),
       mEndpointList(),
       mLock(),
       mCv(),
       mLockFd(),
+      mCommandsQueued(0),
+      mCommandsDone(0),
       mCurrentUsbFunctionsApplied(false),
+      mPullUp(false),
+      mWaitAborted(false),
+      mPullUpTimes(),
       mMonitor(),
       mCallback(NULL),
       mPayload(NULL),
       mGadgetName(gadget),
       mMonitorRunning(false) {
-    unique_fd eventFd(eventfd(0, 0));
+    unique_fd eventFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
     if (eventFd == -1) {
         ALOGE("mEventFd failed to create %d", errno);
         abort();
@@ -64,7 +70,13 @@ MonitorFfs::MonitorFfs(const char* const gadget)
     mEpollFd = std::move(epollFd);
     mInotifyFd = std::move(inotifyFd);
     mEventFd = std::move(eventFd);
-    gadgetPullup = false;
+}
+
+MonitorFfs::~MonitorFfs() {
+    if (mMonitor) {
+        sendCommand(Command::SHUTDOWN);
+        mMonitor->join();
+    }
 }
 
 static void displayInotifyEvent(struct inotify_event* i) {
@@ -93,128 +105,226 @@ static void displayInotifyEvent(struct inotify_event* i) {
     if (i->len > 0) ALOGE("        name = %s\n", i->name);
 }
 
+void MonitorFfs::scanEndpoints(const string& dir) {
+    for (size_t i = 0; i < mEndpointList.size(); i++) {
+        if (!dir.empty() && mEndpointList[i].compare(0, dir.size(), dir) != 0) continue;
+        mEndpointPresent[i] = access(mEndpointList[i].c_str(), R_OK) == 0;
+    }
+}
+
+// FunctionFS creates and removes the ep files without telling inotify, so
+// only the names of create/delete events are trusted as is. Any other
+// activity in a function's directory, e.g. its daemon writing or closing
+// ep0, rechecks the endpoints of that function alone.
+void MonitorFfs::updateEndpoints(const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        scanEndpoints("");
+        return;
+    }
+
+    size_t w = 0;
+    while (w < mWatchFd.size() && mWatchFd[w] != event->wd) w++;
+    if (w == mWatchFd.size()) return;
+    const string& dir = mWatchPath[w];
+
+    if (event->len > 0 && (event->mask & (IN_CREATE | IN_DELETE))) {
+        string path = dir + event->name;
+        for (size_t i = 0; i < mEndpointList.size(); i++) {
+            if (mEndpointList[i] == path) {
+                mEndpointPresent[i] = (event->mask & IN_CREATE) != 0;
+                return;
+            }
+        }
+        if (strcmp(event->name, "ep0") != 0) return;
+    }
+
+    scanEndpoints(dir);
+}
+
+bool MonitorFfs::endpointsReady() {
+    return mEndpointPresent.count() == mEndpointList.size();
+}
+
+bool MonitorFfs::pullUp() {
+    ATRACE_NAME("MonitorFfs::pullUp");
+    // The UDC is unbound when a function daemon goes away, the host must
+    // have seen the disconnect before the gadget comes back.
+    waitForUdcState(mGadgetName, "not attached", kDisconnectWaitUs / 1000);
+
+    if (!WriteStringToFile(mGadgetName, gadgetPath(kPullUpFile))) return false;
+
+    lock_guard<mutex> lock(mLock);
+    mPullUpTimes.pulledUp = steady_clock::now();
+    mCurrentUsbFunctionsApplied = true;
+    if (mCallback) mCallback(mCurrentUsbFunctionsApplied, mPayload);
+    mPullUp = true;
+    ALOGI("GADGET pulled up");
+    // notify the main thread to signal userspace.
+    mCv.notify_all();
+    return true;
+}
+
+void MonitorFfs::sendCommand(Command command) {
+    std::unique_lock<std::mutex> lk(mLock);
+    uint64_t seq = ++mCommandsQueued;
+    uint64_t wake = 1;
+
+    mCommands.push_back(command);
+    if (TEMP_FAILURE_RETRY(write(mEventFd, &wake, sizeof(wake))) < 0)
+        ALOGE("Error writing eventfd errno=%d", errno);
+
+    mCommandCv.wait(lk, [this, seq] { return mCommandsDone >= seq; });
+}
+
 void* MonitorFfs::startMonitorFd(void* param) {
     MonitorFfs* monitorFfs = (MonitorFfs*)param;
-    char buf[kBufferSize];
-    bool writeUdc = true, stopMonitor = false;
+    char buf[kBufferSize] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool armed = false, writeUdc = true;
     struct epoll_event events[kEpollEvents];
+    // Pull up is due at pullUpAt, if pending.
+    bool pullUpPending = false;
+    steady_clock::time_point pullUpAt;
     steady_clock::time_point disconnect;
 
-    bool descriptorWritten = true;
-    for (int i = 0; i < static_cast<int>(monitorFfs->mEndpointList.size()); i++) {
-        if (access(monitorFfs->mEndpointList.at(i).c_str(), R_OK)) {
-            descriptorWritten = false;
-            break;
+    for (;;) {
+        int timeout = -1;
+        if (pullUpPending) {
+            timeout = std::max<long long>(
+                    0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                               pullUpAt - steady_clock::now())
+                               .count());
         }
-    }
 
-    // notify here if the endpoints are already present.
-    if (descriptorWritten) {
-        usleep(kPullUpDelay);
-        if (!!WriteStringToFile(monitorFfs->mGadgetName, PULLUP_PATH)) {
-            lock_guard<mutex> lock(monitorFfs->mLock);
-            monitorFfs->mCurrentUsbFunctionsApplied = true;
-            monitorFfs->mCallback(monitorFfs->mCurrentUsbFunctionsApplied, monitorFfs->mPayload);
-            gadgetPullup = true;
-            writeUdc = false;
-            ALOGI("GADGET pulled up");
-            monitorFfs->mCv.notify_all();
-        }
-    }
+        int nrEvents = epoll_wait(monitorFfs->mEpollFd, events, kEpollEvents, timeout);
 
-    while (!stopMonitor) {
-        int nrEvents = epoll_wait(monitorFfs->mEpollFd, events, kEpollEvents, -1);
-
-        if (nrEvents <= 0) {
-            ALOGE("epoll wait did not return descriptor number");
+        if (nrEvents < 0) {
+            if (errno != EINTR) ALOGE("epoll wait did not return descriptor number");
             continue;
         }
 
         for (int i = 0; i < nrEvents; i++) {
-            ALOGI("event=%u on fd=%d\n", events[i].events, events[i].data.fd);
+            if (kDebug) ALOGI("event=%u on fd=%d\n", events[i].events, events[i].data.fd);
 
             if (events[i].data.fd == monitorFfs->mInotifyFd) {
                 // Process all of the events in buffer returned by read().
                 int numRead = read(monitorFfs->mInotifyFd, buf, kBufferSize);
+                if (!armed) continue;
+
+                lock_guard<mutex> lock(monitorFfs->mLockFd);
                 for (char* p = buf; p < buf + numRead;) {
                     struct inotify_event* event = (struct inotify_event*)p;
                     if (kDebug) displayInotifyEvent(event);
 
                     p += sizeof(struct inotify_event) + event->len;
+                    monitorFfs->updateEndpoints(event);
+                }
+                continue;
+            }
 
-                    bool descriptorPresent = true;
-                    for (int j = 0; j < static_cast<int>(monitorFfs->mEndpointList.size()); j++) {
-                        if (access(monitorFfs->mEndpointList.at(j).c_str(), R_OK)) {
-                            if (kDebug) ALOGI("%s absent", monitorFfs->mEndpointList.at(j).c_str());
-                            descriptorPresent = false;
-                            break;
-                        }
-                    }
+            uint64_t wake;
+            read(monitorFfs->mEventFd, &wake, sizeof(wake));
+
+            std::unique_lock<std::mutex> lk(monitorFfs->mLock);
+            while (!monitorFfs->mCommands.empty()) {
+                Command command = monitorFfs->mCommands.front();
+                monitorFfs->mCommands.pop_front();
 
-                    if (!descriptorPresent && !writeUdc) {
-                        if (kDebug) ALOGI("endpoints not up");
+                switch (command) {
+                    case Command::ARM:
+                        ALOGI("mMonitor armed");
+                        armed = true;
                         writeUdc = true;
-                        disconnect = std::chrono::steady_clock::now();
-                    } else if (descriptorPresent && writeUdc) {
-                        steady_clock::time_point temp = steady_clock::now();
-
-                        if (std::chrono::duration_cast<microseconds>(temp - disconnect).count() <
-                            kPullUpDelay)
-                            usleep(kPullUpDelay);
-
-                        if (!!WriteStringToFile(monitorFfs->mGadgetName, PULLUP_PATH)) {
-                            lock_guard<mutex> lock(monitorFfs->mLock);
-                            monitorFfs->mCurrentUsbFunctionsApplied = true;
-                            monitorFfs->mCallback(monitorFfs->mCurrentUsbFunctionsApplied,
-                                                  monitorFfs->mPayload);
-                            ALOGI("GADGET pulled up");
-                            writeUdc = false;
-                            gadgetPullup = true;
-                            // notify the main thread to signal userspace.
-                            monitorFfs->mCv.notify_all();
+                        pullUpPending = false;
+                        monitorFfs->mPullUpTimes = {steady_clock::now(), {}, {}};
+                        // The gadget was pulled down until the UDC reported
+                        // the disconnect, no debounce needed.
+                        disconnect = steady_clock::now() - kPullUpDebounceMs * 1ms;
+                        lk.unlock();
+                        {
+                            lock_guard<mutex> lock(monitorFfs->mLockFd);
+                            monitorFfs->scanEndpoints("");
                         }
-                    }
-                }
-            } else {
-                uint64_t flag;
-                read(monitorFfs->mEventFd, &flag, sizeof(flag));
-                if (flag == 100) {
-                    stopMonitor = true;
-                    break;
+                        lk.lock();
+                        break;
+                    case Command::DISARM:
+                        ALOGI("mMonitor disarmed");
+                        armed = false;
+                        pullUpPending = false;
+                        break;
+                    case Command::SHUTDOWN:
+                        monitorFfs->mCommandsDone++;
+                        monitorFfs->mCommandCv.notify_all();
+                        return NULL;
                 }
+                monitorFfs->mCommandsDone++;
+                monitorFfs->mCommandCv.notify_all();
             }
         }
+
+        if (!armed) continue;
+
+        bool descriptorPresent;
+        {
+            lock_guard<mutex> lock(monitorFfs->mLockFd);
+            descriptorPresent = monitorFfs->endpointsReady();
+        }
+
+        ATRACE_INT("usb.ffs.endpoints_ready", descriptorPresent);
+        if (!descriptorPresent) {
+            pullUpPending = false;
+            if (!writeUdc) {
+                if (kDebug) ALOGI("endpoints not up");
+                writeUdc = true;
+                disconnect = steady_clock::now();
+            }
+        } else if (writeUdc && !pullUpPending) {
+            // Pull up as soon as the last endpoint appeared, unless still
+            // within the debounce.
+            pullUpPending = true;
+            pullUpAt = disconnect + kPullUpDebounceMs * 1ms;
+            lock_guard<mutex> lock(monitorFfs->mLock);
+            monitorFfs->mPullUpTimes.endpointsReady = steady_clock::now();
+        }
+
+        if (pullUpPending && steady_clock::now() >= pullUpAt) {
+            pullUpPending = false;
+            if (monitorFfs->pullUp()) writeUdc = false;
+        }
     }
-    return NULL;
 }
 
 void MonitorFfs::reset() {
-    lock_guard<mutex> lock(mLockFd);
-    uint64_t flag = 100;
-    unsigned long ret;
-
     if (mMonitorRunning) {
-        // Stop the monitor thread by writing into signal fd.
-        ret = TEMP_FAILURE_RETRY(write(mEventFd, &flag, sizeof(flag)));
-        if (ret < 0) ALOGE("Error writing eventfd errno=%d", errno);
-
-        ALOGI("mMonitor signalled to exit");
-        mMonitor->join();
-        ALOGI("mMonitor destroyed");
+        sendCommand(Command::DISARM);
         mMonitorRunning = false;
     }
 
-    for (std::vector<int>::size_type i = 0; i != mWatchFd.size(); i++)
-        inotify_rm_watch(mInotifyFd, mWatchFd[i]);
+    {
+        lock_guard<mutex> lock(mLockFd);
+        for (std::vector<int>::size_type i = 0; i != mWatchFd.size(); i++)
+            inotify_rm_watch(mInotifyFd, mWatchFd[i]);
+        mWatchFd.clear();
+        mWatchPath.clear();
+
+        mEndpointList.clear();
+        mEndpointPresent.reset();
+    }
 
-    mEndpointList.clear();
-    gadgetPullup = false;
+    lock_guard<mutex> lock(mLock);
+    mPullUp = false;
     mCallback = NULL;
     mPayload = NULL;
 }
 
 bool MonitorFfs::startMonitor() {
-    mMonitor = unique_ptr<thread>(new thread(this->startMonitorFd, this));
+    if (!mMonitor) mMonitor = unique_ptr<thread>(new thread(this->startMonitorFd, this));
+
+    {
+        lock_guard<mutex> lock(mLock);
+        mPullUp = false;
+        mWaitAborted = false;
+    }
+    sendCommand(Command::ARM);
     mMonitorRunning = true;
     return true;
 }
@@ -226,11 +336,11 @@ bool MonitorFfs::isMonitorRunning() {
 bool MonitorFfs::waitForPullUp(int timeout_ms) {
     std::unique_lock<std::mutex> lk(mLock);
 
-    if (gadgetPullup) return true;
+    if (mPullUp) return true;
 
-    if (mCv.wait_for(lk, timeout_ms * 1ms, [] { return gadgetPullup; })) {
-        ALOGI("monitorFfs signalled true");
-        return true;
+    if (mCv.wait_for(lk, timeout_ms * 1ms, [this] { return mPullUp || mWaitAborted; })) {
+        ALOGI("monitorFfs signalled %s", mPullUp ? "true" : "abort");
+        return mPullUp;
     } else {
         ALOGI("monitorFfs signalled error");
         // continue monitoring as the descriptors might be written at a later
@@ -239,6 +349,17 @@ bool MonitorFfs::waitForPullUp(int timeout_ms) {
     }
 }
 
+void MonitorFfs::abortWaitForPullUp() {
+    lock_guard<mutex> lock(mLock);
+    mWaitAborted = true;
+    mCv.notify_all();
+}
+
+MonitorFfs::PullUpTimes MonitorFfs::getPullUpTimes() {
+    lock_guard<mutex> lock(mLock);
+    return mPullUpTimes;
+}
+
 bool MonitorFfs::addInotifyFd(string fd) {
     lock_guard<mutex> lock(mLockFd);
     int wfd;
@@ -246,8 +367,9 @@ bool MonitorFfs::addInotifyFd(string fd) {
     wfd = inotify_add_watch(mInotifyFd, fd.c_str(), IN_ALL_EVENTS);
     if (wfd == -1)
         return false;
-    else
-        mWatchFd.push_back(wfd);
+
+    mWatchFd.push_back(wfd);
+    mWatchPath.push_back(fd);
 
     return true;
 }
@@ -255,12 +377,17 @@ bool MonitorFfs::addInotifyFd(string fd) {
 void MonitorFfs::addEndPoint(string ep) {
     lock_guard<mutex> lock(mLockFd);
 
+    if (mEndpointList.size() == kMaxEndpoints) {
+        ALOGE("Too many endpoints, not monitoring %s", ep.c_str());
+        return;
+    }
     mEndpointList.push_back(ep);
 }
 
 void MonitorFfs::registerFunctionsAppliedCallback(void (*callback)(bool functionsApplied,
                                                                    void* payload),
                                                   void* payload) {
+    lock_guard<mutex> lock(mLock);
     mCallback = callback;
     mPayload = payload;
 }
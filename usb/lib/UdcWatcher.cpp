@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "libusbconfigfs"
+
+#include "include/UsbGadgetCommon.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+constexpr uint64_t kShutdownWatch = 1;
+// An unbound UDC keeps its state node signalled, retry at this pace instead.
+constexpr int kReopenIntervalMs = 1000;
+
+UdcWatcher::UdcWatcher(const char* const udc)
+    : mUdc(udc), mLock(), mListener(NULL), mPayload(NULL), mWatch() {}
+
+UdcWatcher::~UdcWatcher() {
+    uint64_t flag = kShutdownWatch;
+
+    if (!mWatch) return;
+
+    if (TEMP_FAILURE_RETRY(write(mEventFd, &flag, sizeof(flag))) < 0)
+        ALOGE("Error writing eventfd errno=%d", errno);
+    mWatch->join();
+}
+
+static bool readAttribute(int fd, string* value) {
+    char buf[32];
+    ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf) - 1, 0));
+
+    if (len < 0) {
+        *value = "";
+        return false;
+    }
+    buf[len] = '\0';
+    *value = ::android::base::Trim(buf);
+    return true;
+}
+
+bool UdcWatcher::refresh(bool* lost) {
+    string state;
+    string speed;
+
+    if (!readAttribute(mStateFd, &state) && lost) *lost = true;
+
+    if (!::android::base::ReadFileToString(udcPath(mUdc, "current_speed"), &speed))
+        speed = "UNKNOWN";
+    speed = ::android::base::Trim(speed);
+
+    lock_guard<mutex> lock(mLock);
+    if (state == mState && speed == mSpeed) return false;
+    mState = state;
+    mSpeed = speed;
+    return true;
+}
+
+bool UdcWatcher::start() {
+    if (mWatch) return true;
+
+    string path = udcPath(mUdc, "state");
+    unique_fd stateFd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (stateFd < 0) {
+        ALOGE("Cannot open %s errno:%d", path.c_str(), errno);
+        return false;
+    }
+
+    unique_fd eventFd(eventfd(0, EFD_CLOEXEC));
+    if (eventFd < 0) {
+        ALOGE("mEventFd failed to create %d", errno);
+        return false;
+    }
+
+    mStateFd = std::move(stateFd);
+    mEventFd = std::move(eventFd);
+    refresh();
+    mWatch = unique_ptr<thread>(new thread(this->watch, this));
+    return true;
+}
+
+bool UdcWatcher::isRunning() {
+    return mWatch != nullptr;
+}
+
+void UdcWatcher::registerListener(void (*listener)(const string& state, const string& speed,
+                                                   void* payload),
+                                  void* payload) {
+    lock_guard<mutex> lock(mLock);
+    mListener = listener;
+    mPayload = payload;
+}
+
+string UdcWatcher::state() {
+    lock_guard<mutex> lock(mLock);
+    return mState;
+}
+
+string UdcWatcher::speed() {
+    lock_guard<mutex> lock(mLock);
+    return mSpeed;
+}
+
+bool UdcWatcher::reopen(struct pollfd* stateFd) {
+    string path = udcPath(mUdc, "state");
+    struct pollfd shutdown = {mEventFd, POLLIN, 0};
+
+    ALOGW("Cannot read %s, retrying every %d ms", path.c_str(), kReopenIntervalMs);
+    for (;;) {
+        int ret = TEMP_FAILURE_RETRY(poll(&shutdown, 1, kReopenIntervalMs));
+        if (ret < 0) {
+            ALOGE("poll on UDC shutdown failed errno:%d", errno);
+            return false;
+        }
+        if (shutdown.revents & POLLIN) return false;
+
+        unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+        string state;
+        if (fd < 0 || !readAttribute(fd, &state)) continue;
+
+        ALOGI("UDC %s is back", mUdc);
+        mStateFd = std::move(fd);
+        stateFd->fd = mStateFd;
+        return true;
+    }
+}
+
+void* UdcWatcher::watch(void* param) {
+    UdcWatcher* udcWatcher = (UdcWatcher*)param;
+    struct pollfd fds[2] = {{udcWatcher->mStateFd, POLLPRI | POLLERR, 0},
+                            {udcWatcher->mEventFd, POLLIN, 0}};
+
+    for (;;) {
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0) {
+            ALOGE("poll on UDC state failed errno:%d", errno);
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN) return NULL;
+        if (!(fds[0].revents & (POLLPRI | POLLERR))) continue;
+
+        // Report the lost state once, then wait for the UDC to come back
+        // instead of spinning on the node, which stays signalled.
+        bool lost = false;
+        bool changed = udcWatcher->refresh(&lost);
+        if (lost && !changed) {
+            if (!udcWatcher->reopen(&fds[0])) return NULL;
+            changed = udcWatcher->refresh();
+        }
+        if (!changed) continue;
+
+        void (*listener)(const string& state, const string& speed, void* payload);
+        void* payload;
+        string state, speed;
+        {
+            lock_guard<mutex> lock(udcWatcher->mLock);
+            listener = udcWatcher->mListener;
+            payload = udcWatcher->mPayload;
+            state = udcWatcher->mState;
+            speed = udcWatcher->mSpeed;
+        }
+
+        ALOGI("UDC %s %s", state.c_str(), speed.c_str());
+        if (listener) listener(state, speed, payload);
+    }
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
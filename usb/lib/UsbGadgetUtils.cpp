@@ -25,7 +25,90 @@ namespace hardware {
 namespace usb {
 namespace gadget {
 
-int unlinkFunctions(const char* path) {
+constexpr bool functionTableValid() {
+    int endpoints = 0;
+
+    if (kFunctionCount > 8) return false;
+    for (size_t i = 0; i < kFunctionCount; i++) {
+        const FunctionDesc& desc = kFunctions[i];
+
+        // One GadgetFunction bit each, listed once.
+        if (desc.function <= 0 || (desc.function & (desc.function - 1)) != 0) return false;
+        for (size_t j = 0; j < i; j++) {
+            if (kFunctions[j].function == desc.function) return false;
+        }
+
+        if (desc.configfsName == nullptr) return false;
+        if ((desc.ffsName != nullptr) != (desc.ffsEndpoints > 0)) return false;
+        endpoints += desc.ffsEndpoints;
+
+        // Exclusions go both ways.
+        if ((desc.excludes & desc.function) != 0) return false;
+        for (const FunctionDesc& other : kFunctions) {
+            if (((desc.excludes & other.function) != 0) != ((other.excludes & desc.function) != 0))
+                return false;
+        }
+    }
+    return endpoints <= kMaxEndpoints;
+}
+
+constexpr bool productIdsValid() {
+    for (size_t i = 0; i < sizeof(kProductIds) / sizeof(kProductIds[0]); i++) {
+        const ProductId& known = kProductIds[i];
+
+        if (!isSupportedComposition(known.functions)) return false;
+        if ((known.productId & ~0xff) == kCompositeProductId ||
+            (known.productId & ~0xff) == kBulkProductId)
+            return false;
+        for (size_t j = 0; j < i; j++) {
+            if (kProductIds[j].functions == known.functions ||
+                kProductIds[j].productId == known.productId)
+                return false;
+        }
+    }
+    return true;
+}
+
+static_assert(functionTableValid(), "kFunctions is inconsistent");
+static_assert(productIdsValid(), "kProductIds is inconsistent");
+static_assert(productIdFor(GadgetFunction::ADB | GadgetFunction::NCM | GadgetFunction::MIDI) > 0,
+              "NCM and MIDI with ADB must be supported");
+static_assert(productIdFor(GadgetFunction::ADB, true) != productIdFor(GadgetFunction::ADB),
+              "Bulk compositions need their own product IDs");
+static_assert(productIdFor(GadgetFunction::MTP | GadgetFunction::PTP) < 0,
+              "MTP and PTP share the gadget's FFS slot");
+
+static string gadgetRoot = kGadgetRoot;
+static string ffsRoot = kFfsRoot;
+static string udcClassRoot = kUdcClassRoot;
+static string netClassRoot = kNetClassRoot;
+static UdcStateNotifier* udcStateNotifier = nullptr;
+
+void setGadgetRoots(const string& gadget, const string& ffs, const string& udcClass,
+                    const string& netClass) {
+    gadgetRoot = gadget;
+    ffsRoot = ffs;
+    udcClassRoot = udcClass;
+    netClassRoot = netClass;
+}
+
+void setUdcStateNotifier(UdcStateNotifier* notifier) {
+    udcStateNotifier = notifier;
+}
+
+string gadgetPath(const char* leaf) {
+    return gadgetRoot + leaf;
+}
+
+string ffsPath(const char* leaf) {
+    return ffsRoot + leaf;
+}
+
+string udcPath(const char* udc, const char* attribute) {
+    return udcClassRoot + udc + "/" + attribute;
+}
+
+int unlinkFunctions(const char* path, int first) {
     DIR* config = opendir(path);
     struct dirent* function;
     char filepath[kMaxFilePathLength];
@@ -37,6 +120,7 @@ int unlinkFunctions(const char* path) {
     // so filtering by name.
     while (((function = readdir(config)) != NULL)) {
         if ((strstr(function->d_name, FUNCTION_NAME) == NULL)) continue;
+        if (atoi(function->d_name + strlen(FUNCTION_NAME)) < first) continue;
         // build the path for each file in the folder.
         sprintf(filepath, "%s/%s", path, function->d_name);
         ret = remove(filepath);
@@ -66,9 +150,22 @@ int addEpollFd(const unique_fd& epfd, const unique_fd& fd) {
 int linkFunction(const char* function, int index) {
     char functionPath[kMaxFilePathLength];
     char link[kMaxFilePathLength];
+    char target[kMaxFilePathLength];
+
+    snprintf(functionPath, sizeof(functionPath), "%s%s", gadgetPath(kFunctionsDir).c_str(),
+             function);
+    snprintf(link, sizeof(link), "%s%s%d", gadgetPath(kConfigDir).c_str(), FUNCTION_NAME, index);
+
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len >= 0) {
+        target[len] = '\0';
+        const char* name = strrchr(target, '/');
+        if (strcmp(name ? name + 1 : target, function) == 0) return 0;
+    }
+
+    // configfs orders the functions by link creation, redo the rest.
+    if (unlinkFunctions(gadgetPath(kConfigDir).c_str(), index)) return -1;
 
-    sprintf(functionPath, "%s%s", FUNCTIONS_PATH, function);
-    sprintf(link, "%s%d", FUNCTION_PATH, index);
     if (symlink(functionPath, link)) {
         ALOGE("Cannot create symlink %s -> %s errno:%d", link, functionPath, errno);
         return -1;
@@ -76,10 +173,78 @@ int linkFunction(const char* function, int index) {
     return 0;
 }
 
+// configfs reads numbers back in its own format, e.g. bDeviceClass as 0x00.
+static bool sameValue(const string& current, const string& value) {
+    if (current == value) return true;
+
+    char* currentEnd;
+    char* valueEnd;
+    unsigned long currentNumber = strtoul(current.c_str(), &currentEnd, 0);
+    unsigned long valueNumber = strtoul(value.c_str(), &valueEnd, 0);
+    return !current.empty() && !value.empty() && *currentEnd == '\0' &&
+           *valueEnd == '\0' && currentNumber == valueNumber;
+}
+
+bool writeIfChanged(const string& value, const string& path) {
+    string current;
+
+    if (::android::base::ReadFileToString(path, &current) &&
+        sameValue(::android::base::Trim(current), value))
+        return true;
+
+    return WriteStringToFile(value, path);
+}
+
+// The UDC notifies its state attribute on every change, so poll() wakes up
+// as soon as it moves.
+bool waitForUdcState(const char* udc, const char* state, int timeoutMs) {
+    string path = udcPath(udc, "state");
+    char buf[32];
+
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd < 0) {
+        ALOGE("Cannot open %s errno:%d", path.c_str(), errno);
+        return false;
+    }
+
+    steady_clock::time_point deadline = steady_clock::now() + timeoutMs * 1ms;
+    for (;;) {
+        // Taken before the read, a change right after it is not missed.
+        uint64_t generation = udcStateNotifier ? udcStateNotifier->generation() : 0;
+        ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf) - 1, 0));
+        if (len < 0) {
+            ALOGE("Cannot read %s errno:%d", path.c_str(), errno);
+            return false;
+        }
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' ')) len--;
+        buf[len] = '\0';
+        if (strcmp(buf, state) == 0) return true;
+
+        int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                deadline - steady_clock::now())
+                                .count();
+        if (remaining <= 0) {
+            ALOGI("UDC still %s after %d ms", buf, timeoutMs);
+            return false;
+        }
+
+        if (udcStateNotifier) {
+            udcStateNotifier->waitForChange(generation, remaining);
+            continue;
+        }
+
+        struct pollfd pfd = {fd, POLLPRI | POLLERR, 0};
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, remaining)) < 0) {
+            ALOGE("poll on %s failed errno:%d", path.c_str(), errno);
+            return false;
+        }
+    }
+}
+
 Status setVidPid(const char* vid, const char* pid) {
-    if (!WriteStringToFile(vid, VENDOR_ID_PATH)) return Status::ERROR;
+    if (!writeIfChanged(vid, gadgetPath(kVendorIdFile))) return Status::ERROR;
 
-    if (!WriteStringToFile(pid, PRODUCT_ID_PATH)) return Status::ERROR;
+    if (!writeIfChanged(pid, gadgetPath(kProductIdFile))) return Status::ERROR;
 
     return Status::SUCCESS;
 }
@@ -107,100 +272,179 @@ std::string getVendorFunctions() {
     return ret;
 }
 
+Status pullDownGadget(const char* udc) {
+    string current;
+
+    // Reads back empty when no UDC is bound.
+    if (::android::base::ReadFileToString(gadgetPath(kPullUpFile), &current) &&
+        ::android::base::Trim(current).empty())
+        return Status::SUCCESS;
+
+    if (!WriteStringToFile("none", gadgetPath(kPullUpFile))) {
+        ALOGI("Gadget cannot be pulled down");
+        return Status::ERROR;
+    }
+
+    // Give the host time to sense the disconnect, which is over once the
+    // UDC stopped signalling on the bus.
+    waitForUdcState(udc, "not attached", kDisconnectWaitUs / 1000);
+    return Status::SUCCESS;
+}
+
 Status resetGadget() {
     ALOGI("setCurrentUsbFunctions None");
 
-    if (!WriteStringToFile("none", PULLUP_PATH)) ALOGI("Gadget cannot be pulled down");
+    if (!WriteStringToFile("none", gadgetPath(kPullUpFile))) ALOGI("Gadget cannot be pulled down");
 
-    if (!WriteStringToFile("0", DEVICE_CLASS_PATH)) return Status::ERROR;
+    if (!writeIfChanged("0", gadgetPath(kDeviceClassFile))) return Status::ERROR;
 
-    if (!WriteStringToFile("0", DEVICE_SUB_CLASS_PATH)) return Status::ERROR;
+    if (!writeIfChanged("0", gadgetPath(kDeviceSubClassFile))) return Status::ERROR;
 
-    if (!WriteStringToFile("0", DEVICE_PROTOCOL_PATH)) return Status::ERROR;
+    if (!writeIfChanged("0", gadgetPath(kDeviceProtocolFile))) return Status::ERROR;
 
-    if (!WriteStringToFile("0", DESC_USE_PATH)) return Status::ERROR;
+    if (!writeIfChanged("0", gadgetPath(kDescUseFile))) return Status::ERROR;
 
-    if (unlinkFunctions(CONFIG_PATH)) return Status::ERROR;
+    if (unlinkFunctions(gadgetPath(kConfigDir).c_str())) return Status::ERROR;
 
     return Status::SUCCESS;
 }
 
-Status addGenericAndroidFunctions(MonitorFfs* monitorFfs, uint64_t functions, bool* ffsEnabled,
-                                  int* functionCount) {
-    if (((functions & GadgetFunction::MTP) != 0)) {
-        *ffsEnabled = true;
-        ALOGI("setCurrentUsbFunctions mtp");
-        if (!WriteStringToFile("1", DESC_USE_PATH)) return Status::ERROR;
+string functionName(const FunctionDesc& desc) {
+    if (desc.function == GadgetFunction::RNDIS) {
+        string rndisFunction = GetProperty(kVendorRndisConfig, "");
+        // gsi.rndis is left for older pixel projects
+        if (rndisFunction != "") return rndisFunction;
+    }
+    return desc.configfsName;
+}
 
-        if (!monitorFfs->addInotifyFd("/dev/usb-ffs/mtp/")) return Status::ERROR;
+// Locally administered addresses derived from the serial number, so that the
+// host sees the same interface after every mode switch instead of a new one.
+static string etherAddress(const string& serial, const char* tag, uint8_t role) {
+    uint64_t hash = 14695981039346656037ull;
+    char address[18];
+
+    for (char c : serial + tag) hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    snprintf(address, sizeof(address), "%02x:%02x:%02x:%02x:%02x:%02x", 0x02 | (role << 2),
+             (uint8_t)(hash >> 32), (uint8_t)(hash >> 24), (uint8_t)(hash >> 16),
+             (uint8_t)(hash >> 8), (uint8_t)hash);
+    return address;
+}
 
-        if (linkFunction("ffs.mtp", (*functionCount)++)) return Status::ERROR;
+static void writeEtherAttribute(const string& dir, const char* attribute, const string& value) {
+    string path = dir + attribute;
 
-        // Add endpoints to be monitored.
-        monitorFfs->addEndPoint("/dev/usb-ffs/mtp/ep1");
-        monitorFfs->addEndPoint("/dev/usb-ffs/mtp/ep2");
-        monitorFfs->addEndPoint("/dev/usb-ffs/mtp/ep3");
-    } else if (((functions & GadgetFunction::PTP) != 0)) {
-        *ffsEnabled = true;
-        ALOGI("setCurrentUsbFunctions ptp");
-        if (!WriteStringToFile("1", DESC_USE_PATH)) return Status::ERROR;
+    if (access(path.c_str(), F_OK) != 0) return;
+    // The attributes are read only while the function is linked.
+    if (!writeIfChanged(value, path)) ALOGE("Cannot set %s errno:%d", path.c_str(), errno);
+}
 
-        if (!monitorFfs->addInotifyFd("/dev/usb-ffs/ptp/")) return Status::ERROR;
+void applyEtherProfile(const FunctionDesc& desc) {
+    for (const EtherProfile& profile : kEtherProfiles) {
+        if (profile.function != desc.function) continue;
+
+        string dir = gadgetPath(kFunctionsDir) + functionName(desc) + "/";
+        string prefix = string("vendor.usb.") + profile.tag + ".";
+        int qmult = ::android::base::GetIntProperty(prefix + "qmult", profile.qmult);
+        int maxSegmentSize =
+                ::android::base::GetIntProperty(prefix + "max_segment_size", profile.maxSegmentSize);
+        string serial = GetProperty("ro.serialno", "");
+
+        if (qmult > 0) writeEtherAttribute(dir, "qmult", std::to_string(qmult));
+        if (maxSegmentSize > 0)
+            writeEtherAttribute(dir, "max_segment_size", std::to_string(maxSegmentSize));
+        if (serial != "") {
+            writeEtherAttribute(dir, "dev_addr", etherAddress(serial, profile.tag, 0));
+            writeEtherAttribute(dir, "host_addr", etherAddress(serial, profile.tag, 1));
+        }
+    }
+}
 
-        if (linkFunction("ffs.ptp", (*functionCount)++)) return Status::ERROR;
+static bool readCounter(const string& dir, const char* name, uint64_t* value) {
+    string counter;
 
-        // Add endpoints to be monitored.
-        monitorFfs->addEndPoint("/dev/usb-ffs/ptp/ep1");
-        monitorFfs->addEndPoint("/dev/usb-ffs/ptp/ep2");
-        monitorFfs->addEndPoint("/dev/usb-ffs/ptp/ep3");
-    }
+    if (!::android::base::ReadFileToString(dir + name, &counter)) return false;
+    *value = strtoull(counter.c_str(), NULL, 10);
+    return true;
+}
 
-    if ((functions & GadgetFunction::MIDI) != 0) {
-        ALOGI("setCurrentUsbFunctions MIDI");
-        if (linkFunction("midi.gs5", (*functionCount)++)) return Status::ERROR;
-    }
+bool readEtherStats(const FunctionDesc& desc, EtherStats* stats) {
+    string ifname;
+
+    if (!::android::base::ReadFileToString(
+                gadgetPath(kFunctionsDir) + functionName(desc) + "/ifname", &ifname))
+        return false;
+    stats->ifname = ::android::base::Trim(ifname);
+
+    string dir = netClassRoot + stats->ifname + "/statistics/";
+    stats->sampled = steady_clock::now();
+    return readCounter(dir, "rx_bytes", &stats->rxBytes) &&
+           readCounter(dir, "tx_bytes", &stats->txBytes) &&
+           readCounter(dir, "rx_packets", &stats->rxPackets) &&
+           readCounter(dir, "tx_packets", &stats->txPackets) &&
+           readCounter(dir, "rx_dropped", &stats->rxDropped) &&
+           readCounter(dir, "tx_dropped", &stats->txDropped);
+}
 
-    if ((functions & GadgetFunction::ACCESSORY) != 0) {
-        ALOGI("setCurrentUsbFunctions Accessory");
-        if (linkFunction("accessory.gs2", (*functionCount)++)) return Status::ERROR;
-    }
+bool ffsEndpointsPresent(const FunctionDesc& desc) {
+    if (desc.ffsName == nullptr) return false;
 
-    if ((functions & GadgetFunction::AUDIO_SOURCE) != 0) {
-        ALOGI("setCurrentUsbFunctions Audio Source");
-        if (linkFunction("audio_source.gs3", (*functionCount)++)) return Status::ERROR;
+    for (int ep = 1; ep <= desc.ffsEndpoints; ep++) {
+        string path = ffsPath(desc.ffsName) + "/ep" + std::to_string(ep);
+        if (access(path.c_str(), F_OK) != 0) return false;
     }
+    return true;
+}
 
-    if ((functions & GadgetFunction::RNDIS) != 0) {
-        ALOGI("setCurrentUsbFunctions rndis");
-        std::string rndisFunction = GetProperty(kVendorRndisConfig, "");
-        if (rndisFunction != "") {
-            if (linkFunction(rndisFunction.c_str(), (*functionCount)++)) return Status::ERROR;
-        } else {
-            // link gsi.rndis for older pixel projects
-            if (linkFunction("gsi.rndis", (*functionCount)++)) return Status::ERROR;
-        }
+Status addFunction(MonitorFfs* monitorFfs, const FunctionDesc& desc, int* functionCount) {
+    string name = functionName(desc);
+
+    ALOGI("setCurrentUsbFunctions %s", name.c_str());
+
+    if (desc.ffsName != nullptr) {
+        string ffsDir = ffsPath(desc.ffsName) + "/";
+
+        if (!writeIfChanged("1", gadgetPath(kDescUseFile))) return Status::ERROR;
+
+        if (!monitorFfs->addInotifyFd(ffsDir)) return Status::ERROR;
+
+        if (linkFunction(name.c_str(), (*functionCount)++)) return Status::ERROR;
+
+        // Add endpoints to be monitored.
+        for (int ep = 1; ep <= desc.ffsEndpoints; ep++)
+            monitorFfs->addEndPoint(ffsDir + "ep" + std::to_string(ep));
+        return Status::SUCCESS;
     }
 
-    if ((functions & GadgetFunction::NCM) != 0) {
-        ALOGI("setCurrentUsbFunctions ncm");
-        if (linkFunction("ncm.gs6", (*functionCount)++)) return Status::ERROR;
+    applyEtherProfile(desc);
+    if (linkFunction(name.c_str(), (*functionCount)++)) return Status::ERROR;
+    return Status::SUCCESS;
+}
+
+Status addGenericAndroidFunctions(MonitorFfs* monitorFfs, uint64_t functions, bool* ffsEnabled,
+                                  int* functionCount) {
+    for (const FunctionDesc& desc : kFunctions) {
+        if (desc.function == GadgetFunction::ADB || (functions & desc.function) == 0) continue;
+
+        if (desc.ffsName != nullptr) *ffsEnabled = true;
+        if (addFunction(monitorFfs, desc, functionCount) != Status::SUCCESS)
+            return Status::ERROR;
     }
 
     return Status::SUCCESS;
 }
 
 Status addAdb(MonitorFfs* monitorFfs, int* functionCount) {
-    ALOGI("setCurrentUsbFunctions Adb");
-    if (!WriteStringToFile("1", DESC_USE_PATH))
-        return Status::ERROR;
+    for (const FunctionDesc& desc : kFunctions) {
+        if (desc.function != GadgetFunction::ADB) continue;
 
-    if (!monitorFfs->addInotifyFd("/dev/usb-ffs/adb/")) return Status::ERROR;
+        if (addFunction(monitorFfs, desc, functionCount) != Status::SUCCESS)
+            return Status::ERROR;
+        ALOGI("Service started");
+        return Status::SUCCESS;
+    }
 
-    if (linkFunction("ffs.adb", (*functionCount)++)) return Status::ERROR;
-    monitorFfs->addEndPoint("/dev/usb-ffs/adb/ep1");
-    monitorFfs->addEndPoint("/dev/usb-ffs/adb/ep2");
-    ALOGI("Service started");
-    return Status::SUCCESS;
+    return Status::ERROR;
 }
 
 }  // namespace gadget
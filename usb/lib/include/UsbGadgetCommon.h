@@ -20,6 +20,7 @@
 
 #include <android-base/file.h>
 #include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
 #include <aidl/android/hardware/usb/gadget/IUsbGadget.h>
@@ -27,6 +28,7 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
@@ -36,8 +38,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <utils/Log.h>
+#include <atomic>
+#include <bitset>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -53,29 +60,37 @@ constexpr int kMaxFilePathLength = 256;
 constexpr int kEpollEvents = 10;
 constexpr bool kDebug = false;
 constexpr int kDisconnectWaitUs = 100000;
-constexpr int kPullUpDelay = 500000;
-constexpr int kShutdownMonitor = 100;
+// Minimum time between the endpoints going away and the next pull up, on
+// top of the UDC reporting the disconnect. 0 pulls up right away.
+constexpr int kPullUpDebounceMs = 0;
+constexpr int kMaxEndpoints = 32;
 
 constexpr char kBuildType[] = "ro.build.type";
 constexpr char kPersistentVendorConfig[] = "persist.vendor.usb.usbradio.config";
 constexpr char kVendorConfig[] = "vendor.usb.config";
 constexpr char kVendorRndisConfig[] = "vendor.usb.rndis.config";
 
-#define GADGET_PATH "/config/usb_gadget/g1/"
-#define PULLUP_PATH GADGET_PATH "UDC"
 #define PERSISTENT_BOOT_MODE "ro.bootmode"
-#define VENDOR_ID_PATH GADGET_PATH "idVendor"
-#define PRODUCT_ID_PATH GADGET_PATH "idProduct"
-#define DEVICE_CLASS_PATH GADGET_PATH "bDeviceClass"
-#define DEVICE_SUB_CLASS_PATH GADGET_PATH "bDeviceSubClass"
-#define DEVICE_PROTOCOL_PATH GADGET_PATH "bDeviceProtocol"
-#define DESC_USE_PATH GADGET_PATH "os_desc/use"
-#define OS_DESC_PATH GADGET_PATH "os_desc/b.1"
-#define CONFIG_PATH GADGET_PATH "configs/b.1/"
-#define FUNCTIONS_PATH GADGET_PATH "functions/"
 #define FUNCTION_NAME "function"
-#define FUNCTION_PATH CONFIG_PATH FUNCTION_NAME
-#define RNDIS_PATH FUNCTIONS_PATH "gsi.rndis"
+
+// Default roots of the gadget, the FunctionFS mounts and the UDC class
+// directory, see setGadgetRoots().
+constexpr char kGadgetRoot[] = "/config/usb_gadget/g1/";
+constexpr char kFfsRoot[] = "/dev/usb-ffs/";
+constexpr char kUdcClassRoot[] = "/sys/class/udc/";
+constexpr char kNetClassRoot[] = "/sys/class/net/";
+
+// Files and directories below the gadget root.
+constexpr char kPullUpFile[] = "UDC";
+constexpr char kVendorIdFile[] = "idVendor";
+constexpr char kProductIdFile[] = "idProduct";
+constexpr char kDeviceClassFile[] = "bDeviceClass";
+constexpr char kDeviceSubClassFile[] = "bDeviceSubClass";
+constexpr char kDeviceProtocolFile[] = "bDeviceProtocol";
+constexpr char kDescUseFile[] = "os_desc/use";
+constexpr char kOsDescDir[] = "os_desc/b.1";
+constexpr char kConfigDir[] = "configs/b.1/";
+constexpr char kFunctionsDir[] = "functions/";
 
 using ::android::base::GetProperty;
 using ::android::base::SetProperty;
@@ -98,28 +113,58 @@ using ::std::literals::chrono_literals::operator""ms;
 // MonitorFfs automously manages gadget pullup by monitoring
 // the ep file status. Restarts the usb gadget when the ep
 // owner restarts.
+//
+// One worker thread lives as long as the MonitorFfs and is driven through
+// a command queue: startMonitor() arms it, reset() disarms it and the
+// destructor shuts it down. The endpoint and watch lists are written under
+// mLockFd by the caller while disarmed, and read under mLockFd by the
+// worker. Lock order is mLockFd, then mLock.
 class MonitorFfs {
+  public:
+    // When the monitor was last armed, saw all of its endpoints and pulled
+    // up the gadget. The later two are left empty until reached after arming.
+    struct PullUpTimes {
+        steady_clock::time_point armed;
+        steady_clock::time_point endpointsReady;
+        steady_clock::time_point pulledUp;
+    };
+
   private:
+    enum class Command { ARM, DISARM, SHUTDOWN };
+
     // Monitors the endpoints Inotify events.
     unique_fd mInotifyFd;
-    // Control pipe for shutting down the mMonitor thread.
-    // mMonitor exits when SHUTDOWN_MONITOR is written into
-    // mEventFd/
+    // Wakes up mMonitor when a command is queued.
     unique_fd mEventFd;
     // Pools on mInotifyFd and mEventFd.
     unique_fd mEpollFd;
     vector<int> mWatchFd;
+    // Directory of each entry in mWatchFd.
+    vector<string> mWatchPath;
 
     // Maintains the list of Endpoints.
     vector<string> mEndpointList;
-    // protects the CV.
+    // Which of mEndpointList exist, kept up to date from the inotify events.
+    std::bitset<kMaxEndpoints> mEndpointPresent;
+    // protects the CV, the command queue and the callback.
     std::mutex mLock;
     std::condition_variable mCv;
-    // protects mInotifyFd, mEpollFd.
+    // protects the watch and endpoint lists.
     std::mutex mLockFd;
 
+    // Commands for mMonitor, and how many were queued and carried out.
+    std::deque<Command> mCommands;
+    uint64_t mCommandsQueued;
+    uint64_t mCommandsDone;
+    std::condition_variable mCommandCv;
+
     // Flag to maintain the current status of gadget pullup.
     bool mCurrentUsbFunctionsApplied;
+    std::atomic<bool> mPullUp;
+    // Set by abortWaitForPullUp() until the next startMonitor().
+    bool mWaitAborted;
+    // protected by mLock.
+    PullUpTimes mPullUpTimes;
 
     // Thread object that executes the ep monitoring logic.
     unique_ptr<thread> mMonitor;
@@ -129,11 +174,22 @@ class MonitorFfs {
     // Name of the USB gadget. Used for pullup.
     const char* const mGadgetName;
     // Monitor State
-    bool mMonitorRunning;
+    std::atomic<bool> mMonitorRunning;
+
+    // Queues a command and waits until mMonitor carried it out.
+    void sendCommand(Command command);
+    // Rechecks the endpoints under dir, or all of them if dir is empty.
+    void scanEndpoints(const string& dir);
+    // Applies one inotify event to mEndpointPresent.
+    void updateEndpoints(const struct inotify_event* event);
+    bool endpointsReady();
+    // Pulls up the gadget once the UDC reports the last disconnect.
+    bool pullUp();
 
   public:
     MonitorFfs(const char* const gadget);
-    // Inits all the UniqueFds.
+    ~MonitorFfs();
+    // Stops monitoring and clears the watch and endpoint lists.
     void reset();
     // Starts monitoring endpoints and pullup the gadget when
     // the descriptors are written.
@@ -141,6 +197,10 @@ class MonitorFfs {
     // Waits for timeout_ms for gadget pull up to happen.
     // Returns immediately if the gadget is already pulled up.
     bool waitForPullUp(int timeout_ms);
+    // Makes waitForPullUp() return false right away, until the next
+    // startMonitor(). Monitoring itself goes on.
+    void abortWaitForPullUp();
+    PullUpTimes getPullUpTimes();
     // Adds the given fd to the watch list.
     bool addInotifyFd(string fd);
     // Adds the given endpoint to the watch list.
@@ -154,24 +214,253 @@ class MonitorFfs {
     static void* startMonitorFd(void* param);
 };
 
+// UdcWatcher keeps the state and current_speed of a UDC in memory. The UDC
+// core notifies its state attribute on every change, and current_speed
+// only changes along with it, so a single poll() on state covers both.
+// Listeners run on the watch thread.
+class UdcWatcher {
+  private:
+    // Name of the UDC, e.g. fe980000.usb.
+    const char* const mUdc;
+    unique_fd mStateFd;
+    // Wakes up mWatch for shutdown.
+    unique_fd mEventFd;
+    // protects the cached values and the listener.
+    std::mutex mLock;
+    string mState;
+    string mSpeed;
+    void (*mListener)(const string& state, const string& speed, void* payload);
+    void* mPayload;
+    unique_ptr<thread> mWatch;
+
+    // Rereads state and current_speed, returns true if either changed.
+    // Sets *lost if the state cannot be read, i.e. the UDC went away.
+    bool refresh(bool* lost = nullptr);
+    // Waits for the UDC to come back after its state could not be read.
+    // Returns false on shutdown.
+    bool reopen(struct pollfd* stateFd);
+
+  public:
+    UdcWatcher(const char* const udc);
+    ~UdcWatcher();
+    // Reads the initial values and starts watching. Returns false if the
+    // UDC has no state attribute.
+    bool start();
+    bool isRunning();
+    // Registers the callback invoked on every change of state or speed.
+    void registerListener(void (*listener)(const string& state, const string& speed,
+                                           void* payload),
+                          void* payload);
+    // Last values read, e.g. "configured" and "high-speed".
+    string state();
+    string speed();
+    static void* watch(void* param);
+};
+
+//**************** Function composition ************************//
+
+// A USB function the gadget can expose.
+struct FunctionDesc {
+    int64_t function;
+    // Directory below functions/. vendor.usb.rndis.config overrides it for
+    // RNDIS.
+    const char* configfsName;
+    // FunctionFS instance below the FFS root, nullptr for kernel functions.
+    const char* ffsName;
+    // Endpoint files the FFS daemon creates once it wrote its descriptors.
+    int ffsEndpoints;
+    // Functions it cannot be combined with.
+    int64_t excludes;
+};
+
+// Accessory mode (AOA) has fixed product IDs and only goes along with ADB.
+constexpr int64_t kAoaFunctions = GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE;
+constexpr int64_t kNonAoaFunctions = GadgetFunction::MTP | GadgetFunction::PTP |
+                                     GadgetFunction::MIDI | GadgetFunction::RNDIS |
+                                     GadgetFunction::NCM;
+
+// In configfs link order. ADB goes last so that the other interfaces keep
+// their numbers with and without it.
+constexpr FunctionDesc kFunctions[] = {
+        {GadgetFunction::MTP, "ffs.mtp", "mtp", 3, GadgetFunction::PTP | kAoaFunctions},
+        {GadgetFunction::PTP, "ffs.ptp", "ptp", 3, GadgetFunction::MTP | kAoaFunctions},
+        {GadgetFunction::MIDI, "midi.gs5", nullptr, 0, kAoaFunctions},
+        {GadgetFunction::ACCESSORY, "accessory.gs2", nullptr, 0, kNonAoaFunctions},
+        {GadgetFunction::AUDIO_SOURCE, "audio_source.gs3", nullptr, 0, kNonAoaFunctions},
+        {GadgetFunction::RNDIS, "gsi.rndis", nullptr, 0, GadgetFunction::NCM | kAoaFunctions},
+        {GadgetFunction::NCM, "ncm.gs6", nullptr, 0, GadgetFunction::RNDIS | kAoaFunctions},
+        {GadgetFunction::ADB, "ffs.adb", "adb", 2, 0},
+};
+constexpr size_t kFunctionCount = sizeof(kFunctions) / sizeof(kFunctions[0]);
+
+// Vendor bulk function served by usb_bulk_rpi. It has no GadgetFunction bit,
+// it is added to every composition while kBulkProperty is set and the daemon
+// has written its descriptors.
+constexpr FunctionDesc kBulkFunction = {GadgetFunction::NONE, "ffs.bulk", "bulk", 2, 0};
+constexpr char kBulkProperty[] = "persist.vendor.usb.bulk";
+
+// Tuning of the u_ether based tethering functions, written before they are
+// linked. Each value can be overridden with vendor.usb.<tag>.<attribute>,
+// 0 keeps the kernel default.
+struct EtherProfile {
+    int64_t function;
+    const char* tag;
+    // USB requests queued per direction at high speed, in multiples of the
+    // full speed queue. More requests keep the dwc2 DMA busy between
+    // completions.
+    int qmult;
+    // NCM only: largest Ethernet frame offered to the host. Frames larger
+    // than 1514 bytes need a kernel with the max_segment_size attribute.
+    int maxSegmentSize;
+};
+constexpr EtherProfile kEtherProfiles[] = {
+        {GadgetFunction::RNDIS, "rndis", 10, 0},
+        {GadgetFunction::NCM, "ncm", 10, 0},
+};
+
+// Counters of the network interface behind a u_ether function.
+struct EtherStats {
+    string ifname;
+    uint64_t rxBytes;
+    uint64_t txBytes;
+    uint64_t rxPackets;
+    uint64_t txPackets;
+    uint64_t rxDropped;
+    uint64_t txDropped;
+    steady_clock::time_point sampled;
+};
+
+constexpr char kVendorId[] = "0x18d1";
+
+// Product IDs of the single functions and of the compositions hosts already
+// know. Any other supported composition gets kCompositeProductId with one
+// bit per kFunctions entry. Compositions with kBulkFunction get
+// kBulkProductId with the same bits instead: its interface comes before
+// ADB's, so they must not reuse an ID hosts bind by interface number.
+struct ProductId {
+    int64_t functions;
+    int productId;
+};
+constexpr ProductId kProductIds[] = {
+        {GadgetFunction::MTP, 0x4ee1},
+        {GadgetFunction::ADB | GadgetFunction::MTP, 0x4ee2},
+        {GadgetFunction::RNDIS, 0x4ee3},
+        {GadgetFunction::ADB | GadgetFunction::RNDIS, 0x4ee4},
+        {GadgetFunction::PTP, 0x4ee5},
+        {GadgetFunction::ADB | GadgetFunction::PTP, 0x4ee6},
+        {GadgetFunction::ADB, 0x4ee7},
+        {GadgetFunction::MIDI, 0x4ee8},
+        {GadgetFunction::ADB | GadgetFunction::MIDI, 0x4ee9},
+        {GadgetFunction::NCM, 0x4eeb},
+        {GadgetFunction::ADB | GadgetFunction::NCM, 0x4eec},
+        {GadgetFunction::ACCESSORY, 0x2d00},
+        {GadgetFunction::ADB | GadgetFunction::ACCESSORY, 0x2d01},
+        {GadgetFunction::AUDIO_SOURCE, 0x2d02},
+        {GadgetFunction::ADB | GadgetFunction::AUDIO_SOURCE, 0x2d03},
+        {GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE, 0x2d04},
+        {GadgetFunction::ADB | GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE, 0x2d05},
+};
+constexpr int kCompositeProductId = 0x4f00;
+constexpr int kBulkProductId = 0x4d00;
+
+constexpr int64_t allFunctions() {
+    int64_t all = 0;
+    for (const FunctionDesc& desc : kFunctions) all |= desc.function;
+    return all;
+}
+
+// Whether the functions can be exposed together.
+constexpr bool isSupportedComposition(int64_t functions) {
+    if (functions == GadgetFunction::NONE || (functions & ~allFunctions()) != 0) return false;
+
+    for (const FunctionDesc& desc : kFunctions) {
+        if ((functions & desc.function) != 0 && (functions & desc.excludes) != 0) return false;
+    }
+    return true;
+}
+
+// Product ID for the functions, with kBulkFunction if bulk is set, -1 if
+// they cannot be combined.
+constexpr int productIdFor(int64_t functions, bool bulk = false) {
+    if (!isSupportedComposition(functions)) return -1;
+
+    for (const ProductId& known : kProductIds) {
+        if (!bulk && known.functions == functions) return known.productId;
+    }
+
+    int productId = bulk ? kBulkProductId : kCompositeProductId;
+    for (size_t i = 0; i < kFunctionCount; i++) {
+        if ((functions & kFunctions[i].function) != 0) productId |= 1 << i;
+    }
+    return productId;
+}
+
 //**************** Helper functions ************************//
 
+// Signals changes of the UDC state where the state attribute cannot, e.g.
+// a regular file standing in for it. Each change bumps generation().
+class UdcStateNotifier {
+  public:
+    virtual ~UdcStateNotifier() = default;
+    virtual uint64_t generation() = 0;
+    // Waits up to timeoutMs for generation() to move past since.
+    virtual void waitForChange(uint64_t since, int timeoutMs) = 0;
+};
+
+// Points the helpers at another gadget, FunctionFS, UDC and net class tree,
+// e.g. an emulated one on a tmpfs. Each root ends with '/'. Not thread
+// safe, call it before anything else in here.
+void setGadgetRoots(const string& gadget, const string& ffs, const string& udcClass,
+                    const string& netClass = kNetClassRoot);
+// Has waitForUdcState() wait on notifier instead of polling the state
+// attribute, nullptr to poll again. Same rules as setGadgetRoots().
+void setUdcStateNotifier(UdcStateNotifier* notifier);
+// Path of leaf below the gadget root.
+string gadgetPath(const char* leaf);
+// Path of leaf below the FunctionFS root, e.g. "adb/ep1".
+string ffsPath(const char* leaf);
+// Path of the attribute of the given UDC.
+string udcPath(const char* udc, const char* attribute);
+
 // Adds the given fd to the epollfd(epfd).
 int addEpollFd(const unique_fd& epfd, const unique_fd& fd);
-// Removes all the usb functions link in the specified path.
-int unlinkFunctions(const char* path);
-// Craetes a configfs link for the function.
+// Removes the usb function links in the specified path, starting with
+// function<first>.
+int unlinkFunctions(const char* path, int first = 0);
+// Craetes a configfs link for the function. An existing link at index is
+// kept if it already points to the function, otherwise it and every link
+// after it are removed first, so the function order stays as requested.
 int linkFunction(const char* function, int index);
+// Writes value to path unless the file already holds it.
+bool writeIfChanged(const string& value, const string& path);
+// Waits up to timeoutMs for the UDC to report state, e.g. "not attached".
+bool waitForUdcState(const char* udc, const char* state, int timeoutMs);
 // Sets the USB VID and PID.
 Status setVidPid(const char* vid, const char* pid);
 // Extracts vendor functions from the vendor init properties.
 std::string getVendorFunctions();
+// Directory of the function below functions/.
+string functionName(const FunctionDesc& desc);
+// Writes the EtherProfile of a tethering function, no-op for the others.
+// Attributes the kernel lacks are skipped.
+void applyEtherProfile(const FunctionDesc& desc);
+// Reads the interface counters of a linked tethering function.
+bool readEtherStats(const FunctionDesc& desc, EtherStats* stats);
+// Whether the daemon behind a FunctionFS function has written its
+// descriptors, i.e. all its endpoints exist.
+bool ffsEndpointsPresent(const FunctionDesc& desc);
+// Links the function and, for FunctionFS ones, has monitorFfs watch its
+// endpoints.
+Status addFunction(MonitorFfs* monitorFfs, const FunctionDesc& desc, int* functionCount);
 // Adds Adb to the usb configuration.
 Status addAdb(MonitorFfs* monitorFfs, int* functionCount);
-// Adds all applicable generic android usb functions other than ADB.
+// Adds all requested functions of kFunctions other than ADB, in table
+// order.
 Status addGenericAndroidFunctions(MonitorFfs* monitorFfs, uint64_t functions, bool* ffsEnabled,
                                   int* functionCount);
-// Pulls down USB gadget.
+// Pulls down USB gadget, and waits for the UDC to drop off the bus.
+Status pullDownGadget(const char* udc);
+// Pulls down USB gadget and removes all functions.
 Status resetGadget();
 
 }  // namespace gadget
@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "usb_gadget_emulator_rpi"
+
+#include "GadgetEmulator.h"
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+// Every function the HAL may link, kBulkFunction included.
+static vector<const FunctionDesc*> allDescs() {
+    vector<const FunctionDesc*> descs;
+    for (const FunctionDesc& desc : kFunctions) descs.push_back(&desc);
+    descs.push_back(&kBulkFunction);
+    return descs;
+}
+
+static bool makeDir(const string& path) {
+    if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST) return true;
+    ALOGE("Cannot create %s errno:%d", path.c_str(), errno);
+    return false;
+}
+
+// Creates path and every missing directory above it.
+static bool makeDirs(const string& path) {
+    for (size_t slash = path.find('/', 1); slash != string::npos;
+         slash = path.find('/', slash + 1)) {
+        if (!makeDir(path.substr(0, slash))) return false;
+    }
+    return makeDir(path);
+}
+
+static bool makeFile(const string& path, const string& value) {
+    if (WriteStringToFile(value, path)) return true;
+    ALOGE("Cannot create %s errno:%d", path.c_str(), errno);
+    return false;
+}
+
+string scratchDir(const char* name) {
+    const char* base = access("/data/local/tmp", W_OK) == 0 ? "/data/local/tmp" : "/tmp";
+    string dir = string(base) + "/" + name + ".XXXXXX";
+
+    if (mkdtemp(&dir[0]) == NULL) {
+        ALOGE("Cannot create %s errno:%d", dir.c_str(), errno);
+        return "";
+    }
+    return dir + "/";
+}
+
+GadgetEmulator::GadgetEmulator(const string& root, const char* udc)
+    : mRoot(root),
+      mUdc(udc),
+      mMounted(false),
+      mUdcWatch(-1),
+      mConfigWatch(-1),
+      mFfsDelayMs(0),
+      mStateGeneration(0) {}
+
+GadgetEmulator::~GadgetEmulator() {
+    setUdcStateNotifier(nullptr);
+    if (mEmulator) {
+        uint64_t wake = 1;
+        if (TEMP_FAILURE_RETRY(write(mEventFd, &wake, sizeof(wake))) < 0)
+            ALOGE("Error writing eventfd errno=%d", errno);
+        mEmulator->join();
+    }
+    if (mMounted && umount2(mRoot.c_str(), MNT_DETACH))
+        ALOGE("Cannot unmount %s errno:%d", mRoot.c_str(), errno);
+}
+
+string GadgetEmulator::udcDir() {
+    return mRoot + "udc/" + mUdc + "/";
+}
+
+bool GadgetEmulator::start() {
+    if (!makeDirs(mRoot.substr(0, mRoot.size() - 1))) return false;
+    // A plain directory does as well, only slower.
+    mMounted = mount("tmpfs", mRoot.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") == 0;
+    if (!mMounted) ALOGI("%s not mounted as tmpfs errno:%d", mRoot.c_str(), errno);
+
+    string gadget = mRoot + "gadget/";
+    string ffs = mRoot + "ffs/";
+    string udcClass = mRoot + "udc/";
+    string netClass = mRoot + "net/";
+    setGadgetRoots(gadget, ffs, udcClass, netClass);
+    setUdcStateNotifier(this);
+
+    if (!makeDirs(gadgetPath(kConfigDir)) || !makeDirs(gadgetPath(kOsDescDir)) ||
+        !makeFile(gadgetPath(kDescUseFile), "0") || !makeFile(gadgetPath(kPullUpFile), "") ||
+        !makeFile(gadgetPath(kVendorIdFile), "0x0000") ||
+        !makeFile(gadgetPath(kProductIdFile), "0x0000") ||
+        !makeFile(gadgetPath(kDeviceClassFile), "0x00") ||
+        !makeFile(gadgetPath(kDeviceSubClassFile), "0x00") ||
+        !makeFile(gadgetPath(kDeviceProtocolFile), "0x00"))
+        return false;
+
+    for (const FunctionDesc* desc : allDescs()) {
+        string dir = gadgetPath(kFunctionsDir) + functionName(*desc) + "/";
+        if (!makeDirs(dir)) return false;
+        if (desc->ffsName != nullptr && !makeDirs(ffsPath(desc->ffsName))) return false;
+    }
+
+    for (const EtherProfile& profile : kEtherProfiles) {
+        for (const FunctionDesc& desc : kFunctions) {
+            if (desc.function != profile.function) continue;
+
+            string dir = gadgetPath(kFunctionsDir) + functionName(desc) + "/";
+            string ifname = string(profile.tag) + "0";
+            if (!makeFile(dir + "ifname", ifname) || !makeFile(dir + "qmult", "5") ||
+                !makeFile(dir + "dev_addr", "") || !makeFile(dir + "host_addr", ""))
+                return false;
+            if (desc.function == GadgetFunction::NCM &&
+                !makeFile(dir + "max_segment_size", "1514"))
+                return false;
+
+            string statistics = netClass + ifname + "/statistics/";
+            if (!makeDirs(statistics.substr(0, statistics.size() - 1))) return false;
+            for (const char* counter : {"rx_bytes", "tx_bytes", "rx_packets", "tx_packets",
+                                        "rx_dropped", "tx_dropped"}) {
+                if (!makeFile(statistics + counter, "0")) return false;
+            }
+        }
+    }
+
+    if (!makeDirs(udcDir().substr(0, udcDir().size() - 1))) return false;
+    setUdcState("not attached", "UNKNOWN");
+
+    mInotifyFd.reset(inotify_init1(IN_CLOEXEC));
+    mEventFd.reset(eventfd(0, EFD_CLOEXEC));
+    if (mInotifyFd < 0 || mEventFd < 0) {
+        ALOGE("Cannot create the emulator fds errno:%d", errno);
+        return false;
+    }
+    mUdcWatch = inotify_add_watch(mInotifyFd, gadget.c_str(), IN_CLOSE_WRITE);
+    mConfigWatch = inotify_add_watch(mInotifyFd, gadgetPath(kConfigDir).c_str(), IN_CREATE);
+    if (mUdcWatch < 0 || mConfigWatch < 0) {
+        ALOGE("Cannot watch the gadget errno:%d", errno);
+        return false;
+    }
+
+    mEmulator = unique_ptr<thread>(new thread(this->emulate, this));
+    return true;
+}
+
+void GadgetEmulator::setFfsDelayMs(int delayMs) {
+    lock_guard<mutex> lock(mLock);
+    mFfsDelayMs = delayMs;
+}
+
+void GadgetEmulator::stopDaemons() {
+    lock_guard<mutex> lock(mLock);
+    mPending.clear();
+    for (const FunctionDesc* desc : allDescs()) {
+        if (desc->ffsName == nullptr) continue;
+        for (int ep = 1; ep <= desc->ffsEndpoints; ep++)
+            unlink((ffsPath(desc->ffsName) + "/ep" + std::to_string(ep)).c_str());
+    }
+}
+
+string GadgetEmulator::readGadgetFile(const char* leaf) {
+    string value;
+    ::android::base::ReadFileToString(gadgetPath(leaf), &value);
+    return ::android::base::Trim(value);
+}
+
+vector<string> GadgetEmulator::linkedFunctions() {
+    vector<std::pair<int, string>> links;
+    string config = gadgetPath(kConfigDir);
+    DIR* dir = opendir(config.c_str());
+    struct dirent* entry;
+    char target[kMaxFilePathLength];
+
+    if (dir == NULL) return {};
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, FUNCTION_NAME, strlen(FUNCTION_NAME)) != 0) continue;
+        ssize_t len = readlink((config + entry->d_name).c_str(), target, sizeof(target) - 1);
+        if (len < 0) continue;
+        target[len] = '\0';
+        const char* name = strrchr(target, '/');
+        links.emplace_back(atoi(entry->d_name + strlen(FUNCTION_NAME)), name ? name + 1 : target);
+    }
+    closedir(dir);
+
+    std::sort(links.begin(), links.end());
+    vector<string> functions;
+    for (const auto& link : links) functions.push_back(link.second);
+    return functions;
+}
+
+void GadgetEmulator::setUdcState(const char* state, const char* speed) {
+    WriteStringToFile(speed, udcDir() + "current_speed");
+    WriteStringToFile(state, udcDir() + "state");
+    {
+        lock_guard<mutex> lock(mStateLock);
+        mStateGeneration++;
+    }
+    mStateCv.notify_all();
+}
+
+uint64_t GadgetEmulator::generation() {
+    lock_guard<mutex> lock(mStateLock);
+    return mStateGeneration;
+}
+
+void GadgetEmulator::waitForChange(uint64_t since, int timeoutMs) {
+    std::unique_lock<mutex> lock(mStateLock);
+    mStateCv.wait_for(lock, timeoutMs * 1ms, [this, since] { return mStateGeneration != since; });
+}
+
+void GadgetEmulator::onUdcWritten() {
+    string udc = readGadgetFile(kPullUpFile);
+
+    if (udc == mUdc) {
+        setUdcState("configured", "high-speed");
+        return;
+    }
+    // configfs reads back empty once unbound. Truncating the file raises
+    // another event, which then finds it empty.
+    if (udc == "none") WriteStringToFile("", gadgetPath(kPullUpFile));
+    setUdcState("not attached", "UNKNOWN");
+}
+
+void GadgetEmulator::onFunctionLinked(const char* link) {
+    char target[kMaxFilePathLength];
+    ssize_t len = readlink((gadgetPath(kConfigDir) + link).c_str(), target, sizeof(target) - 1);
+    if (len < 0) return;
+    target[len] = '\0';
+    const char* name = strrchr(target, '/');
+    name = name ? name + 1 : target;
+
+    lock_guard<mutex> lock(mLock);
+    for (const FunctionDesc* desc : allDescs()) {
+        if (desc->ffsName == nullptr || functionName(*desc) != name) continue;
+        mPending.push_back({desc, steady_clock::now() + mFfsDelayMs * 1ms});
+    }
+}
+
+void GadgetEmulator::startDaemon(const FunctionDesc& desc) {
+    for (int ep = 1; ep <= desc.ffsEndpoints; ep++) {
+        string path = ffsPath(desc.ffsName) + "/ep" + std::to_string(ep);
+        if (access(path.c_str(), F_OK) == 0) continue;
+        unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644)));
+        if (fd < 0) ALOGE("Cannot create %s errno:%d", path.c_str(), errno);
+    }
+}
+
+int GadgetEmulator::runPendingDaemons() {
+    lock_guard<mutex> lock(mLock);
+    steady_clock::time_point now = steady_clock::now();
+    int timeout = -1;
+
+    for (auto it = mPending.begin(); it != mPending.end();) {
+        if (it->due <= now) {
+            startDaemon(*it->desc);
+            it = mPending.erase(it);
+            continue;
+        }
+        int remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(it->due - now).count() + 1;
+        timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+        ++it;
+    }
+    return timeout;
+}
+
+void* GadgetEmulator::emulate(void* param) {
+    GadgetEmulator* emulator = (GadgetEmulator*)param;
+    char buf[kBufferSize] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {{emulator->mInotifyFd, POLLIN, 0}, {emulator->mEventFd, POLLIN, 0}};
+
+    for (;;) {
+        int timeout = emulator->runPendingDaemons();
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, timeout)) < 0) {
+            ALOGE("poll on the emulated gadget failed errno:%d", errno);
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN) return NULL;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        ssize_t numRead = TEMP_FAILURE_RETRY(read(emulator->mInotifyFd, buf, sizeof(buf)));
+        for (char* p = buf; numRead > 0 && p < buf + numRead;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0) continue;
+
+            if (event->wd == emulator->mUdcWatch && strcmp(event->name, kPullUpFile) == 0)
+                emulator->onUdcWritten();
+            else if (event->wd == emulator->mConfigWatch)
+                emulator->onFunctionLinked(event->name);
+        }
+    }
+}
+
+::ndk::ScopedAStatus RecordingCallback::setCurrentUsbFunctionsCb(int64_t /* functions */,
+                                                                Status status,
+                                                                int64_t transactionId) {
+    lock_guard<mutex> lock(mLock);
+    mResults[transactionId] = status;
+    mCv.notify_all();
+    return ::ndk::ScopedAStatus::ok();
+}
+
+::ndk::ScopedAStatus RecordingCallback::getCurrentUsbFunctionsCb(int64_t functions,
+                                                                Status status,
+                                                                int64_t /* transactionId */) {
+    lock_guard<mutex> lock(mLock);
+    mCurrentFunctions = functions;
+    mCurrentStatus = status;
+    return ::ndk::ScopedAStatus::ok();
+}
+
+::ndk::ScopedAStatus RecordingCallback::getUsbSpeedCb(UsbSpeed /* speed */,
+                                                     int64_t /* transactionId */) {
+    return ::ndk::ScopedAStatus::ok();
+}
+
+::ndk::ScopedAStatus RecordingCallback::resetCb(Status status, int64_t transactionId) {
+    lock_guard<mutex> lock(mLock);
+    mResults[transactionId] = status;
+    mCv.notify_all();
+    return ::ndk::ScopedAStatus::ok();
+}
+
+bool RecordingCallback::waitFor(int64_t transactionId, int timeoutMs, Status* status) {
+    std::unique_lock<mutex> lk(mLock);
+    if (!mCv.wait_for(lk, timeoutMs * 1ms,
+                      [this, transactionId] { return mResults.count(transactionId) != 0; }))
+        return false;
+    *status = mResults[transactionId];
+    mResults.erase(transactionId);
+    return true;
+}
+
+int64_t RecordingCallback::currentFunctions() {
+    lock_guard<mutex> lock(mLock);
+    return mCurrentFunctions;
+}
+
+Status RecordingCallback::currentStatus() {
+    lock_guard<mutex> lock(mLock);
+    return mCurrentStatus;
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <UsbGadgetCommon.h>
+#include <aidl/android/hardware/usb/gadget/BnUsbGadgetCallback.h>
+
+#include <map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+// Emulates the configfs gadget, the FunctionFS instances and the UDC class
+// directory as plain files below a scratch directory, a tmpfs when running
+// as root, and points setGadgetRoots() at them:
+//
+// - Writing the UDC name to the gadget's UDC file binds it, the UDC state
+//   turns "configured" at high speed. Writing "none" unbinds it, the file
+//   reads back empty and the state turns "not attached".
+// - The daemon behind a FunctionFS instance writes its descriptors, i.e. its
+//   endpoint files show up, ffsDelayMs after the function is linked into the
+//   configuration. Like adbd they then stay, until stopDaemons().
+// - The tethering functions get their attributes and a net class interface
+//   with zeroed counters.
+//
+// The UDC state is a regular file, so poll() never reports a change. The
+// emulator installs itself as the UdcStateNotifier instead, which wakes up
+// waitForUdcState() as soon as it updated the state. UdcWatcher still polls
+// and keeps the speed it read at start.
+class GadgetEmulator : public UdcStateNotifier {
+  public:
+    // root ends with '/', udc is the name of the emulated UDC.
+    GadgetEmulator(const string& root, const char* udc);
+    ~GadgetEmulator() override;
+
+    // Builds the tree and starts emulating. Returns false if the tree
+    // cannot be created.
+    bool start();
+    // Delay of the emulated FunctionFS daemons, 0 by default.
+    void setFfsDelayMs(int delayMs);
+    // Takes down the endpoints of every FunctionFS instance.
+    void stopDaemons();
+
+    // Contents of the file below the gadget root, trimmed.
+    string readGadgetFile(const char* leaf);
+    // Directories below functions/ linked into the configuration, in link
+    // order.
+    vector<string> linkedFunctions();
+
+    uint64_t generation() override;
+    void waitForChange(uint64_t since, int timeoutMs) override;
+
+  private:
+    struct PendingDaemon {
+        const FunctionDesc* desc;
+        steady_clock::time_point due;
+    };
+
+    const string mRoot;
+    const char* const mUdc;
+    bool mMounted;
+    unique_fd mInotifyFd;
+    // Wakes up mEmulator for shutdown.
+    unique_fd mEventFd;
+    int mUdcWatch;
+    int mConfigWatch;
+
+    // protects the daemon delay and the pending daemons.
+    std::mutex mLock;
+    int mFfsDelayMs;
+    vector<PendingDaemon> mPending;
+    unique_ptr<thread> mEmulator;
+
+    // protects the UDC state generation.
+    std::mutex mStateLock;
+    std::condition_variable mStateCv;
+    uint64_t mStateGeneration;
+
+    string udcDir();
+    void setUdcState(const char* state, const char* speed);
+    void onUdcWritten();
+    void onFunctionLinked(const char* link);
+    void startDaemon(const FunctionDesc& desc);
+    // Milliseconds to the next pending daemon, -1 if there is none.
+    int runPendingDaemons();
+    static void* emulate(void* param);
+};
+
+// Creates a fresh directory for a GadgetEmulator below /data/local/tmp, or
+// /tmp off device. Returns it with a trailing '/', empty on failure.
+string scratchDir(const char* name);
+
+// Keeps the status of every setCurrentUsbFunctionsCb and resetCb by
+// transaction id, for the caller to wait on.
+class RecordingCallback : public BnUsbGadgetCallback {
+  public:
+    ::ndk::ScopedAStatus setCurrentUsbFunctionsCb(int64_t functions, Status status,
+                                                  int64_t transactionId) override;
+    ::ndk::ScopedAStatus getCurrentUsbFunctionsCb(int64_t functions, Status status,
+                                                  int64_t transactionId) override;
+    ::ndk::ScopedAStatus getUsbSpeedCb(UsbSpeed speed, int64_t transactionId) override;
+    ::ndk::ScopedAStatus resetCb(Status status, int64_t transactionId) override;
+
+    // Waits up to timeoutMs for the callback of transactionId. Returns false
+    // on timeout.
+    bool waitFor(int64_t transactionId, int timeoutMs, Status* status);
+    // Functions and status of the last getCurrentUsbFunctionsCb.
+    int64_t currentFunctions();
+    Status currentStatus();
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::map<int64_t, Status> mResults;
+    int64_t mCurrentFunctions = GadgetFunction::NONE;
+    Status mCurrentStatus = Status::ERROR;
+};
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "usb_gadget_emulation_test_rpi"
+
+#include <gtest/gtest.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "GadgetEmulator.h"
+#include "UsbGadget.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+constexpr int kSwitchTimeoutMs = 2000;
+// The emulated UDC follows writes to the UDC file on its own thread.
+constexpr int kUdcTimeoutMs = 100;
+
+class UsbGadgetEmulationTest : public ::testing::Test {
+  protected:
+    // The gadget roots are process wide, so is the emulated tree.
+    static void SetUpTestSuite() {
+        string root = scratchDir("usb_gadget_emulation_test");
+        ASSERT_FALSE(root.empty());
+        sEmulator = new GadgetEmulator(root, kGadgetName);
+        ASSERT_TRUE(sEmulator->start());
+    }
+
+    static void TearDownTestSuite() {
+        delete sEmulator;
+        sEmulator = nullptr;
+    }
+
+    void SetUp() override {
+        ASSERT_NE(sEmulator, nullptr);
+        sEmulator->setFfsDelayMs(0);
+        mGadget = ::ndk::SharedRefBase::make<UsbGadget>();
+        mCallback = ::ndk::SharedRefBase::make<RecordingCallback>();
+    }
+
+    void TearDown() override {
+        Status status;
+        mGadget->setCurrentUsbFunctions(GadgetFunction::NONE, mCallback, kSwitchTimeoutMs,
+                                        ++mTransactionId);
+        EXPECT_TRUE(mCallback->waitFor(mTransactionId, kSwitchTimeoutMs, &status));
+        mGadget.reset();
+    }
+
+    Status setFunctions(int64_t functions) {
+        Status status = Status::ERROR;
+        mGadget->setCurrentUsbFunctions(functions, mCallback, kSwitchTimeoutMs, ++mTransactionId);
+        EXPECT_TRUE(mCallback->waitFor(mTransactionId, kSwitchTimeoutMs, &status))
+                << "no callback for 0x" << std::hex << functions;
+        return status;
+    }
+
+    // configfs directories of the functions, in the order they get linked.
+    static vector<string> expectedLinks(int64_t functions) {
+        vector<string> links;
+        for (const FunctionDesc& desc : kFunctions) {
+            if ((functions & desc.function) != 0) links.push_back(functionName(desc));
+        }
+        return links;
+    }
+
+    static GadgetEmulator* sEmulator;
+    shared_ptr<UsbGadget> mGadget;
+    shared_ptr<RecordingCallback> mCallback;
+    int64_t mTransactionId = 0;
+};
+
+GadgetEmulator* UsbGadgetEmulationTest::sEmulator = nullptr;
+
+TEST_F(UsbGadgetEmulationTest, EveryCompositionComesUp) {
+    for (int64_t functions = 1; functions <= allFunctions(); functions++) {
+        int productId = productIdFor(functions);
+        if (productId < 0) continue;
+        SCOPED_TRACE(::android::base::StringPrintf("functions 0x%" PRIx64, functions));
+
+        ASSERT_EQ(setFunctions(functions), Status::SUCCESS);
+        EXPECT_EQ(sEmulator->readGadgetFile(kProductIdFile),
+                  ::android::base::StringPrintf("0x%04x", productId));
+        EXPECT_EQ(sEmulator->linkedFunctions(), expectedLinks(functions));
+        EXPECT_EQ(sEmulator->readGadgetFile(kPullUpFile), kGadgetName);
+        EXPECT_TRUE(waitForUdcState(kGadgetName, "configured", kUdcTimeoutMs));
+
+        mGadget->getCurrentUsbFunctions(mCallback, ++mTransactionId);
+        EXPECT_EQ(mCallback->currentFunctions(), functions);
+        EXPECT_EQ(mCallback->currentStatus(), Status::FUNCTIONS_APPLIED);
+    }
+}
+
+TEST_F(UsbGadgetEmulationTest, UnsupportedCompositionKeepsFunctions) {
+    ASSERT_EQ(setFunctions(GadgetFunction::ADB | GadgetFunction::MTP), Status::SUCCESS);
+
+    EXPECT_EQ(setFunctions(GadgetFunction::MTP | GadgetFunction::PTP),
+              Status::CONFIGURATION_NOT_SUPPORTED);
+    EXPECT_EQ(sEmulator->linkedFunctions(),
+              expectedLinks(GadgetFunction::ADB | GadgetFunction::MTP));
+    EXPECT_EQ(sEmulator->readGadgetFile(kPullUpFile), kGadgetName);
+}
+
+TEST_F(UsbGadgetEmulationTest, PullUpWaitsForFfsDaemon) {
+    constexpr int kDelayMs = 200;
+    ASSERT_EQ(setFunctions(GadgetFunction::NONE), Status::SUCCESS);
+    sEmulator->stopDaemons();
+    sEmulator->setFfsDelayMs(kDelayMs);
+
+    steady_clock::time_point start = steady_clock::now();
+    ASSERT_EQ(setFunctions(GadgetFunction::ADB), Status::SUCCESS);
+    EXPECT_GE(steady_clock::now() - start, kDelayMs * 1ms);
+    EXPECT_EQ(sEmulator->readGadgetFile(kPullUpFile), kGadgetName);
+}
+
+TEST_F(UsbGadgetEmulationTest, MissingFfsDaemonTimesOut) {
+    ASSERT_EQ(setFunctions(GadgetFunction::NONE), Status::SUCCESS);
+    sEmulator->stopDaemons();
+    sEmulator->setFfsDelayMs(kSwitchTimeoutMs * 2);
+
+    Status status = Status::SUCCESS;
+    mGadget->setCurrentUsbFunctions(GadgetFunction::ADB, mCallback, 100, ++mTransactionId);
+    ASSERT_TRUE(mCallback->waitFor(mTransactionId, kSwitchTimeoutMs, &status));
+    EXPECT_EQ(status, Status::ERROR);
+    EXPECT_EQ(sEmulator->readGadgetFile(kPullUpFile), "");
+}
+
+TEST_F(UsbGadgetEmulationTest, NoneUnbindsAndUnlinks) {
+    ASSERT_EQ(setFunctions(GadgetFunction::ADB | GadgetFunction::NCM), Status::SUCCESS);
+
+    ASSERT_EQ(setFunctions(GadgetFunction::NONE), Status::SUCCESS);
+    EXPECT_TRUE(sEmulator->linkedFunctions().empty());
+    // The UDC file reads back empty before the state changes.
+    EXPECT_TRUE(waitForUdcState(kGadgetName, "not attached", kUdcTimeoutMs));
+    EXPECT_EQ(sEmulator->readGadgetFile(kPullUpFile), "");
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
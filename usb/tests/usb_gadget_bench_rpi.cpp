@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Switching latency of the gadget HAL over every composition productIdFor()
+// accepts, against the emulated gadget of GadgetEmulator:
+//
+//   usb_gadget_bench_rpi [rounds] [ffs daemon delay ms]
+//
+// Each composition is switched to once with its FunctionFS daemons down
+// (cold), then rounds times from ADB, or from no functions for ADB itself,
+// with the daemons up (warm). Latency runs from setCurrentUsbFunctions() to
+// its callback. The emulator wakes the HAL's UDC state waits itself, so no
+// poll() timeout is in there. The HAL dump at the end breaks the last
+// switches down into their stages.
+
+#define LOG_TAG "usb_gadget_bench_rpi"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include "GadgetEmulator.h"
+#include "UsbGadget.h"
+
+using namespace ::aidl::android::hardware::usb::gadget;
+
+constexpr int kDefaultRounds = 10;
+constexpr int kSwitchTimeoutMs = 5000;
+
+static int64_t sTransactionId = 0;
+
+// Milliseconds until the switch was called back, -1 if it failed.
+static double switchTo(UsbGadget* gadget, const shared_ptr<RecordingCallback>& callback,
+                       int64_t functions) {
+    Status status;
+    steady_clock::time_point start = steady_clock::now();
+
+    gadget->setCurrentUsbFunctions(functions, callback, kSwitchTimeoutMs, ++sTransactionId);
+    if (!callback->waitFor(sTransactionId, kSwitchTimeoutMs * 2, &status) ||
+        status != Status::SUCCESS)
+        return -1;
+    return std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : kDefaultRounds;
+    int ffsDelayMs = argc > 2 ? atoi(argv[2]) : 0;
+    if (rounds <= 0 || ffsDelayMs < 0) {
+        fprintf(stderr, "usage: %s [rounds] [ffs daemon delay ms]\n", argv[0]);
+        return 1;
+    }
+
+    string root = scratchDir("usb_gadget_bench");
+    if (root.empty()) return 1;
+    GadgetEmulator emulator(root, kGadgetName);
+    if (!emulator.start()) {
+        fprintf(stderr, "cannot emulate the gadget below %s\n", root.c_str());
+        return 1;
+    }
+    emulator.setFfsDelayMs(ffsDelayMs);
+
+    shared_ptr<UsbGadget> gadget = ::ndk::SharedRefBase::make<UsbGadget>();
+    shared_ptr<RecordingCallback> callback = ::ndk::SharedRefBase::make<RecordingCallback>();
+    int failures = 0;
+
+    printf("%d rounds, FunctionFS daemons up after %d ms, latency in ms\n", rounds, ffsDelayMs);
+    for (int64_t functions = 1; functions <= allFunctions(); functions++) {
+        int productId = productIdFor(functions);
+        if (productId < 0) continue;
+        int64_t from = functions == GadgetFunction::ADB ? GadgetFunction::NONE
+                                                        : GadgetFunction::ADB;
+
+        switchTo(gadget.get(), callback, GadgetFunction::NONE);
+        emulator.stopDaemons();
+        double cold = switchTo(gadget.get(), callback, functions);
+
+        vector<double> warm;
+        for (int i = 0; i < rounds; i++) {
+            if (switchTo(gadget.get(), callback, from) < 0) continue;
+            double ms = switchTo(gadget.get(), callback, functions);
+            if (ms >= 0) warm.push_back(ms);
+        }
+        std::sort(warm.begin(), warm.end());
+
+        failures += (cold < 0) + rounds - warm.size();
+        printf("0x%04" PRIx64 " pid 0x%04x: cold %6.1f, warm p50 %6.1f p90 %6.1f max %6.1f,"
+               " %zu failed\n",
+               functions, productId, cold, warm.empty() ? -1 : percentile(warm, 0.5),
+               warm.empty() ? -1 : percentile(warm, 0.9), warm.empty() ? -1 : warm.back(),
+               (cold < 0) + rounds - warm.size());
+    }
+
+    fflush(stdout);
+    gadget->dump(STDOUT_FILENO, nullptr, 0);
+    switchTo(gadget.get(), callback, GadgetFunction::NONE);
+    return failures == 0 ? 0 : 1;
+}